@@ -0,0 +1,729 @@
+// facialexps_bench: per-stage timings of the blendshape pipeline on
+// data/faces and data/weights. Run from the build directory.
+//
+//   facialexps_bench [--filter <substring>] [--samples <n>] [--min-time <ms>] [--csv]
+//
+// Every stage is warmed up, calibrated to at least --min-time per sample and
+// then sampled --samples times; the median is reported together with the
+// median absolute deviation, throughput and heap allocations per operation.
+// Steady-state stages (re-blending a frame into existing buffers) must not
+// allocate; the run fails with exit status 1 if one does.
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <arena.h>
+#include <basis.h>
+#include <blendshape.h>
+#include <bvh.h>
+#include <capture.h>
+#include <drivers.h>
+#include <landmarks.h>
+#include <lod.h>
+#include <meshlets.h>
+#include <pca.h>
+#include <skinning.h>
+#include <solver.h>
+#include <subdivision.h>
+#include <vertex_cache.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+// count every heap allocation in the process, aligned ones included
+static std::atomic<uint64_t> g_allocations{0};
+static bool g_failed = false;
+
+// every operator new lands here; the word before the block points at the
+// malloc'd origin, so aligned and unaligned blocks are freed the same way
+static void *counted_allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+{
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  alignment = std::max(alignment, alignof(std::max_align_t));
+  void *origin = std::malloc(size + alignment + sizeof(void *));
+  if (!origin)
+  {
+    return nullptr;
+  }
+  uintptr_t p = ((uintptr_t)origin + sizeof(void *) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  *(void **)(p - sizeof(void *)) = origin;
+  return (void *)p;
+}
+
+static void counted_release(void *p)
+{
+  if (p)
+  {
+    std::free(*(void **)((uintptr_t)p - sizeof(void *)));
+  }
+}
+
+void *operator new(size_t size)
+{
+  void *p = counted_allocate(size);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  return counted_allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return counted_allocate(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+  void *p = counted_allocate(size, (size_t)alignment);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+  return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return counted_allocate(size, (size_t)alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+  return counted_allocate(size, (size_t)alignment);
+}
+
+void operator delete(void *p) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  counted_release(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  counted_release(p);
+}
+
+struct Options
+{
+  std::string filter;
+  int samples = 15;
+  double min_time_ms = 20.0;
+  bool csv = false;
+};
+
+struct Result
+{
+  double median_ns;
+  double mad_ns;
+  double mb_per_s;
+  double allocs_per_op;
+};
+
+static double median(std::vector<double> values)
+{
+  std::sort(values.begin(), values.end());
+  size_t n = values.size();
+  return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+// run `op` `iterations` times and return the elapsed nanoseconds
+static double time_ns(const std::function<void()> &op, size_t iterations)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++)
+  {
+    op();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+}
+
+// steady: the stage must report zero allocations per operation
+static void run_stage(const Options &options, const std::string &name,
+                      double bytes_per_op, const std::function<void()> &op,
+                      bool steady = false)
+{
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos)
+  {
+    return;
+  }
+
+  // warm up, then double the batch until one sample takes long enough
+  op();
+  size_t iterations = 1;
+  while (time_ns(op, iterations) < options.min_time_ms * 1e6 && iterations < (1u << 24))
+  {
+    iterations *= 2;
+  }
+
+  std::vector<double> per_op;
+  per_op.reserve(options.samples);
+  uint64_t allocations = g_allocations.load();
+  for (int s = 0; s < options.samples; s++)
+  {
+    per_op.push_back(time_ns(op, iterations) / iterations);
+  }
+  allocations = g_allocations.load() - allocations;
+
+  Result result;
+  result.median_ns = median(per_op);
+  std::vector<double> deviations;
+  for (double t : per_op)
+  {
+    deviations.push_back(std::abs(t - result.median_ns));
+  }
+  result.mad_ns = median(deviations);
+  result.mb_per_s = bytes_per_op / result.median_ns * 1e3;
+  result.allocs_per_op = (double)allocations / ((double)iterations * options.samples);
+
+  if (options.csv)
+  {
+    std::printf("%s,%.1f,%.1f,%.2f,%.2f\n", name.c_str(), result.median_ns,
+                result.mad_ns, result.mb_per_s, result.allocs_per_op);
+  }
+  else
+  {
+    std::printf("%-18s %14.1f ns/op  +-%5.1f%%  %10.2f MB/s  %10.2f allocs/op\n",
+                name.c_str(), result.median_ns,
+                100.0 * result.mad_ns / result.median_ns, result.mb_per_s,
+                result.allocs_per_op);
+  }
+  if (steady && allocations != 0)
+  {
+    std::printf("FAIL: %s allocated %llu times in steady state\n", name.c_str(),
+                (unsigned long long)allocations);
+    g_failed = true;
+  }
+  std::fflush(stdout);
+}
+
+static double file_size(const std::string &path)
+{
+  return (double)std::filesystem::file_size(path);
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc)
+    {
+      options.filter = argv[++i];
+    }
+    else if (arg == "--samples" && i + 1 < argc)
+    {
+      options.samples = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (arg == "--min-time" && i + 1 < argc)
+    {
+      options.min_time_ms = std::atof(argv[++i]);
+    }
+    else if (arg == "--csv")
+    {
+      options.csv = true;
+    }
+    else
+    {
+      std::cout << "usage: facialexps_bench [--filter <substring>] [--samples <n>] "
+                   "[--min-time <ms>] [--csv]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  const std::string faces_path = "data/faces/";
+  const std::string weights_path = "data/weights/";
+
+  JobScheduler scheduler;
+
+  std::vector<std::vector<tinyobj::real_t>> all_weights;
+  for (const auto &file : list_weight_files(weights_path))
+  {
+    all_weights.push_back(get_weights(file.string().c_str()));
+  }
+  if (all_weights.empty())
+  {
+    std::cout << "ERROR::BENCH::NO_WEIGHTS: no *.weights files in " << weights_path << std::endl;
+    return 1;
+  }
+  const std::vector<tinyobj::real_t> &weights = all_weights.back();
+  size_t num_faces = weights.size();
+
+  Obj base_obj(faces_path + "base.obj");
+  std::vector<Obj> face_objs = load_face_objs(scheduler, faces_path, num_faces);
+
+  double basis_bytes = file_size(faces_path + "base.obj");
+  for (size_t i = 0; i < num_faces; i++)
+  {
+    basis_bytes += file_size(faces_path + std::to_string(i) + ".obj");
+  }
+  double vertex_bytes = base_obj.getVertices().size() * sizeof(tinyobj::real_t);
+
+  if (options.csv)
+  {
+    std::printf("stage,median_ns,mad_ns,mb_per_s,allocs_per_op\n");
+  }
+  else
+  {
+    std::printf("%zu targets, %zu vertices, %u workers\n", num_faces,
+                base_obj.getVertices().size() / 3, scheduler.size());
+  }
+
+  run_stage(options, "obj_parse", file_size(faces_path + "0.obj"), [&]()
+            { Obj obj(faces_path + "0.obj"); });
+
+  run_stage(options, "basis_load", basis_bytes, [&]()
+            {
+              Obj base(faces_path + "base.obj");
+              std::vector<Obj> faces = load_face_objs(scheduler, faces_path, num_faces);
+            });
+
+  // bytes read: the base plus every target
+  std::vector<tinyobj::real_t> result_vertices;
+  run_stage(options, "blend_single", vertex_bytes * (num_faces + 1), [&]()
+            { blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices); },
+            true);
+
+  run_stage(options, "blend_batch", vertex_bytes * (num_faces + 1) * all_weights.size(), [&]()
+            {
+              scheduler.parallel_for(0, all_weights.size(), 1, [&](size_t begin, size_t end)
+                                     {
+                                       std::vector<tinyobj::real_t> out;
+                                       for (size_t i = begin; i < end; i++)
+                                       {
+                                         blend_vertices(scheduler, base_obj, face_objs, all_weights[i], out);
+                                       }
+                                     });
+            });
+
+  // float SoA basis: only the x/y/z streams of the base and every target
+  BlendBasis basis(base_obj, face_objs);
+  float *streams = static_cast<float *>(
+      ::operator new(3 * basis.padded() * sizeof(float), std::align_val_t(BlendBasis::ALIGNMENT)));
+  run_stage(options, "blend_soa", basis.size_bytes(), [&]()
+            { basis.evaluate(scheduler, weights, streams); },
+            true);
+
+  // meshlet-skipping blend, for the benchmark weights and for an
+  // expression that only drives two mouth targets
+  {
+    ArenaScope load_scope;
+    MeshletBasis meshlets(basis, triangle_corners(base_obj, load_scope.resource()));
+    std::vector<tinyobj::real_t> mouth(num_faces, 0.0);
+    if (num_faces > 21)
+    {
+      mouth[20] = 1.0;
+      mouth[21] = 0.5;
+    }
+    const std::vector<tinyobj::real_t> *blends[] = {&weights, &mouth};
+    for (const std::vector<tinyobj::real_t> *blend : blends)
+    {
+      std::string name = blend == &weights ? "blend_meshlets" : "blend_meshlets_mouth";
+      run_stage(options, name, basis.size_bytes(), [&]()
+                { meshlets.evaluate(scheduler, *blend, streams); },
+                true);
+      if (!options.csv && (options.filter.empty() || name.find(options.filter) != std::string::npos))
+      {
+        std::printf("%-18s %zu of %zu meshlets active\n", "", meshlets.num_active(*blend), meshlets.size());
+      }
+    }
+
+    // BVH over the base triangles: rebuild vs full refit vs the refit of
+    // the mouth expression, which only visits nodes of its meshlets, and
+    // one packet of rays at the front of the face
+    std::pmr::vector<int> corners = triangle_corners(base_obj, load_scope.resource());
+    Bvh bvh(base_obj.getVertices(), corners, &meshlets);
+    run_stage(options, "bvh_build", (double)bvh.size_bytes(), [&]()
+              { Bvh rebuilt(base_obj.getVertices(), corners, &meshlets); });
+    basis.evaluate(scheduler, weights, streams);
+    run_stage(options, "bvh_refit", (double)bvh.size_bytes(), [&]()
+              { bvh.refit(streams, basis.padded()); },
+              true);
+    meshlets.evaluate(scheduler, mouth, streams);
+    bvh.refit(streams, basis.padded(), mouth);
+    run_stage(options, "bvh_refit_mouth", (double)bvh.size_bytes(), [&]()
+              { bvh.refit(streams, basis.padded(), mouth); },
+              true);
+    if (!options.csv && (options.filter.empty() || std::string("bvh_refit_mouth").find(options.filter) != std::string::npos))
+    {
+      std::printf("%-18s %zu of %zu nodes refit\n", "", bvh.num_refit(), bvh.num_nodes());
+    }
+    RayPacket packet, rays;
+    for (size_t l = 0; l < RayPacket::LANES; l++)
+    {
+      packet.set(l, glm::vec3(-14.0f + 4.0f * l, 110.0f, 200.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+    }
+    run_stage(options, "bvh_packet", (double)sizeof(RayPacket), [&]()
+              {
+                rays = packet;
+                bvh.intersect(rays);
+              },
+              true);
+  }
+
+  // blend fused with skinning on a synthetic four-joint neck/jaw chain,
+  // weighted by height so most vertices have several influences
+  {
+    const std::vector<tinyobj::real_t> &base = base_obj.getVertices();
+    std::string skin_path = (std::filesystem::temp_directory_path() / "facialexps_bench.skin").string();
+    {
+      std::ofstream skin_file(skin_path);
+      for (size_t v = 0; v < base.size() / 3; v++)
+      {
+        double t = std::min(1.0, std::max(0.0, (base[v * 3 + 1] - 80.0) / 60.0));
+        skin_file << v << " root " << 1 - t << " neck " << t * (1 - t) + 0.1 << " head " << t * t
+                  << " jaw " << (base[v * 3 + 2] > 5 && t < 0.5 ? 0.5 : 0.0) << "\n";
+      }
+    }
+    std::vector<SkinJoint> joints = {{"root", "-", {0, 80, 0}, {0, 0, 0}},
+                                     {"neck", "root", {0, 100, 0}, {15, 0, 5}},
+                                     {"head", "neck", {0, 120, 0}, {0, 25, 0}},
+                                     {"jaw", "head", {0, 105, 5}, {20, 0, 0}}};
+    SkinBinding binding(joints, skin_path, base.size() / 3);
+    std::filesystem::remove(skin_path);
+    for (SkinMethod method : {SKIN_LBS, SKIN_DQS})
+    {
+      SkinPose pose(binding, method);
+      pose.set(binding.preview());
+      std::string name = method == SKIN_LBS ? "blend_skin_lbs" : "blend_skin_dqs";
+      run_stage(options, name, basis.size_bytes(), [&]()
+                { basis.evaluate(scheduler, weights, streams, nullptr, &pose); },
+                true);
+    }
+  }
+  ::operator delete(streams, std::align_val_t(BlendBasis::ALIGNMENT));
+
+  // int16 deltas; accuracy is reported against the double path
+  QuantizedBasis quantized(basis);
+  streams = static_cast<float *>(
+      ::operator new(3 * quantized.padded() * sizeof(float), std::align_val_t(QuantizedBasis::ALIGNMENT)));
+  run_stage(options, "blend_q16", quantized.size_bytes(), [&]()
+            { quantized.evaluate(scheduler, weights, streams); },
+            true);
+  if (!options.csv && (options.filter.empty() || std::string("blend_q16").find(options.filter) != std::string::npos))
+  {
+    blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices);
+    std::vector<tinyobj::real_t> evaluated;
+    quantized.to_aos(streams, evaluated);
+    double blend_error = 0;
+    for (size_t i = 0; i < evaluated.size(); i++)
+    {
+      blend_error = std::max(blend_error, std::abs(evaluated[i] - result_vertices[i]));
+    }
+    std::printf("%-18s basis %zu KiB (float %zu KiB, double %zu KiB), max delta error %.3g, "
+                "max blend error %.3g\n",
+                "", quantized.size_bytes() / 1024, basis.size_bytes() / 1024,
+                (size_t)(vertex_bytes * num_faces) / 1024, quantized.max_error(), blend_error);
+  }
+  ::operator delete(streams, std::align_val_t(QuantizedBasis::ALIGNMENT));
+
+  // low-rank basis at 1% relative error
+  PcaBasis pca = PcaBasis::build(scheduler, basis, 0.01);
+  streams = static_cast<float *>(
+      ::operator new(3 * pca.padded() * sizeof(float), std::align_val_t(PcaBasis::ALIGNMENT)));
+  run_stage(options, "blend_pca", pca.size_bytes(), [&]()
+            { pca.evaluate(scheduler, weights, streams); },
+            true);
+  if (!options.csv && (options.filter.empty() || std::string("blend_pca").find(options.filter) != std::string::npos))
+  {
+    blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices);
+    std::vector<tinyobj::real_t> evaluated;
+    pca.to_aos(streams, evaluated);
+    double blend_error = 0;
+    for (size_t i = 0; i < evaluated.size(); i++)
+    {
+      blend_error = std::max(blend_error, std::abs(evaluated[i] - result_vertices[i]));
+    }
+    std::printf("%-18s %zu of %zu components, basis %zu KiB, relative error %.3g, "
+                "max blend error %.3g\n",
+                "", pca.num_components(), pca.num_targets(), pca.size_bytes() / 1024,
+                pca.relative_error(), blend_error);
+  }
+  ::operator delete(streams, std::align_val_t(PcaBasis::ALIGNMENT));
+
+  // inverse solve of a blended mesh; the bound is lifted since the sample
+  // weights exceed 1
+  WeightSolver solver(scheduler, basis);
+  SolveOptions solve_options;
+  solve_options.upper = 4.0;
+  blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices);
+  std::vector<tinyobj::real_t> fitted;
+  run_stage(options, "fit_solve", vertex_bytes + basis.size_bytes(), [&]()
+            { solver.solve(result_vertices, fitted, solve_options); },
+            true);
+  run_stage(options, "fit_batch", (vertex_bytes + basis.size_bytes()) * all_weights.size(), [&]()
+            {
+              std::vector<std::vector<tinyobj::real_t>> meshes(all_weights.size(), result_vertices);
+              std::vector<std::vector<tinyobj::real_t>> batch;
+              solver.solve_batch(scheduler, meshes, batch, solve_options);
+            });
+
+  // per-frame landmark tracking: every 23rd vertex, observed under a rigid
+  // motion of the blended head
+  std::vector<int> landmark_vertices;
+  for (size_t v = 0; v < base_obj.getVertices().size() / 3; v += 23)
+  {
+    landmark_vertices.push_back((int)v);
+  }
+  LandmarkFitter tracker(basis, landmark_vertices);
+  glm::dmat3 pose = glm::mat3_cast(glm::angleAxis(0.2, glm::normalize(glm::dvec3(0.3, 1.0, 0.1))));
+  glm::dvec3 offset(1.0, -2.0, 3.0);
+  std::vector<glm::dvec3> observed;
+  for (int v : landmark_vertices)
+  {
+    observed.push_back(pose * glm::dvec3(result_vertices[v * 3], result_vertices[v * 3 + 1],
+                                         result_vertices[v * 3 + 2]) +
+                       offset);
+  }
+  run_stage(options, "landmark_fit", (double)observed.size() * sizeof(glm::dvec3), [&]()
+            { tracker.fit(observed, solve_options); },
+            true);
+  if (!options.csv && (options.filter.empty() || std::string("landmark_fit").find(options.filter) != std::string::npos))
+  {
+    const LandmarkFit &fit = tracker.fit(observed, solve_options);
+    double weight_error = 0, rotation_error = 0;
+    for (size_t i = 0; i < weights.size(); i++)
+    {
+      weight_error = std::max(weight_error, std::abs(fit.weights[i] - weights[i]));
+    }
+    for (int c = 0; c < 3; c++)
+    {
+      rotation_error = std::max(rotation_error, glm::length(fit.rotation[c] - pose[c]));
+    }
+    std::printf("%-18s %zu landmarks, rms %.3g, max weight error %.3g, rotation error %.3g, "
+                "translation error %.3g\n",
+                "", observed.size(), fit.rms, weight_error, rotation_error,
+                glm::length(fit.translation - offset));
+  }
+
+  // a production-sized driver rig (15 controls, one driver per target)
+  // evaluated for a crowd of instances in one pass
+  std::vector<DriverControl> driver_controls;
+  std::vector<DriverSource> driver_sources;
+  for (int c = 0; c < 15; c++)
+  {
+    driver_controls.push_back({"c" + std::to_string(c), 0.0});
+  }
+  for (size_t t = 0; t < num_faces; t++)
+  {
+    std::string a = "c" + std::to_string(t % 15), b = "c" + std::to_string((t * 7 + 3) % 15);
+    std::string expressions[] = {"clamp(" + a + " * 1.5, 0, 1)", "pos(" + a + ")", "neg(" + a + ")",
+                                 "remap(" + a + ", 0.2, 0.8, 0, 1) * " + b,
+                                 "min(abs(" + a + "), max(" + b + ", 0.1))"};
+    driver_sources.push_back({(int)t, expressions[t % 5]});
+  }
+  DriverProgram drivers(driver_controls, driver_sources);
+  const size_t num_instances = 4096;
+  std::vector<double> instance_controls(num_instances * drivers.num_controls());
+  for (size_t i = 0; i < instance_controls.size(); i++)
+  {
+    instance_controls[i] = std::sin((double)i) * 1.2;
+  }
+  std::vector<double> instance_weights(num_instances * num_faces);
+  run_stage(options, "drivers", (double)(instance_controls.size() + instance_weights.size()) * sizeof(double), [&]()
+            { drivers.evaluate_batch(scheduler, instance_controls.data(), num_instances,
+                                     instance_weights.data(), num_faces); },
+            true);
+  if (!options.csv && (options.filter.empty() || std::string("drivers").find(options.filter) != std::string::npos))
+  {
+    std::printf("%-18s %zu instances, %zu drivers, %zu instructions\n",
+                "", num_instances, drivers.num_drivers(), drivers.num_instructions());
+  }
+
+  // Catmull-Clark stencils applied to a blended cage, per level
+  {
+    Obj cage(faces_path + "base.obj", false);
+    float *blended = static_cast<float *>(
+        ::operator new(3 * basis.padded() * sizeof(float), std::align_val_t(BlendBasis::ALIGNMENT)));
+    basis.evaluate(scheduler, weights, blended);
+    for (int level = 1; level <= SubdivisionStencils::MAX_LEVEL; level++)
+    {
+      SubdivisionStencils stencils(cage, level);
+      float *refined = static_cast<float *>(::operator new(
+          3 * stencils.padded() * sizeof(float), std::align_val_t(SubdivisionStencils::ALIGNMENT)));
+      std::string name = "subdivide_l" + std::to_string(level);
+      run_stage(options, name, (double)stencils.size_bytes(), [&]()
+                { stencils.apply(scheduler, blended, basis.padded(), refined); },
+                true);
+      if (!options.csv && (options.filter.empty() || name.find(options.filter) != std::string::npos))
+      {
+        std::printf("%-18s %zu vertices, %zu stencil entries (%zu KiB)\n", "", stencils.num_vertices(),
+                    stencils.num_entries(), stencils.size_bytes() / 1024);
+      }
+      ::operator delete(refined, std::align_val_t(SubdivisionStencils::ALIGNMENT));
+    }
+    ::operator delete(blended, std::align_val_t(BlendBasis::ALIGNMENT));
+  }
+
+  // QEM level-of-detail chain; vertex shader runs per crowd instance show
+  // what each level saves the GPU blend
+  {
+    ArenaScope scratch;
+    std::pmr::vector<int> corners = triangle_corners(base_obj, scratch.resource());
+    std::vector<std::vector<tinyobj::real_t>> targets;
+    for (const Obj &face : face_objs)
+    {
+      targets.push_back(face.getVertices());
+    }
+    run_stage(options, "lod_build", vertex_bytes * (num_faces + 1), [&]()
+              { LodChain chain(base_obj.getVertices(), corners, targets); });
+    if (!options.csv && (options.filter.empty() || std::string("lod_build").find(options.filter) != std::string::npos))
+    {
+      LodChain chain(base_obj.getVertices(), corners, targets);
+      size_t V = base_obj.getVertices().size() / 3;
+      for (size_t l = 0; l < chain.size(); l++)
+      {
+        std::vector<uint32_t> indices(chain.level(l).triangles);
+        optimize_vertex_cache(indices, V);
+        std::printf("%-18s level %zu: %zu triangles, %zu vertices, error %.3g, %.0f vertex shader runs\n", "",
+                    l, indices.size() / 3, chain.level(l).sources.size(), chain.level(l).error,
+                    acmr(indices, V) * (indices.size() / 3));
+      }
+    }
+  }
+
+  std::vector<tinyobj::real_t> normals;
+  blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices);
+  run_stage(options, "normals", vertex_bytes * 2, [&]()
+            { recompute_normals(scheduler, base_obj, result_vertices, normals); },
+            true);
+
+  // what the viewer does per frame once its buffers exist
+  std::vector<tinyobj::real_t> vbuffer, nbuffer;
+  run_stage(options, "blend_frame", vertex_bytes * (num_faces + 3), [&]()
+            {
+              ArenaScope frame_scope;
+              blend_shape(scheduler, base_obj, basis, weights, vbuffer, nbuffer);
+            },
+            true);
+  blend_shape(scheduler, base_obj, face_objs, weights, vbuffer, nbuffer);
+
+  // buffer upload needs a context; use a hidden window when one is available
+  if (glfwInit())
+  {
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *window = glfwCreateWindow(64, 64, "facialexps_bench", NULL, NULL);
+    if (window)
+    {
+      glfwMakeContextCurrent(window);
+    }
+    if (window && gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+      size_t bytes = (vbuffer.size() + nbuffer.size()) * sizeof(tinyobj::real_t);
+      GLuint VBO;
+      glGenBuffers(1, &VBO);
+      glBindBuffer(GL_ARRAY_BUFFER, VBO);
+      glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_DYNAMIC_DRAW);
+      run_stage(options, "buffer_upload", (double)bytes, [&]()
+                {
+                  glBufferSubData(GL_ARRAY_BUFFER, 0, vbuffer.size() * sizeof(tinyobj::real_t),
+                                  vbuffer.data());
+                  glBufferSubData(GL_ARRAY_BUFFER, vbuffer.size() * sizeof(tinyobj::real_t),
+                                  nbuffer.size() * sizeof(tinyobj::real_t), nbuffer.data());
+                  glFinish();
+                });
+      glDeleteBuffers(1, &VBO);
+    }
+    else if (!options.csv)
+    {
+      std::printf("%-18s skipped (no OpenGL 3.3 context)\n", "buffer_upload");
+    }
+    glfwTerminate();
+  }
+
+  const uint32_t width = 1024, height = 768;
+  std::vector<unsigned char> pixels(width * height * 3);
+  for (size_t i = 0; i < pixels.size(); i++)
+  {
+    pixels[i] = (unsigned char)(i * 31);
+  }
+  run_stage(options, "capture_encode", (double)pixels.size(), [&]()
+            { std::string ppm = encode_ppm(pixels.data(), width, height); });
+
+  return g_failed ? 1 : 0;
+}
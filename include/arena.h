@@ -0,0 +1,195 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+// Monotonic bump allocator for scratch memory. Deallocation is a no-op;
+// memory is reclaimed wholesale by rewinding to a mark. Blocks are kept
+// across rewinds, and when the outermost scope ends several blocks are
+// merged into one, so a repeated workload settles on a single block and
+// stops touching the heap.
+class Arena : public std::pmr::memory_resource
+{
+public:
+  struct Mark
+  {
+    size_t block;
+    size_t offset;
+  };
+
+  explicit Arena(size_t initial_size = 1 << 16) : initial_size(initial_size) {}
+
+  ~Arena()
+  {
+    release();
+  }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  Mark mark() const
+  {
+    return {current, offset};
+  }
+
+  // drop everything allocated after `m`
+  void rewind(Mark m)
+  {
+    current = m.block;
+    offset = m.offset;
+  }
+
+  // rewind to empty; a fragmented arena is replaced by one block covering
+  // the high-water mark
+  void reset()
+  {
+    if (blocks.size() > 1)
+    {
+      size_t total = 0;
+      for (const Block &block : blocks)
+      {
+        total += block.size;
+      }
+      release();
+      add_block(total);
+    }
+    current = 0;
+    offset = 0;
+  }
+
+  size_t capacity() const
+  {
+    size_t total = 0;
+    for (const Block &block : blocks)
+    {
+      total += block.size;
+    }
+    return total;
+  }
+
+private:
+  struct Block
+  {
+    char *data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  size_t current = 0;
+  size_t offset = 0;
+  size_t initial_size;
+
+  void add_block(size_t size)
+  {
+    // reserve ahead so the block list itself does not grow on the hot path
+    if (blocks.capacity() == blocks.size())
+    {
+      blocks.reserve(std::max<size_t>(8, blocks.size() * 2));
+    }
+    blocks.push_back({static_cast<char *>(::operator new(size)), size});
+  }
+
+  void release()
+  {
+    for (const Block &block : blocks)
+    {
+      ::operator delete(block.data);
+    }
+    blocks.clear();
+    current = 0;
+    offset = 0;
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    while (true)
+    {
+      if (current < blocks.size())
+      {
+        Block &block = blocks[current];
+        // align the address, not the offset, so over-aligned requests work too
+        uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+        size_t start = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+        if (start + bytes <= block.size)
+        {
+          offset = start + bytes;
+          return block.data + start;
+        }
+        if (current + 1 < blocks.size())
+        {
+          current++;
+          offset = 0;
+          continue;
+        }
+      }
+
+      size_t last = blocks.empty() ? initial_size : blocks.back().size * 2;
+      add_block(std::max(last, bytes + alignment));
+      current = blocks.size() - 1;
+      offset = 0;
+    }
+  }
+
+  void do_deallocate(void *, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+// the calling thread's scratch arena
+inline Arena &thread_arena()
+{
+  thread_local Arena arena;
+  return arena;
+}
+
+// Scratch lifetime: everything allocated from resource() while the scope is
+// alive is reclaimed when it ends. Scopes nest; the outermost one resets the
+// thread's arena (e.g. one scope per frame, one per load).
+class ArenaScope
+{
+public:
+  ArenaScope() : arena(thread_arena()), start(arena.mark())
+  {
+    depth()++;
+  }
+
+  ~ArenaScope()
+  {
+    if (--depth() == 0)
+    {
+      arena.reset();
+    }
+    else
+    {
+      arena.rewind(start);
+    }
+  }
+
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+  std::pmr::memory_resource *resource()
+  {
+    return &arena;
+  }
+
+private:
+  Arena &arena;
+  Arena::Mark start;
+
+  static int &depth()
+  {
+    thread_local int value = 0;
+    return value;
+  }
+};
+
+#endif // !ARENA_H
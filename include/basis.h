@@ -0,0 +1,517 @@
+#ifndef BASIS_H
+#define BASIS_H
+
+#include <algorithm>
+#include <arena.h>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mem_tracker.h>
+#include <new>
+#include <memory_resource>
+#include <obj.h>
+#include <rig.h>
+#include <scheduler.h>
+#include <skinning.h>
+#include <trace.h>
+#include <vector>
+
+// allocator for SIMD streams: every block starts on an `Align` boundary
+template <typename T, size_t Align>
+struct AlignedAllocator
+{
+  using value_type = T;
+
+  template <typename U>
+  struct rebind
+  {
+    using other = AlignedAllocator<U, Align>;
+  };
+
+  AlignedAllocator() = default;
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+  T *allocate(size_t n)
+  {
+    return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+  }
+
+  void deallocate(T *p, size_t)
+  {
+    ::operator delete(p, std::align_val_t(Align));
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Align> &) const
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Align> &) const
+  {
+    return false;
+  }
+};
+
+// interleave `count` entries of three SoA streams, `stride` floats apart,
+// into xyz triples
+template <typename Vector>
+void soa_to_aos(const float *soa, size_t stride, size_t count, Vector &aos)
+{
+  aos.resize(count * 3);
+  for (size_t v = 0; v < count; v++)
+  {
+    aos[v * 3] = soa[v];
+    aos[v * 3 + 1] = soa[stride + v];
+    aos[v * 3 + 2] = soa[2 * stride + v];
+  }
+}
+
+// one scaled delta block of a blend: targets are blocks 0..T-1, in-between
+// shapes follow from T
+struct BlendTerm
+{
+  size_t block;
+  float coefficient;
+};
+
+// the terms of `weights` under `lookup`: one per non-zero weight, at most two
+// when the target has in-betweens, so a blend never costs more than twice the
+// linear one
+template <typename Vector>
+void blend_terms(const InBetweenLookup &lookup, size_t num_targets,
+                 const std::vector<tinyobj::real_t> &weights, Vector &terms)
+{
+  size_t num_weights = std::min(weights.size(), num_targets);
+  for (size_t t = 0; t < num_weights; t++)
+  {
+    if (weights[t] == 0)
+    {
+      continue;
+    }
+    InBetweenLookup::Term pair[2];
+    int count = lookup.terms(t, weights[t], pair);
+    for (int k = 0; k < count; k++)
+    {
+      if (pair[k].coefficient != 0)
+      {
+        size_t block = pair[k].shape == InBetweenLookup::TARGET ? t : num_targets + pair[k].shape;
+        terms.push_back({block, (float)pair[k].coefficient});
+      }
+    }
+  }
+}
+
+// the rest of a frame on vertices [lo, lo + n) of evaluated SoA streams:
+// the rig's active correctives, then skinning. Bases call it on each chunk
+// right after blending it, so positions are read and written once per frame
+// instead of once per pass.
+inline void finish_range(const std::vector<tinyobj::real_t> &weights, const Rig *rig,
+                         const SkinPose *pose, float *out, size_t stride, size_t lo, size_t n)
+{
+  if (rig)
+  {
+    rig->correctives.apply(weights, out, stride, lo, lo + n);
+  }
+  if (pose)
+  {
+    pose->apply(out, stride, lo, n);
+  }
+}
+
+// Blend basis in structure-of-arrays layout: for the base and for every
+// target delta, x, y and z are separate float streams. Each stream is padded
+// to a multiple of LANES floats and starts on an ALIGNMENT boundary, so the
+// blend loop runs whole SIMD registers (8 AVX or 16 AVX-512 lanes) without
+// shuffles or a scalar tail. Padding lanes are zero.
+//
+// Results are SoA too (3 * padded() floats); to_aos() interleaves them only
+// where xyz triples are needed, i.e. for normals and upload.
+//
+// In-between shapes are stored as extra delta blocks after the targets; the
+// blend turns the weights into (block, coefficient) terms first, so the
+// piecewise-linear response runs in the same loop as the linear one.
+class BlendBasis
+{
+public:
+  static constexpr size_t ALIGNMENT = 64;
+  static constexpr size_t LANES = ALIGNMENT / sizeof(float);
+
+  using Stream = std::vector<float, AlignedAllocator<float, ALIGNMENT>>;
+
+  BlendBasis(const Obj &base_obj, const std::vector<Obj> &face_objs,
+             const InBetweenSet *inbetweens = nullptr)
+  {
+    TRACE_SCOPE("BlendBasis::BlendBasis");
+    MemScope mem_scope(MEM_BASIS);
+    const std::vector<tinyobj::real_t> &base = base_obj.getVertices();
+    vertex_count = base.size() / 3;
+    stride = (vertex_count + LANES - 1) / LANES * LANES;
+    target_count = face_objs.size();
+    shape_count = inbetweens ? inbetweens->size() : 0;
+    if (inbetweens)
+    {
+      lookup = inbetweens->lookup();
+    }
+
+    // stream s of block b starts at (b * 3 + s) * stride; block 0 is the base
+    data.assign((target_count + shape_count + 1) * 3 * stride, 0.0f);
+    for (size_t v = 0; v < vertex_count; v++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        data[c * stride + v] = (float)base[v * 3 + c];
+      }
+    }
+    for (size_t t = 0; t < target_count; t++)
+    {
+      const std::vector<tinyobj::real_t> &target = face_objs[t].getVertices();
+      float *block = &data[(t + 1) * 3 * stride];
+      for (size_t v = 0; v < vertex_count; v++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          block[c * stride + v] = (float)(target[v * 3 + c] - base[v * 3 + c]);
+        }
+      }
+    }
+    for (size_t k = 0; k < shape_count; k++)
+    {
+      const std::vector<tinyobj::real_t> &shape = inbetweens->delta(k);
+      float *block = &data[(target_count + k + 1) * 3 * stride];
+      for (size_t v = 0; v < vertex_count; v++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          block[c * stride + v] = (float)shape[v * 3 + c];
+        }
+      }
+    }
+  }
+
+  size_t num_vertices() const
+  {
+    return vertex_count;
+  }
+
+  size_t num_targets() const
+  {
+    return target_count;
+  }
+
+  // in-between shapes stored after the targets
+  size_t num_inbetweens() const
+  {
+    return shape_count;
+  }
+
+  const InBetweenLookup &inbetweens() const
+  {
+    return lookup;
+  }
+
+  // floats per stream, a multiple of LANES
+  size_t padded() const
+  {
+    return stride;
+  }
+
+  // component c (0 = x, 1 = y, 2 = z) of the base positions
+  const float *base(int c) const
+  {
+    return &data[c * stride];
+  }
+
+  // component c of target t's deltas; t >= num_targets() addresses the
+  // in-between shapes
+  const float *delta(size_t t, int c) const
+  {
+    return &data[((t + 1) * 3 + c) * stride];
+  }
+
+  // T x T Gram matrix D^T D of the target deltas in double, row-major into
+  // `out`; entry (i, j) is the dot product of targets i and j
+  void gram(JobScheduler &scheduler, std::vector<double> &out) const
+  {
+    size_t T = target_count;
+    out.assign(T * T, 0.0);
+    scheduler.parallel_for(0, T, 1, [&](size_t begin, size_t end)
+                           {
+                             for (size_t i = begin; i < end; i++)
+                             {
+                               for (size_t j = 0; j <= i; j++)
+                               {
+                                 double dot = 0;
+                                 for (int c = 0; c < 3; c++)
+                                 {
+                                   const float *a = delta(i, c);
+                                   const float *b = delta(j, c);
+                                   for (size_t v = 0; v < vertex_count; v++)
+                                   {
+                                     dot += (double)a[v] * b[v];
+                                   }
+                                 }
+                                 out[i * T + j] = out[j * T + i] = dot;
+                               }
+                             }
+                           });
+  }
+
+  // FNV-1a over the base and target streams (not the in-between shapes), to
+  // key caches derived from them
+  uint64_t checksum() const
+  {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const unsigned char *bytes = (const unsigned char *)data.data();
+    size_t size = (target_count + 1) * 3 * stride * sizeof(float);
+    for (size_t i = 0; i < size; i++)
+    {
+      hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  // base + sum_t weights[t] * delta_t into `out`: 3 * padded() floats,
+  // ALIGNMENT-aligned (x stream, then y, then z). Missing weights are zero.
+  // Targets with in-betweens use their piecewise-linear response instead.
+  // With a rig and/or pose, correctives and skinning run per chunk, see
+  // finish_range().
+  void evaluate(JobScheduler &scheduler, const std::vector<tinyobj::real_t> &weights,
+                float *out, const Rig *rig = nullptr, const SkinPose *pose = nullptr) const
+  {
+    TRACE_SCOPE("BlendBasis::evaluate");
+    ArenaScope scratch;
+    std::pmr::vector<BlendTerm> terms(scratch.resource());
+    terms.reserve(2 * target_count);
+    blend_terms(lookup, target_count, weights, terms);
+
+    // chunks are whole lane groups, so every inner loop is a multiple of LANES
+    scheduler.parallel_for(0, stride / LANES, 64, [&](size_t begin, size_t end)
+                           {
+                             size_t lo = begin * LANES;
+                             size_t n = (end - begin) * LANES;
+                             for (int c = 0; c < 3; c++)
+                             {
+                               float *__restrict dst = out + c * stride + lo;
+                               const float *src = base(c) + lo;
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                 dst[i] = src[i];
+                               }
+                               for (const BlendTerm &term : terms)
+                               {
+                                 float w = term.coefficient;
+                                 const float *__restrict d = delta(term.block, c) + lo;
+                                 for (size_t i = 0; i < n; i++)
+                                 {
+                                   dst[i] += w * d[i];
+                                 }
+                               }
+                             }
+                             finish_range(weights, rig, pose, out, stride, lo, n);
+                           });
+  }
+
+  // interleave evaluated streams into xyz triples (drops the padding)
+  template <typename Vector>
+  void to_aos(const float *soa, Vector &aos) const
+  {
+    soa_to_aos(soa, stride, vertex_count, aos);
+  }
+
+  // bytes held by the streams
+  size_t size_bytes() const
+  {
+    return data.size() * sizeof(float);
+  }
+
+private:
+  size_t vertex_count = 0;
+  size_t target_count = 0;
+  size_t shape_count = 0;
+  size_t stride = 0;
+  InBetweenLookup lookup;
+  Stream data;
+};
+
+// BlendBasis with the target deltas stored as int16. Every run of BLOCK
+// vertices of one component of one target has its own offset and scale,
+// delta ~= offset + scale * q, so a few large deltas (lips, jaw) do not cost
+// precision everywhere else. The base stays float. Dequantization is folded
+// into the blend loop: per block the weight becomes a = w * scale and
+// b = w * offset, and each lane does dst += a * q + b.
+//
+// Deltas take half the memory of the float basis and a quarter of the double
+// Obj vertices; max_error() is the largest absolute rounding error of any
+// stored delta.
+class QuantizedBasis
+{
+public:
+  static constexpr size_t ALIGNMENT = BlendBasis::ALIGNMENT;
+  static constexpr size_t LANES = BlendBasis::LANES;
+  static constexpr size_t BLOCK = 256;
+
+  explicit QuantizedBasis(const BlendBasis &basis)
+      : vertex_count(basis.num_vertices()), target_count(basis.num_targets()),
+        block_count(basis.num_targets() + basis.num_inbetweens()),
+        stride((basis.padded() + BLOCK - 1) / BLOCK * BLOCK), lookup(basis.inbetweens())
+  {
+    TRACE_SCOPE("QuantizedBasis::QuantizedBasis");
+    MemScope mem_scope(MEM_BASIS);
+    size_t blocks = stride / BLOCK;
+
+    base_data.assign(3 * stride, 0.0f);
+    for (int c = 0; c < 3; c++)
+    {
+      std::copy(basis.base(c), basis.base(c) + vertex_count, &base_data[c * stride]);
+    }
+
+    deltas.assign(block_count * 3 * stride, 0);
+    ranges.resize(block_count * 3 * blocks);
+    for (size_t t = 0; t < block_count; t++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        const float *src = basis.delta(t, c);
+        int16_t *dst = &deltas[(t * 3 + c) * stride];
+        for (size_t b = 0; b < blocks; b++)
+        {
+          size_t lo = b * BLOCK;
+          size_t hi = std::min(vertex_count, lo + BLOCK);
+          float min_value = 0, max_value = 0;
+          for (size_t v = lo; v < hi; v++)
+          {
+            min_value = std::min(min_value, src[v]);
+            max_value = std::max(max_value, src[v]);
+          }
+
+          // map [min, max] onto [-32767, 32767]; padding lanes keep q = 0
+          // (they dequantize to the offset, evaluate() zeroes them)
+          Range &range = ranges[(t * 3 + c) * blocks + b];
+          range.offset = 0.5f * (min_value + max_value);
+          range.scale = (max_value - min_value) / 65534.0f;
+          if (range.scale == 0)
+          {
+            range.offset = 0;
+            continue;
+          }
+          for (size_t v = lo; v < hi; v++)
+          {
+            float q = std::round((src[v] - range.offset) / range.scale);
+            dst[v] = (int16_t)std::max(-32767.0f, std::min(32767.0f, q));
+            error = std::max(error, (double)std::abs(range.offset + range.scale * dst[v] - src[v]));
+          }
+        }
+      }
+    }
+  }
+
+  size_t num_vertices() const
+  {
+    return vertex_count;
+  }
+
+  size_t num_targets() const
+  {
+    return target_count;
+  }
+
+  // floats per output stream, a multiple of BLOCK
+  size_t padded() const
+  {
+    return stride;
+  }
+
+  // largest |dequantized - float delta| over the basis
+  double max_error() const
+  {
+    return error;
+  }
+
+  // same contract as BlendBasis::evaluate, out holds 3 * padded() floats
+  void evaluate(JobScheduler &scheduler, const std::vector<tinyobj::real_t> &weights,
+                float *out, const Rig *rig = nullptr, const SkinPose *pose = nullptr) const
+  {
+    TRACE_SCOPE("QuantizedBasis::evaluate");
+    size_t blocks = stride / BLOCK;
+    ArenaScope scratch;
+    std::pmr::vector<BlendTerm> terms(scratch.resource());
+    terms.reserve(2 * target_count);
+    blend_terms(lookup, target_count, weights, terms);
+
+    scheduler.parallel_for(0, blocks, 4, [&](size_t begin, size_t end)
+                           {
+                             for (int c = 0; c < 3; c++)
+                             {
+                               for (size_t b = begin; b < end; b++)
+                               {
+                                 float *__restrict dst = out + c * stride + b * BLOCK;
+                                 const float *src = &base_data[c * stride + b * BLOCK];
+                                 for (size_t i = 0; i < BLOCK; i++)
+                                 {
+                                   dst[i] = src[i];
+                                 }
+                                 for (const BlendTerm &term : terms)
+                                 {
+                                   size_t t = term.block;
+                                   const Range &range = ranges[(t * 3 + c) * blocks + b];
+                                   if (range.scale == 0)
+                                   {
+                                     continue;
+                                   }
+                                   float a = term.coefficient * range.scale;
+                                   float o = term.coefficient * range.offset;
+                                   const int16_t *__restrict q = &deltas[(t * 3 + c) * stride + b * BLOCK];
+                                   for (size_t i = 0; i < BLOCK; i++)
+                                   {
+                                     dst[i] += a * (float)q[i] + o;
+                                   }
+                                 }
+                                 // keep the zero-padding contract of BlendBasis
+                                 size_t live = b * BLOCK < vertex_count ? vertex_count - b * BLOCK : 0;
+                                 for (size_t i = live; i < BLOCK; i++)
+                                 {
+                                   dst[i] = 0.0f;
+                                 }
+                               }
+                             }
+                             finish_range(weights, rig, pose, out, stride, begin * BLOCK,
+                                          (end - begin) * BLOCK);
+                           });
+  }
+
+  template <typename Vector>
+  void to_aos(const float *soa, Vector &aos) const
+  {
+    soa_to_aos(soa, stride, vertex_count, aos);
+  }
+
+  // bytes held by the base, the deltas and the block ranges
+  size_t size_bytes() const
+  {
+    return base_data.size() * sizeof(float) + deltas.size() * sizeof(int16_t) +
+           ranges.size() * sizeof(Range);
+  }
+
+private:
+  struct Range
+  {
+    float offset;
+    float scale;
+  };
+
+  size_t vertex_count;
+  size_t target_count;
+  size_t block_count; // targets, then in-between shapes
+  size_t stride;
+  InBetweenLookup lookup;
+  double error = 0;
+  BlendBasis::Stream base_data;
+  std::vector<int16_t, AlignedAllocator<int16_t, ALIGNMENT>> deltas;
+  std::vector<Range> ranges;
+};
+
+#endif // !BASIS_H
@@ -0,0 +1,426 @@
+#ifndef BLENDSHAPE_H
+#define BLENDSHAPE_H
+
+#include <algorithm>
+#include <arena.h>
+#include <basis.h>
+#include <bvh.h>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <mem_tracker.h>
+#include <fstream>
+#include <obj.h>
+#include <memory_resource>
+#include <optional>
+#include <rig.h>
+#include <scheduler.h>
+#include <sstream>
+#include <string>
+#include <subdivision.h>
+#include <trace.h>
+#include <vector>
+
+// Loading and evaluation of the linear blendshape model shared by the viewer,
+// batch mode and the benchmarks. Temporaries come from the calling thread's
+// scratch arena, so re-blending into existing buffers does not allocate.
+
+inline std::vector<Obj> load_face_objs(JobScheduler &scheduler,
+                                       const std::string faces_path, const int num_faces)
+{
+  TRACE_SCOPE("load_face_objs");
+  // parse every target on its own task; Obj has no empty state, so collect
+  // into optionals first
+  std::vector<std::optional<Obj>> loaded(num_faces);
+  scheduler.parallel_for(0, num_faces, 1, [&](size_t begin, size_t end)
+                         {
+                           for (size_t i = begin; i < end; i++)
+                           {
+                             std::string file_name = faces_path + std::to_string(i) + ".obj";
+                             loaded[i].emplace(file_name);
+                           }
+                         });
+
+  std::vector<Obj> face_objs;
+  face_objs.reserve(num_faces);
+  for (auto &obj : loaded)
+  {
+    face_objs.push_back(std::move(*obj));
+  }
+
+  return face_objs;
+}
+
+// every *.weights (or other `extension`) file in weights_path, in name order
+inline std::vector<std::filesystem::path> list_weight_files(const std::string weights_path,
+                                                            const std::string extension = ".weights")
+{
+  std::vector<std::filesystem::path> weight_files;
+  for (const auto &entry : std::filesystem::directory_iterator(weights_path))
+  {
+    if (entry.path().extension() == extension)
+    {
+      weight_files.push_back(entry.path());
+    }
+  }
+  std::sort(weight_files.begin(), weight_files.end());
+  return weight_files;
+}
+
+// base vertex index of every triangle corner, in draw order
+inline std::pmr::vector<int> triangle_corners(
+    const Obj &obj, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+{
+  size_t count = 0;
+  for (const auto &shape : obj.getShapes())
+  {
+    count += shape.mesh.indices.size();
+  }
+  std::pmr::vector<int> corners(resource);
+  corners.reserve(count);
+  for (const auto &shape : obj.getShapes())
+  {
+    for (const auto &face : shape.mesh.indices)
+    {
+      corners.push_back(face.vertex_index);
+    }
+  }
+  return corners;
+}
+
+inline std::vector<tinyobj::real_t> get_weights(const char *file_path)
+{
+  TRACE_SCOPE("get_weights");
+  MemScope mem_scope(MEM_LOADER);
+  std::vector<tinyobj::real_t> weights;
+
+  std::ifstream weights_file(file_path);
+
+  std::string line;
+  while (std::getline(weights_file, line))
+  {
+    const char *cursor = line.c_str();
+    char *end = nullptr;
+    for (tinyobj::real_t weight = std::strtod(cursor, &end); end != cursor;
+         weight = std::strtod(cursor, &end))
+    {
+      weights.push_back(weight);
+      cursor = end;
+    }
+  }
+
+  weights_file.close();
+  return weights;
+}
+
+// one weight per line, the format get_weights() reads
+inline void write_weights(const std::string &file_path,
+                          const std::vector<tinyobj::real_t> &weights)
+{
+  std::ofstream out(file_path);
+  for (tinyobj::real_t weight : weights)
+  {
+    out << weight << "\n";
+  }
+}
+
+// base + sum_i weights[i] * (target_i - base), per vertex coordinate;
+// `Vector` is std::vector or std::pmr::vector of real_t. Targets with
+// in-betweens follow their piecewise-linear response instead.
+template <typename Vector>
+void blend_vertices(JobScheduler &scheduler, const Obj &base_obj,
+                    const std::vector<Obj> &face_objs,
+                    const std::vector<tinyobj::real_t> &weights,
+                    Vector &result_vertices,
+                    const InBetweenSet *inbetweens = nullptr)
+{
+  TRACE_SCOPE("blend_vertices");
+  MemScope mem_scope(MEM_BLEND);
+  const std::vector<tinyobj::real_t> &base_vertices = base_obj.getVertices();
+  result_vertices.resize(base_vertices.size());
+
+  // blend disjoint vertex ranges in parallel
+  size_t num_vertices = base_vertices.size() / 3;
+  scheduler.parallel_for(0, num_vertices, 512, [&](size_t begin, size_t end)
+                         {
+                           for (size_t j = begin * 3; j < end * 3; j++)
+                           {
+                             result_vertices[j] = base_vertices[j];
+                           }
+
+                           for (size_t i = 0; i < weights.size(); i++)
+                           {
+                             if (weights[i] == 0)
+                             {
+                               continue;
+                             }
+
+                             InBetweenLookup::Term terms[2] = {{InBetweenLookup::TARGET, weights[i]}};
+                             int count = inbetweens ? inbetweens->lookup().terms(i, weights[i], terms) : 1;
+                             for (int k = 0; k < count; k++)
+                             {
+                               double w = terms[k].coefficient;
+                               if (terms[k].shape != InBetweenLookup::TARGET)
+                               {
+                                 const std::vector<tinyobj::real_t> &delta = inbetweens->delta(terms[k].shape);
+                                 for (size_t j = begin * 3; j < end * 3; j++)
+                                 {
+                                   result_vertices[j] += w * delta[j];
+                                 }
+                                 continue;
+                               }
+
+                               const std::vector<tinyobj::real_t> &face_vertices = face_objs[i].getVertices();
+                               assert(result_vertices.size() == face_vertices.size());
+                               for (size_t j = begin * 3; j < end * 3; j++)
+                               {
+                                 result_vertices[j] += w * (face_vertices[j] - base_vertices[j]);
+                               }
+                             }
+                           }
+                         });
+}
+
+// area-weighted smooth vertex normals of a triangle list (vertex index per
+// corner)
+template <typename InVector, typename OutVector>
+void recompute_normals(JobScheduler &scheduler, const std::pmr::vector<int> &triangles,
+                       const InVector &vertices, OutVector &normals)
+{
+  TRACE_SCOPE("recompute_normals");
+  MemScope mem_scope(MEM_BLEND);
+  // size the output first: it may live in an enclosing arena scope
+  normals.assign(vertices.size(), 0);
+  ArenaScope scratch;
+  size_t num_vertices = vertices.size() / 3;
+  size_t num_triangles = triangles.size() / 3;
+
+  // vertex -> incident triangles (CSR) so vertices can gather without races
+  std::pmr::vector<int> offsets(num_vertices + 1, 0, scratch.resource());
+  for (int vid : triangles)
+  {
+    offsets[vid + 1]++;
+  }
+  for (size_t v = 0; v < num_vertices; v++)
+  {
+    offsets[v + 1] += offsets[v];
+  }
+  std::pmr::vector<int> incident(triangles.size(), scratch.resource());
+  std::pmr::vector<int> cursor(offsets.begin(), offsets.end() - 1, scratch.resource());
+  for (size_t c = 0; c < triangles.size(); c++)
+  {
+    incident[cursor[triangles[c]]++] = (int)(c / 3);
+  }
+
+  // unnormalized face normals; their length is twice the triangle area
+  std::pmr::vector<tinyobj::real_t> face_normals(num_triangles * 3, scratch.resource());
+  scheduler.parallel_for(0, num_triangles, 2048, [&](size_t begin, size_t end)
+                         {
+                           for (size_t t = begin; t < end; t++)
+                           {
+                             const tinyobj::real_t *a = &vertices[triangles[t * 3] * 3];
+                             const tinyobj::real_t *b = &vertices[triangles[t * 3 + 1] * 3];
+                             const tinyobj::real_t *c = &vertices[triangles[t * 3 + 2] * 3];
+                             tinyobj::real_t e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+                             tinyobj::real_t e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+                             face_normals[t * 3] = e1[1] * e2[2] - e1[2] * e2[1];
+                             face_normals[t * 3 + 1] = e1[2] * e2[0] - e1[0] * e2[2];
+                             face_normals[t * 3 + 2] = e1[0] * e2[1] - e1[1] * e2[0];
+                           }
+                         });
+
+  scheduler.parallel_for(0, num_vertices, 1024, [&](size_t begin, size_t end)
+                         {
+                           for (size_t v = begin; v < end; v++)
+                           {
+                             tinyobj::real_t n[3] = {0, 0, 0};
+                             for (int k = offsets[v]; k < offsets[v + 1]; k++)
+                             {
+                               for (int d = 0; d < 3; d++)
+                               {
+                                 n[d] += face_normals[incident[k] * 3 + d];
+                               }
+                             }
+                             tinyobj::real_t len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                             if (len > 0)
+                             {
+                               for (int d = 0; d < 3; d++)
+                               {
+                                 normals[v * 3 + d] = n[d] / len;
+                               }
+                             }
+                           }
+                         });
+}
+
+// the same on the triangulated base topology
+template <typename InVector, typename OutVector>
+void recompute_normals(JobScheduler &scheduler, const Obj &base_obj,
+                       const InVector &vertices, OutVector &normals)
+{
+  normals.assign(vertices.size(), 0);
+  ArenaScope scratch;
+  recompute_normals(scheduler, triangle_corners(base_obj, scratch.resource()), vertices, normals);
+}
+
+// recompute normals for blended positions and expand both to one entry per
+// triangle corner
+template <typename Vector>
+void expand_corners(JobScheduler &scheduler, const std::pmr::vector<int> &corners,
+                    const Vector &result_vertices,
+                    std::vector<tinyobj::real_t> &vbuffer,
+                    std::vector<tinyobj::real_t> &nbuffer)
+{
+  ArenaScope scratch;
+
+  // the base normals no longer match the deformed surface
+  std::pmr::vector<tinyobj::real_t> result_normals(scratch.resource());
+  recompute_normals(scheduler, corners, result_vertices, result_normals);
+
+  vbuffer.resize(corners.size() * 3);
+  nbuffer.resize(corners.size() * 3);
+  scheduler.parallel_for(0, corners.size(), 4096, [&](size_t begin, size_t end)
+                         {
+                           for (size_t c = begin; c < end; c++)
+                           {
+                             int vid = corners[c];
+                             for (int k = 0; k < 3; k++)
+                             {
+                               vbuffer[c * 3 + k] = result_vertices[vid * 3 + k];
+                               nbuffer[c * 3 + k] = result_normals[vid * 3 + k];
+                             }
+                           }
+                         });
+}
+
+template <typename Vector>
+void expand_corners(JobScheduler &scheduler, const Obj &base_obj,
+                    const Vector &result_vertices,
+                    std::vector<tinyobj::real_t> &vbuffer,
+                    std::vector<tinyobj::real_t> &nbuffer)
+{
+  ArenaScope scratch;
+  expand_corners(scheduler, triangle_corners(base_obj, scratch.resource()), result_vertices,
+                 vbuffer, nbuffer);
+}
+
+// blend (with the rig's in-betweens), add active correctives, recompute
+// normals and expand to one position/normal per corner. This double
+// reference path does not skin; skinning runs on the float bases
+inline void blend_shape(JobScheduler &scheduler, const Obj &base_obj,
+                        const std::vector<Obj> &face_objs,
+                        const std::vector<tinyobj::real_t> &weights,
+                        std::vector<tinyobj::real_t> &vbuffer,
+                        std::vector<tinyobj::real_t> &nbuffer,
+                        const Rig *rig = nullptr)
+{
+  TRACE_SCOPE("blend_shape");
+  MemScope mem_scope(MEM_BLEND);
+  ArenaScope scratch;
+  std::pmr::vector<tinyobj::real_t> result_vertices(scratch.resource());
+  blend_vertices(scheduler, base_obj, face_objs, weights, result_vertices,
+                 rig ? &rig->inbetweens : nullptr);
+  if (rig)
+  {
+    rig->correctives.apply(weights, result_vertices);
+  }
+  expand_corners(scheduler, base_obj, result_vertices, vbuffer, nbuffer);
+}
+
+// same, evaluated in float on a SoA basis: BlendBasis, QuantizedBasis,
+// PcaBasis or MeshletBasis (the evaluate()/to_aos()/padded() contract).
+// In-betweens come from the basis (PcaBasis responds linearly), the rig's
+// correctives and the optional skin pose are fused into the basis
+// evaluation. With `subdivision` the blended cage is refined by its
+// stencils before the normal pass; a non-null `bvh` is refit to the blended
+// cage, not the refined surface. The streams are interleaved once for the
+// normal pass and the corner expansion
+template <typename Basis>
+void blend_shape(JobScheduler &scheduler, const Obj &base_obj, const Basis &basis,
+                 const std::vector<tinyobj::real_t> &weights,
+                 std::vector<tinyobj::real_t> &vbuffer,
+                 std::vector<tinyobj::real_t> &nbuffer,
+                 const Rig *rig = nullptr, const SkinPose *pose = nullptr,
+                 const SubdivisionStencils *subdivision = nullptr, Bvh *bvh = nullptr)
+{
+  TRACE_SCOPE("blend_shape");
+  MemScope mem_scope(MEM_BLEND);
+  ArenaScope scratch;
+  float *streams = static_cast<float *>(scratch.resource()->allocate(
+      3 * basis.padded() * sizeof(float), Basis::ALIGNMENT));
+  basis.evaluate(scheduler, weights, streams, rig, pose);
+  if (bvh)
+  {
+    bvh->refit(streams, basis.padded(), weights, rig, pose);
+  }
+
+  std::pmr::vector<tinyobj::real_t> result_vertices(scratch.resource());
+  if (subdivision)
+  {
+    float *refined = static_cast<float *>(scratch.resource()->allocate(
+        3 * subdivision->padded() * sizeof(float), SubdivisionStencils::ALIGNMENT));
+    subdivision->apply(scheduler, streams, basis.padded(), refined);
+    soa_to_aos(refined, subdivision->padded(), subdivision->num_vertices(), result_vertices);
+    expand_corners(scheduler, subdivision->triangles(), result_vertices, vbuffer, nbuffer);
+    return;
+  }
+  basis.to_aos(streams, result_vertices);
+  expand_corners(scheduler, base_obj, result_vertices, vbuffer, nbuffer);
+}
+
+// write a blended mesh (expanded triangle corners) as a Wavefront OBJ
+inline void write_obj(const std::string &file_path, const Obj &base_obj,
+                      const std::vector<tinyobj::real_t> &vbuffer,
+                      const std::vector<tinyobj::real_t> &nbuffer)
+{
+  TRACE_SCOPE("write_obj");
+  MemScope mem_scope(MEM_CAPTURE);
+  std::ostringstream out;
+  out << "# blended from " << base_obj.getVertices().size() / 3 << " vertices\n";
+  for (size_t i = 0; i < vbuffer.size(); i += 3)
+  {
+    out << "v " << vbuffer[i] << " " << vbuffer[i + 1] << " " << vbuffer[i + 2] << "\n";
+  }
+  for (size_t i = 0; i < nbuffer.size(); i += 3)
+  {
+    out << "vn " << nbuffer[i] << " " << nbuffer[i + 1] << " " << nbuffer[i + 2] << "\n";
+  }
+  for (size_t c = 1; c + 2 <= vbuffer.size() / 3; c += 3)
+  {
+    out << "f " << c << "//" << c << " " << c + 1 << "//" << c + 1 << " "
+        << c + 2 << "//" << c + 2 << "\n";
+  }
+
+  std::ofstream fout(file_path);
+  fout << out.str();
+}
+
+// write a shape with the base topology (one position per base vertex) as a
+// Wavefront OBJ that load_face_objs() can read back as a target
+template <typename Vector>
+void write_shape_obj(const std::string &file_path, const Obj &base_obj, const Vector &vertices)
+{
+  TRACE_SCOPE("write_shape_obj");
+  MemScope mem_scope(MEM_CAPTURE);
+  std::ostringstream out;
+  out.precision(9);
+  for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+  {
+    out << "v " << vertices[i] << " " << vertices[i + 1] << " " << vertices[i + 2] << "\n";
+  }
+  for (const auto &shape : base_obj.getShapes())
+  {
+    const std::vector<tinyobj::index_t> &indices = shape.mesh.indices;
+    for (size_t c = 0; c + 2 < indices.size(); c += 3)
+    {
+      out << "f " << indices[c].vertex_index + 1 << " " << indices[c + 1].vertex_index + 1 << " "
+          << indices[c + 2].vertex_index + 1 << "\n";
+    }
+  }
+
+  std::ofstream fout(file_path);
+  fout << out.str();
+}
+
+#endif // !BLENDSHAPE_H
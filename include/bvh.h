@@ -0,0 +1,608 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <meshlets.h>
+#include <skinning.h>
+#include <trace.h>
+#include <vector>
+
+// RayPacket::LANES rays traced together, one lane per ray. Inputs are the
+// origins, directions and t (the far limit; a negative t disables the lane).
+// intersect() leaves the nearest hit in t, its base triangle (or -1) and
+// barycentrics u, v of corners 1 and 2.
+struct RayPacket
+{
+  static constexpr size_t LANES = 8;
+
+  alignas(32) float origin[3][LANES];
+  alignas(32) float direction[3][LANES];
+  alignas(32) float t[LANES];
+  alignas(32) int32_t triangle[LANES];
+  alignas(32) float u[LANES];
+  alignas(32) float v[LANES];
+
+  // every lane disabled
+  RayPacket()
+  {
+    for (size_t l = 0; l < LANES; l++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        origin[c][l] = 0.0f;
+        direction[c][l] = c == 2 ? 1.0f : 0.0f;
+      }
+      t[l] = -1.0f;
+    }
+  }
+
+  void set(size_t lane, const glm::vec3 &from, const glm::vec3 &dir,
+           float max_t = std::numeric_limits<float>::max())
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      origin[c][lane] = from[c];
+      direction[c][lane] = dir[c];
+    }
+    t[lane] = max_t;
+  }
+};
+
+// Bounding volume hierarchy over the base triangles. The tree (binned SAH,
+// up to MAX_LEAF triangles per leaf) is built once on base.obj; a blend only
+// moves vertices, so refit() recomputes the boxes bottom-up for the new
+// positions instead of rebuilding. Nodes are in depth-first order with the
+// left child right after its parent, so one reverse sweep visits children
+// before parents.
+//
+// Boxes are eight floats, (min x, y, z, 0, -max x, y, z, 0): merging two is
+// a single eight-lane min. Leaves keep their triangles' positions (corner 0
+// and two edges) so ray queries read contiguous memory and do not need the
+// blend streams afterwards.
+//
+// Built with a MeshletBasis, every node also carries the set of meshlets
+// owning one of its vertices. refit() then skips nodes none of whose
+// meshlets moved since the previous refit: a mouth expression only refits
+// the nodes around the mouth.
+class Bvh
+{
+public:
+  static constexpr size_t MAX_LEAF = 4;
+
+  // vertices: 3V base positions; corners: base vertex of every triangle
+  // corner; meshlets must outlive the tree
+  Bvh(const std::vector<tinyobj::real_t> &vertices, const std::pmr::vector<int> &corners,
+      const MeshletBasis *meshlets = nullptr)
+      : meshlets(meshlets)
+  {
+    TRACE_SCOPE("Bvh::Bvh");
+    MemScope mem_scope(MEM_BASIS);
+    size_t T = corners.size() / 3;
+    std::vector<Box> bounds(T);
+    std::vector<float> centroids(T * 3);
+    order.resize(T);
+    for (size_t f = 0; f < T; f++)
+    {
+      Box box = EMPTY;
+      for (int i = 0; i < 3; i++)
+      {
+        const tinyobj::real_t *p = &vertices[corners[f * 3 + i] * 3];
+        box = merge(box, point((float)p[0], (float)p[1], (float)p[2]));
+      }
+      bounds[f] = box;
+      for (int c = 0; c < 3; c++)
+      {
+        centroids[f * 3 + c] = 0.5f * (box.v[c] - box.v[c + 4]);
+      }
+      order[f] = (uint32_t)f;
+    }
+    nodes.reserve(2 * T);
+    build(bounds, centroids, 0, T);
+
+    leaf_corners.resize(T * 3);
+    for (size_t k = 0; k < T; k++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        leaf_corners[k * 3 + i] = (uint32_t)corners[order[k] * 3 + i];
+      }
+    }
+    leaf_triangles.resize(T);
+    boxes.resize(nodes.size());
+
+    if (meshlets)
+    {
+      words = (meshlets->size() + 63) / 64;
+      build_masks(vertices.size() / 3);
+      previous.assign(words, 0);
+    }
+
+    // the first refit places everything at the base
+    size_t V = vertices.size() / 3;
+    std::vector<float> streams(3 * V);
+    for (size_t v = 0; v < V; v++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        streams[c * V + v] = (float)vertices[v * 3 + c];
+      }
+    }
+    refit_nodes(streams.data(), V, nullptr);
+  }
+
+  size_t num_nodes() const
+  {
+    return nodes.size();
+  }
+
+  size_t num_triangles() const
+  {
+    return order.size();
+  }
+
+  size_t size_bytes() const
+  {
+    return nodes.size() * (sizeof(Node) + sizeof(Box) + words * sizeof(uint64_t)) +
+           order.size() * (sizeof(uint32_t) * 4 + sizeof(LeafTriangle));
+  }
+
+  // nodes the last refit recomputed
+  size_t num_refit() const
+  {
+    return refit_count;
+  }
+
+  // refit to evaluated SoA streams (3 * stride floats, as from a basis'
+  // evaluate()); `weights`, `rig` and `pose` are those of the blend. Only
+  // nodes of meshlets the blend or the previous one moved are refit, unless
+  // correctives or skinning may have moved any vertex.
+  void refit(const float *streams, size_t stride, const std::vector<tinyobj::real_t> &weights,
+             const Rig *rig = nullptr, const SkinPose *pose = nullptr)
+  {
+    TRACE_SCOPE("Bvh::refit");
+    if (!meshlets || pose || (rig && rig->correctives.size() > 0))
+    {
+      refit_nodes(streams, stride, nullptr);
+      previous.assign(words, ~uint64_t(0));
+      return;
+    }
+    meshlets->moved(weights, current);
+    dirty.resize(words);
+    for (size_t w = 0; w < words; w++)
+    {
+      dirty[w] = current[w] | previous[w];
+    }
+    refit_nodes(streams, stride, dirty.data());
+    std::swap(previous, current);
+  }
+
+  // refit every node to evaluated SoA streams
+  void refit(const float *streams, size_t stride)
+  {
+    TRACE_SCOPE("Bvh::refit");
+    refit_nodes(streams, stride, nullptr);
+    previous.assign(words, ~uint64_t(0));
+  }
+
+  // nearest hit of every enabled lane against the last refit positions
+  // (two-sided)
+  void intersect(RayPacket &packet) const
+  {
+    const size_t L = RayPacket::LANES;
+    alignas(32) float inverse[3][L];
+    for (int c = 0; c < 3; c++)
+    {
+      for (size_t l = 0; l < L; l++)
+      {
+        float d = packet.direction[c][l];
+        inverse[c][l] = std::fabs(d) > 1e-30f ? 1.0f / d : std::copysign(1e30f, d);
+      }
+    }
+    // the closest hits so far, apart from the packet so the lane loops do
+    // not have to assume they alias the rays
+    Hits hits;
+    for (size_t l = 0; l < L; l++)
+    {
+      hits.t[l] = packet.t[l];
+      hits.triangle[l] = -1;
+      hits.u[l] = hits.v[l] = 0.0f;
+    }
+
+    // nodes with the packet's entry distance, nearer child popped first;
+    // an entry is dropped once every lane has a hit in front of it
+    struct Entry
+    {
+      uint32_t node;
+      float distance;
+    };
+    Entry stack[64];
+    size_t top = 0;
+    float root = entry(packet, inverse, hits.t, boxes[0]);
+    if (root < INF)
+    {
+      stack[top++] = {0, root};
+    }
+    float farthest = max_t(hits.t);
+    while (top > 0)
+    {
+      Entry next = stack[--top];
+      if (next.distance > farthest)
+      {
+        continue;
+      }
+      const Node &node = nodes[next.node];
+      if (node.count > 0)
+      {
+        for (uint32_t k = node.first; k < node.first + node.count; k++)
+        {
+          hit_triangle(packet, k, hits);
+        }
+        farthest = max_t(hits.t);
+        continue;
+      }
+      Entry near_child = {next.node + 1, entry(packet, inverse, hits.t, boxes[next.node + 1])};
+      Entry far_child = {node.first, entry(packet, inverse, hits.t, boxes[node.first])};
+      if (far_child.distance < near_child.distance)
+      {
+        std::swap(near_child, far_child);
+      }
+      if (far_child.distance < INF)
+      {
+        stack[top++] = far_child;
+      }
+      if (near_child.distance < INF)
+      {
+        stack[top++] = near_child;
+      }
+    }
+
+    for (size_t l = 0; l < L; l++)
+    {
+      packet.t[l] = hits.t[l];
+      packet.triangle[l] = hits.triangle[l];
+      packet.u[l] = hits.u[l];
+      packet.v[l] = hits.v[l];
+    }
+  }
+
+private:
+  struct alignas(32) Box
+  {
+    float v[8];
+  };
+
+  struct Node
+  {
+    uint32_t first; // leaf: first leaf triangle, inner: right child
+    uint32_t count; // leaf triangles, 0 for inner nodes
+  };
+
+  struct Hits
+  {
+    alignas(32) float t[RayPacket::LANES];
+    alignas(32) int32_t triangle[RayPacket::LANES];
+    alignas(32) float u[RayPacket::LANES];
+    alignas(32) float v[RayPacket::LANES];
+  };
+
+  // corner 0 and the edges to corners 1 and 2
+  struct LeafTriangle
+  {
+    float p[3], e1[3], e2[3];
+  };
+
+  static constexpr float INF = std::numeric_limits<float>::infinity();
+  static constexpr Box EMPTY = {{INF, INF, INF, 0.0f, INF, INF, INF, 0.0f}};
+  static constexpr int BINS = 16;
+  // below this depth splits are at the median, so the tree stays shallow
+  // enough for the traversal stack whatever SAH does above
+  static constexpr int SAH_DEPTH = 40;
+
+  const MeshletBasis *meshlets;
+  std::vector<Node> nodes;
+  std::vector<Box> boxes;
+  std::vector<uint32_t> order;        // base triangle of every leaf triangle
+  std::vector<uint32_t> leaf_corners; // base vertices, in leaf order
+  std::vector<LeafTriangle> leaf_triangles;
+  size_t words = 0;                   // meshlet mask words per node
+  std::vector<uint64_t> masks;
+  std::vector<uint64_t> previous, current, dirty;
+  size_t refit_count = 0;
+
+  static Box merge(const Box &a, const Box &b)
+  {
+    Box out;
+    for (int i = 0; i < 8; i++)
+    {
+      out.v[i] = std::min(a.v[i], b.v[i]);
+    }
+    return out;
+  }
+
+  static Box point(float x, float y, float z)
+  {
+    return {{x, y, z, 0.0f, -x, -y, -z, 0.0f}};
+  }
+
+  static float area(const Box &box)
+  {
+    float d[3];
+    for (int c = 0; c < 3; c++)
+    {
+      d[c] = std::max(0.0f, -box.v[c + 4] - box.v[c]);
+    }
+    return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+  }
+
+  // binned SAH on the centroids of order[first, first + count)
+  uint32_t build(const std::vector<Box> &bounds, const std::vector<float> &centroids, size_t first,
+                 size_t count, int depth = 0)
+  {
+    uint32_t index = (uint32_t)nodes.size();
+    nodes.push_back({(uint32_t)first, (uint32_t)count});
+    if (count <= MAX_LEAF)
+    {
+      return index;
+    }
+
+    float low[3] = {INF, INF, INF}, high[3] = {-INF, -INF, -INF};
+    for (size_t k = first; k < first + count; k++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        low[c] = std::min(low[c], centroids[order[k] * 3 + c]);
+        high[c] = std::max(high[c], centroids[order[k] * 3 + c]);
+      }
+    }
+    int axis = 0;
+    for (int c = 1; c < 3; c++)
+    {
+      axis = high[c] - low[c] > high[axis] - low[axis] ? c : axis;
+    }
+
+    size_t split = first + count / 2;
+    bool partitioned = false;
+    float extent = high[axis] - low[axis];
+    if (extent > 0 && depth < SAH_DEPTH)
+    {
+      Box bin_box[BINS];
+      size_t bin_count[BINS] = {};
+      std::fill(bin_box, bin_box + BINS, EMPTY);
+      auto bin_of = [&](uint32_t f)
+      {
+        int b = (int)((centroids[f * 3 + axis] - low[axis]) / extent * BINS);
+        return std::min(b, BINS - 1);
+      };
+      for (size_t k = first; k < first + count; k++)
+      {
+        int b = bin_of(order[k]);
+        bin_box[b] = merge(bin_box[b], bounds[order[k]]);
+        bin_count[b]++;
+      }
+      // cost of splitting after bin b: left and right areas times counts
+      float right_cost[BINS];
+      Box box = EMPTY;
+      size_t n = 0;
+      for (int b = BINS - 1; b > 0; b--)
+      {
+        box = merge(box, bin_box[b]);
+        n += bin_count[b];
+        right_cost[b - 1] = area(box) * n;
+      }
+      float best = INF;
+      int best_bin = -1;
+      box = EMPTY;
+      n = 0;
+      for (int b = 0; b < BINS - 1; b++)
+      {
+        box = merge(box, bin_box[b]);
+        n += bin_count[b];
+        float cost = area(box) * n + right_cost[b];
+        if (n > 0 && n < count && cost < best)
+        {
+          best = cost;
+          best_bin = b;
+        }
+      }
+      if (best_bin >= 0)
+      {
+        split = std::partition(order.begin() + first, order.begin() + first + count,
+                               [&](uint32_t f)
+                               { return bin_of(f) <= best_bin; }) -
+                order.begin();
+        partitioned = true;
+      }
+    }
+    if (!partitioned)
+    {
+      // no usable bin boundary: split at the median centroid
+      std::nth_element(order.begin() + first, order.begin() + split, order.begin() + first + count,
+                       [&](uint32_t a, uint32_t b)
+                       { return centroids[a * 3 + axis] < centroids[b * 3 + axis]; });
+    }
+
+    build(bounds, centroids, first, split - first, depth + 1);
+    uint32_t right = build(bounds, centroids, split, first + count - split, depth + 1);
+    nodes[index] = {right, 0};
+    return index;
+  }
+
+  // meshlets owning a vertex of each node, ORed up from the leaves
+  void build_masks(size_t num_vertices)
+  {
+    std::vector<uint32_t> owner(num_vertices, 0);
+    const std::vector<uint32_t> &owned = meshlets->owned();
+    for (size_t m = 0; m < meshlets->size(); m++)
+    {
+      const Meshlet &meshlet = meshlets->meshlet(m);
+      for (uint32_t i = 0; i < meshlet.owned_count; i++)
+      {
+        owner[owned[meshlet.owned_offset + i]] = (uint32_t)m;
+      }
+    }
+    masks.assign(nodes.size() * words, 0);
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+      uint64_t *bits = &masks[i * words];
+      const Node &node = nodes[i];
+      if (node.count > 0)
+      {
+        for (uint32_t k = node.first * 3; k < (node.first + node.count) * 3; k++)
+        {
+          uint32_t m = owner[leaf_corners[k]];
+          bits[m / 64] |= uint64_t(1) << (m % 64);
+        }
+        continue;
+      }
+      for (size_t w = 0; w < words; w++)
+      {
+        bits[w] = masks[(i + 1) * words + w] | masks[node.first * words + w];
+      }
+    }
+  }
+
+  void refit_nodes(const float *streams, size_t stride, const uint64_t *dirty_meshlets)
+  {
+    refit_count = 0;
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+      if (dirty_meshlets && !any(&masks[i * words], dirty_meshlets))
+      {
+        continue;
+      }
+      refit_count++;
+      const Node &node = nodes[i];
+      if (node.count == 0)
+      {
+        boxes[i] = merge(boxes[i + 1], boxes[node.first]);
+        continue;
+      }
+      float low[3] = {INF, INF, INF}, high[3] = {-INF, -INF, -INF};
+      for (uint32_t k = node.first; k < node.first + node.count; k++)
+      {
+        float p[3][3];
+        for (int j = 0; j < 3; j++)
+        {
+          uint32_t v = leaf_corners[k * 3 + j];
+          for (int c = 0; c < 3; c++)
+          {
+            p[j][c] = streams[c * stride + v];
+          }
+        }
+        LeafTriangle &triangle = leaf_triangles[k];
+        for (int c = 0; c < 3; c++)
+        {
+          low[c] = std::min(low[c], std::min(p[0][c], std::min(p[1][c], p[2][c])));
+          high[c] = std::max(high[c], std::max(p[0][c], std::max(p[1][c], p[2][c])));
+          triangle.p[c] = p[0][c];
+          triangle.e1[c] = p[1][c] - p[0][c];
+          triangle.e2[c] = p[2][c] - p[0][c];
+        }
+      }
+      boxes[i] = {{low[0], low[1], low[2], 0.0f, -high[0], -high[1], -high[2], 0.0f}};
+    }
+  }
+
+  bool any(const uint64_t *a, const uint64_t *b) const
+  {
+    for (size_t w = 0; w < words; w++)
+    {
+      if (a[w] & b[w])
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // slab test of every lane against `box`: the smallest distance at which
+  // a lane enters it before its current t, INF if none does
+  static float entry(const RayPacket &packet, const float (&inverse)[3][RayPacket::LANES],
+                     const float *t, const Box &box)
+  {
+    const size_t L = RayPacket::LANES;
+    alignas(32) float enter[L], leave[L];
+    for (size_t l = 0; l < L; l++)
+    {
+      enter[l] = 0.0f;
+      leave[l] = t[l];
+    }
+    for (int c = 0; c < 3; c++)
+    {
+      float low = box.v[c], high = -box.v[c + 4];
+      for (size_t l = 0; l < L; l++)
+      {
+        float t0 = (low - packet.origin[c][l]) * inverse[c][l];
+        float t1 = (high - packet.origin[c][l]) * inverse[c][l];
+        enter[l] = std::max(enter[l], std::min(t0, t1));
+        leave[l] = std::min(leave[l], std::max(t0, t1));
+      }
+    }
+    float nearest = INF;
+    for (size_t l = 0; l < L; l++)
+    {
+      nearest = std::min(nearest, enter[l] <= leave[l] ? enter[l] : INF);
+    }
+    return nearest;
+  }
+
+  static float max_t(const float *t)
+  {
+    float farthest = t[0];
+    for (size_t l = 1; l < RayPacket::LANES; l++)
+    {
+      farthest = std::max(farthest, t[l]);
+    }
+    return farthest;
+  }
+
+  // Moller-Trumbore for every lane against leaf triangle k. The lane loop
+  // only computes candidates so it stays branch free and vectorizes; the
+  // few lanes that actually hit are merged afterwards
+  void hit_triangle(const RayPacket &packet, uint32_t k, Hits &hits) const
+  {
+    const LeafTriangle &tri = leaf_triangles[k];
+    alignas(32) float hit_t[RayPacket::LANES], hit_u[RayPacket::LANES], hit_v[RayPacket::LANES];
+    for (size_t l = 0; l < RayPacket::LANES; l++)
+    {
+      float dx = packet.direction[0][l], dy = packet.direction[1][l], dz = packet.direction[2][l];
+      float sx = packet.origin[0][l] - tri.p[0];
+      float sy = packet.origin[1][l] - tri.p[1];
+      float sz = packet.origin[2][l] - tri.p[2];
+      float px = dy * tri.e2[2] - dz * tri.e2[1];
+      float py = dz * tri.e2[0] - dx * tri.e2[2];
+      float pz = dx * tri.e2[1] - dy * tri.e2[0];
+      float qx = sy * tri.e1[2] - sz * tri.e1[1];
+      float qy = sz * tri.e1[0] - sx * tri.e1[2];
+      float qz = sx * tri.e1[1] - sy * tri.e1[0];
+      float det = tri.e1[0] * px + tri.e1[1] * py + tri.e1[2] * pz;
+      float inv = 1.0f / det;
+      float u = (sx * px + sy * py + sz * pz) * inv;
+      float v = (dx * qx + dy * qy + dz * qz) * inv;
+      float t = (tri.e2[0] * qx + tri.e2[1] * qy + tri.e2[2] * qz) * inv;
+      // non-short-circuit so the lanes stay branch free
+      bool hit = (std::fabs(det) > 1e-12f) & (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) & (t > 0.0f);
+      hit_t[l] = hit ? t : INF;
+      hit_u[l] = u;
+      hit_v[l] = v;
+    }
+    int32_t id = (int32_t)order[k];
+    for (size_t l = 0; l < RayPacket::LANES; l++)
+    {
+      if (hit_t[l] < hits.t[l])
+      {
+        hits.t[l] = hit_t[l];
+        hits.triangle[l] = id;
+        hits.u[l] = hit_u[l];
+        hits.v[l] = hit_v[l];
+      }
+    }
+  }
+};
+
+#endif // !BVH_H
@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mem_tracker.h>
+#include <sstream>
+#include <string>
+#include <trace.h>
+
+// Encode a bottom-up RGB8 framebuffer readback as an ASCII PPM (P3) image.
+inline std::string encode_ppm(const unsigned char *pixels, uint32_t width,
+                              uint32_t height)
+{
+  TRACE_SCOPE("encode_ppm");
+  MemScope mem_scope(MEM_CAPTURE);
+  int pixelChannel = 3;
+  std::ostringstream out;
+  out << "P3\n"
+      << width << " " << height << "\n"
+      << 255 << "\n";
+  for (size_t i = 0; i < height; i++)
+  {
+    for (size_t j = 0; j < width; j++)
+    {
+      size_t cur = pixelChannel * ((height - i - 1) * width + j);
+      out << (int)pixels[cur] << " " << (int)pixels[cur + 1] << " "
+          << (int)pixels[cur + 2] << " ";
+    }
+    out << "\n";
+  }
+  return out.str();
+}
+
+#endif // !CAPTURE_H
@@ -0,0 +1,412 @@
+#ifndef CROWD_H
+#define CROWD_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <lod.h>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <obj.h>
+#include <shader.h>
+#include <skinning.h>
+#include <uniform_buffer.h>
+#include <vertex_cache.h>
+#include <vector>
+
+// Renders many differently-blended copies of one head with a single
+// glDrawElementsInstanced call. Blending happens in shaders/crowd.vs: base
+// and target deltas live in buffer textures, every instance fetches its own
+// weight row and model matrix by gl_InstanceID.
+//
+// The triangles are reordered for the post-transform cache and the vertices
+// renumbered in first-use order at load, so each instance runs the blend
+// about once per vertex rather than once per corner. With set_skin() the blended
+// vertex is then skinned by the joints in the Skin uniform block.
+//
+// With a LodChain, every level's triangles go into the same element buffer
+// (each cache-optimized on its own) and index the same texels, because a
+// level's vertices are original vertices. select_levels() sorts the
+// instances by level from their projected size and draw() issues one
+// instanced draw per level, so distant heads run the blend for only the
+// vertices their level keeps.
+class CrowdRenderer
+{
+public:
+  // corners: base vertex index of every triangle corner
+  CrowdRenderer(const Shader &shader, const std::pmr::vector<int> &corners,
+                const std::vector<tinyobj::real_t> &base_vertices,
+                const std::vector<tinyobj::real_t> &base_normals,
+                const std::vector<std::vector<tinyobj::real_t>> &target_vertices,
+                const std::vector<std::vector<tinyobj::real_t>> &target_normals,
+                const LodChain *lods = nullptr)
+      : shader(shader), lods(lods),
+        num_vertices((int)(base_vertices.size() / 3)),
+        num_targets((int)target_vertices.size())
+  {
+    MemScope mem_scope(MEM_GL_STAGING);
+
+    std::vector<uint32_t> indices(corners.begin(), corners.end());
+    acmr_before = acmr(indices, num_vertices);
+    optimize_vertex_cache(indices, num_vertices);
+    remap = optimize_vertex_fetch(indices, num_vertices);
+    acmr_after = acmr(indices, num_vertices);
+    level_first.push_back(0);
+    level_corners.push_back((GLsizei)indices.size());
+    for (size_t l = 1; lods && l < lods->size(); l++)
+    {
+      std::vector<uint32_t> level(lods->level(l).triangles);
+      for (uint32_t &v : level)
+      {
+        v = remap[v];
+      }
+      optimize_vertex_cache(level, num_vertices);
+      level_first.push_back(indices.size());
+      level_corners.push_back((GLsizei)level.size());
+      indices.insert(indices.end(), level.begin(), level.end());
+    }
+    level_instances.assign(level_corners.size(), 0);
+
+    // texel v is the base vertex, texel (t + 1) * V + v the delta of target t;
+    // RGB32F buffer textures need GL 4.0, so pad to RGBA
+    std::vector<float> positions((size_t)(num_targets + 1) * num_vertices * 4, 0.0f);
+    std::vector<float> normals(positions.size(), 0.0f);
+    for (int v = 0; v < num_vertices; v++)
+    {
+      size_t texel = remap[v] * 4;
+      for (int d = 0; d < 3; d++)
+      {
+        positions[texel + d] = (float)base_vertices[v * 3 + d];
+        normals[texel + d] = (float)base_normals[v * 3 + d];
+      }
+    }
+    for (int t = 0; t < num_targets; t++)
+    {
+      size_t block = (size_t)(t + 1) * num_vertices * 4;
+      for (int v = 0; v < num_vertices; v++)
+      {
+        size_t texel = block + remap[v] * 4;
+        for (int d = 0; d < 3; d++)
+        {
+          positions[texel + d] =
+              (float)(target_vertices[t][v * 3 + d] - base_vertices[v * 3 + d]);
+          normals[texel + d] =
+              (float)(target_normals[t][v * 3 + d] - base_normals[v * 3 + d]);
+        }
+      }
+    }
+
+    GLint max_texels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    if ((size_t)max_texels < positions.size() / 4)
+    {
+      std::cout << "ERROR::CROWD::BASIS_EXCEEDS_TEXTURE_BUFFER_SIZE: "
+                << positions.size() / 4 << " > " << max_texels << std::endl;
+    }
+
+    create_buffer_texture(positions_buffer, positions_texture, GL_RGBA32F,
+                          positions.size() * sizeof(float), positions.data());
+    create_buffer_texture(normals_buffer, normals_texture, GL_RGBA32F,
+                          normals.size() * sizeof(float), normals.data());
+    create_buffer_texture(weights_buffer, weights_texture, GL_R32F, 0, NULL);
+
+    glGenVertexArrays(1, &VAO);
+    glBindVertexArray(VAO);
+
+    // per vertex: which (remapped) base vertex to blend, and the triangles
+    std::vector<int> vertex_ids(num_vertices);
+    for (int v = 0; v < num_vertices; v++)
+    {
+      vertex_ids[v] = v;
+    }
+    glGenBuffers(1, &VBO_vertex_ids);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_vertex_ids);
+    glBufferData(GL_ARRAY_BUFFER, vertex_ids.size() * sizeof(int), vertex_ids.data(),
+                 GL_STATIC_DRAW);
+    GLuint vertex_id_loc = shader.getAttribLocation("aVertexId");
+    glVertexAttribIPointer(vertex_id_loc, 1, GL_INT, sizeof(int), (void *)0);
+    glEnableVertexAttribArray(vertex_id_loc);
+    glGenBuffers(1, &EBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(),
+                 GL_STATIC_DRAW);
+
+    // per instance: model matrix, one vec4 column per attribute slot
+    glGenBuffers(1, &VBO_transforms);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_transforms);
+    model_loc = shader.getAttribLocation("aModel");
+    for (GLuint c = 0; c < 4; c++)
+    {
+      glVertexAttribPointer(model_loc + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                            (void *)(c * sizeof(glm::vec4)));
+      glEnableVertexAttribArray(model_loc + c);
+      glVertexAttribDivisor(model_loc + c, 1);
+    }
+    glBindVertexArray(0);
+
+    positions_loc = shader.uniform<int>("uPositions");
+    normals_loc = shader.uniform<int>("uNormals");
+    weights_loc = shader.uniform<int>("uWeights");
+    num_vertices_loc = shader.uniform<int>("uNumVertices");
+    num_targets_loc = shader.uniform<int>("uNumTargets");
+    first_instance_loc = shader.uniform<int>("uFirstInstance");
+    skin_joints_loc = shader.uniform<int>("uSkinJoints");
+    skin_weights_loc = shader.uniform<int>("uSkinWeights");
+    skin_method_loc = shader.uniform<int>("uSkinMethod");
+  }
+
+  ~CrowdRenderer()
+  {
+    GLuint textures[] = {positions_texture, normals_texture, weights_texture,
+                         skin_joints_texture, skin_weights_texture};
+    GLuint buffers[] = {positions_buffer, normals_buffer, weights_buffer,
+                        skin_joints_buffer, skin_weights_buffer,
+                        VBO_vertex_ids, VBO_transforms, EBO};
+    glDeleteTextures(5, textures);
+    glDeleteBuffers(8, buffers);
+    glDeleteVertexArrays(1, &VAO);
+  }
+
+  CrowdRenderer(const CrowdRenderer &) = delete;
+  CrowdRenderer &operator=(const CrowdRenderer &) = delete;
+
+  // one weight row (num_targets values, missing ones are zero) and one
+  // transform per instance, cycling through `weights` if it is shorter
+  // (neutral when it is empty); every instance starts at level 0
+  void set_instances(const std::vector<std::vector<tinyobj::real_t>> &weights,
+                     const std::vector<glm::mat4> &transforms)
+  {
+    MemScope mem_scope(MEM_GL_STAGING);
+    num_instances = (GLsizei)transforms.size();
+    instance_transforms = transforms;
+
+    instance_rows.assign((size_t)num_instances * num_targets, 0.0f);
+    for (GLsizei i = 0; i < num_instances && !weights.empty(); i++)
+    {
+      const std::vector<tinyobj::real_t> &row = weights[i % weights.size()];
+      for (size_t t = 0; t < row.size() && t < (size_t)num_targets; t++)
+      {
+        instance_rows[(size_t)i * num_targets + t] = (float)row[t];
+      }
+    }
+    instance_levels.assign(num_instances, 0);
+    upload_instances();
+  }
+
+  // pick every instance's level from the projected radius of its bounding
+  // sphere (perspective with vertical field of view `fov_y` radians onto
+  // `viewport_height` pixels); re-uploads the instances only when an
+  // assignment changed
+  void select_levels(const glm::vec3 &eye, float fov_y, float viewport_height,
+                     float tolerance = 1.0f)
+  {
+    if (!lods)
+    {
+      return;
+    }
+    float pixels = 0.5f * viewport_height / std::tan(0.5f * fov_y);
+    bool changed = false;
+    for (GLsizei i = 0; i < num_instances; i++)
+    {
+      const glm::mat4 &m = instance_transforms[i];
+      float scale = std::max({glm::length(glm::vec3(m[0])), glm::length(glm::vec3(m[1])),
+                              glm::length(glm::vec3(m[2]))});
+      glm::vec3 center = glm::vec3(m * glm::vec4(lods->bounds_center(), 1.0f));
+      float distance = std::max(glm::length(center - eye), 1e-6f);
+      int level = (int)lods->select(lods->bounds_radius() * scale * pixels / distance, tolerance);
+      changed |= level != instance_levels[i];
+      instance_levels[i] = level;
+    }
+    if (changed)
+    {
+      upload_instances();
+    }
+  }
+
+  // instances drawn at level l by the last set_instances()/select_levels()
+  GLsizei instances_at(size_t level) const
+  {
+    return level_instances[level];
+  }
+
+  // skin every instance with `binding`; the pose comes from the Skin block
+  // (see skin_block())
+  void set_skin(const SkinBinding &binding, SkinMethod method)
+  {
+    MemScope mem_scope(MEM_GL_STAGING);
+    if (binding.empty() || binding.num_vertices() != (size_t)num_vertices)
+    {
+      std::cout << "ERROR::CROWD::SKIN_MISMATCH" << std::endl;
+      return;
+    }
+    std::vector<int32_t> joints((size_t)num_vertices * 4);
+    std::vector<float> weights((size_t)num_vertices * 4);
+    for (int v = 0; v < num_vertices; v++)
+    {
+      for (size_t k = 0; k < SkinBinding::INFLUENCES; k++)
+      {
+        joints[remap[v] * 4 + k] = binding.joint_stream(k)[v];
+        weights[remap[v] * 4 + k] = binding.weight_stream(k)[v];
+      }
+    }
+    glDeleteTextures(1, &skin_joints_texture);
+    glDeleteTextures(1, &skin_weights_texture);
+    glDeleteBuffers(1, &skin_joints_buffer);
+    glDeleteBuffers(1, &skin_weights_buffer);
+    create_buffer_texture(skin_joints_buffer, skin_joints_texture, GL_RGBA32I,
+                          joints.size() * sizeof(int32_t), joints.data());
+    create_buffer_texture(skin_weights_buffer, skin_weights_texture, GL_RGBA32F,
+                          weights.size() * sizeof(float), weights.data());
+    skin_method = method;
+  }
+
+  // draw every instance; expects `shader` to be in use
+  void draw() const
+  {
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, positions_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, normals_texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, weights_texture);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_BUFFER, skin_joints_texture);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_BUFFER, skin_weights_texture);
+
+    shader.set(positions_loc, 0);
+    shader.set(normals_loc, 1);
+    shader.set(weights_loc, 2);
+    shader.set(num_vertices_loc, num_vertices);
+    shader.set(num_targets_loc, num_targets);
+    // integer and float samplers must not share a unit even when unused
+    shader.set(skin_joints_loc, 3);
+    shader.set(skin_weights_loc, 4);
+    shader.set(skin_method_loc, (int)skin_method);
+
+    // GL 3.3 has no base instance: the transforms are re-pointed at the
+    // level's first instance and the weight rows offset by uFirstInstance
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_transforms);
+    GLsizei first = 0;
+    for (size_t l = 0; l < level_corners.size(); l++)
+    {
+      if (level_instances[l] == 0)
+      {
+        continue;
+      }
+      for (GLuint c = 0; c < 4; c++)
+      {
+        glVertexAttribPointer(model_loc + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                              (void *)(first * sizeof(glm::mat4) + c * sizeof(glm::vec4)));
+      }
+      shader.set(first_instance_loc, (int)first);
+      glDrawElementsInstanced(GL_TRIANGLES, level_corners[l], GL_UNSIGNED_INT,
+                              (void *)(level_first[l] * sizeof(uint32_t)), level_instances[l]);
+      first += level_instances[l];
+    }
+    glBindVertexArray(0);
+  }
+
+  // vertex shader runs per triangle (FIFO cache of 16) before and after
+  // the load-time reordering
+  double acmr_original() const
+  {
+    return acmr_before;
+  }
+
+  double acmr_optimized() const
+  {
+    return acmr_after;
+  }
+
+private:
+  const Shader &shader;
+  const LodChain *lods;
+  GLsizei num_instances = 0;
+  int num_vertices;
+  int num_targets;
+
+  GLuint VAO, VBO_vertex_ids, VBO_transforms, EBO;
+  GLuint model_loc;
+  std::vector<size_t> level_first;    // first corner of each level in EBO
+  std::vector<GLsizei> level_corners;
+  std::vector<GLsizei> level_instances;
+  std::vector<float> instance_rows;   // in set_instances() order
+  std::vector<glm::mat4> instance_transforms;
+  std::vector<int> instance_levels;
+  std::vector<uint32_t> remap; // base vertex -> texel
+  double acmr_before = 0, acmr_after = 0;
+  GLuint positions_buffer, positions_texture;
+  GLuint normals_buffer, normals_texture;
+  GLuint weights_buffer, weights_texture;
+  GLuint skin_joints_buffer = 0, skin_joints_texture = 0;
+  GLuint skin_weights_buffer = 0, skin_weights_texture = 0;
+  SkinMethod skin_method = SKIN_NONE;
+
+  UniformHandle<int> positions_loc, normals_loc, weights_loc;
+  UniformHandle<int> num_vertices_loc, num_targets_loc, first_instance_loc;
+  UniformHandle<int> skin_joints_loc, skin_weights_loc, skin_method_loc;
+
+  // weight rows and transforms grouped by level, levels in order
+  void upload_instances()
+  {
+    MemScope mem_scope(MEM_GL_STAGING);
+    std::fill(level_instances.begin(), level_instances.end(), 0);
+    for (int level : instance_levels)
+    {
+      level_instances[level]++;
+    }
+    std::vector<GLsizei> next(level_instances.size(), 0);
+    for (size_t l = 1; l < next.size(); l++)
+    {
+      next[l] = next[l - 1] + level_instances[l - 1];
+    }
+    std::vector<float> rows(instance_rows.size());
+    std::vector<glm::mat4> transforms(instance_transforms.size());
+    for (GLsizei i = 0; i < num_instances; i++)
+    {
+      GLsizei slot = next[instance_levels[i]]++;
+      const float *row = instance_rows.data() + (size_t)i * num_targets;
+      std::copy(row, row + num_targets, rows.data() + (size_t)slot * num_targets);
+      transforms[slot] = instance_transforms[i];
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, weights_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, rows.size() * sizeof(float), rows.data(),
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_transforms);
+    glBufferData(GL_ARRAY_BUFFER, transforms.size() * sizeof(glm::mat4),
+                 transforms.data(), GL_DYNAMIC_DRAW);
+  }
+
+  static void create_buffer_texture(GLuint &buffer, GLuint &texture,
+                                    GLenum format, size_t size,
+                                    const void *data)
+  {
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+  }
+};
+
+static_assert(SkinBinding::MAX_JOINTS == sizeof(SkinBlock::real) / sizeof(glm::vec4),
+              "Skin block size");
+
+// the Skin block of a pose; joints past the pose are left at zero
+inline SkinBlock skin_block(const SkinPose &pose)
+{
+  SkinBlock block = {};
+  std::copy(pose.rows().begin(), pose.rows().end(), block.rows);
+  std::copy(pose.rotations().begin(), pose.rotations().end(), block.real);
+  std::copy(pose.duals().begin(), pose.duals().end(), block.dual);
+  return block;
+}
+
+#endif // !CROWD_H
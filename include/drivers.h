@@ -0,0 +1,629 @@
+#ifndef DRIVERS_H
+#define DRIVERS_H
+
+#include <algorithm>
+#include <arena.h>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory_resource>
+#include <scheduler.h>
+#include <sstream>
+#include <string>
+#include <trace.h>
+#include <vector>
+
+// a high-level rig control and its value when an instance does not set it
+struct DriverControl
+{
+  std::string name;
+  double value = 0;
+};
+
+// weights[target] = expression over the controls
+struct DriverSource
+{
+  int target;
+  std::string expression;
+};
+
+// Weight drivers compiled to flat three-address bytecode. Registers hold the
+// controls first, then the constants, then one temporary per operation of a
+// driver (reused by the next driver), so evaluation is a single pass over a
+// short instruction list with no parsing, lookups or allocation. Expressions
+// use numbers, control names, + - * / and
+//
+//   min(a, b)  max(a, b)  abs(x)  clamp(x, lo, hi)
+//   remap(x, from_lo, from_hi, to_lo, to_hi)
+//   pos(x) = max(x, 0)  neg(x) = max(-x, 0)
+//
+// pos/neg split one signed control into mirrored left/right weights. clamp,
+// remap, pos and neg are expanded into min/max and arithmetic ops at compile
+// time, and constant subexpressions are folded. Targets without a driver
+// keep their weight.
+class DriverProgram
+{
+public:
+  // instances evaluated together by evaluate_batch(), one per SIMD lane
+  static constexpr size_t LANES = 64;
+
+  DriverProgram() = default;
+
+  DriverProgram(const std::vector<DriverControl> &controls,
+                const std::vector<DriverSource> &drivers)
+  {
+    for (const auto &control : controls)
+    {
+      names.push_back(control.name);
+      defaults.push_back(control.value);
+    }
+    for (const auto &driver : drivers)
+    {
+      compile(driver);
+    }
+    relocate();
+    register_count = names.size() + constants.size() + temp_high;
+  }
+
+  size_t num_controls() const
+  {
+    return names.size();
+  }
+
+  // one past the highest driven target
+  size_t num_targets() const
+  {
+    return target_count;
+  }
+
+  size_t num_drivers() const
+  {
+    return driver_count;
+  }
+
+  size_t num_instructions() const
+  {
+    return code.size();
+  }
+
+  bool empty() const
+  {
+    return driver_count == 0;
+  }
+
+  // index of a control, or -1
+  int control(const std::string &name) const
+  {
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      if (names[i] == name)
+      {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+
+  // every control at its default value
+  std::vector<double> default_controls() const
+  {
+    return defaults;
+  }
+
+  // writes the driven entries of `weights` (num_targets() entries)
+  void evaluate(const double *controls, double *weights) const
+  {
+    ArenaScope scratch;
+    double *registers = static_cast<double *>(
+        scratch.resource()->allocate(register_count * sizeof(double), alignof(double)));
+    load(controls, registers, 1, 0);
+    for (const Instruction &op : code)
+    {
+      if (op.op == STORE)
+      {
+        weights[op.dst] = registers[op.a];
+      }
+      else
+      {
+        registers[op.dst] = apply(op.op, registers[op.a], registers[op.b]);
+      }
+    }
+  }
+
+  // `count` instances: controls are count x num_controls(), weights
+  // count x weight_stride, both row-major. Instances run LANES at a time
+  // with every register as a lane vector, so each instruction is one
+  // vectorizable loop.
+  void evaluate_batch(JobScheduler &scheduler, const double *controls, size_t count,
+                      double *weights, size_t weight_stride) const
+  {
+    TRACE_SCOPE("DriverProgram::evaluate_batch");
+    size_t C = names.size();
+    scheduler.parallel_for(0, (count + LANES - 1) / LANES, 1, [&](size_t begin, size_t end)
+                           {
+                             ArenaScope scratch;
+                             double *registers = static_cast<double *>(scratch.resource()->allocate(
+                                 register_count * LANES * sizeof(double), 64));
+                             for (size_t group = begin; group < end; group++)
+                             {
+                               size_t first = group * LANES;
+                               size_t n = std::min(LANES, count - first);
+                               load(controls + first * C, registers, LANES, n);
+                               for (const Instruction &op : code)
+                               {
+                                 const double *a = registers + op.a * LANES;
+                                 if (op.op == STORE)
+                                 {
+                                   double *out = weights + first * weight_stride + op.dst;
+                                   for (size_t l = 0; l < n; l++)
+                                   {
+                                     out[l * weight_stride] = a[l];
+                                   }
+                                   continue;
+                                 }
+                                 run(op.op, registers + op.dst * LANES, a, registers + op.b * LANES);
+                               }
+                             }
+                           });
+  }
+
+private:
+  enum Op : uint8_t
+  {
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    MIN,
+    MAX,
+    NEG,
+    ABS,
+    STORE, // weights[dst] = r[a]
+  };
+
+  struct Instruction
+  {
+    Op op;
+    uint32_t dst, a, b;
+  };
+
+  // operand while compiling: a register, or a constant not yet interned
+  struct Value
+  {
+    bool constant;
+    double number;
+    uint32_t reg;
+  };
+
+  std::vector<std::string> names;
+  std::vector<double> defaults;
+  std::vector<double> constants;
+  std::vector<Instruction> code;
+  size_t register_count = 0;
+  size_t target_count = 0;
+  size_t driver_count = 0;
+
+  // compile state: temporaries are numbered from 0 per driver and moved
+  // above the constants once the constant count is known
+  static constexpr uint32_t TEMP = 1u << 31;
+  uint32_t temp_count = 0, temp_high = 0;
+  std::string text;
+  size_t pos = 0;
+  bool failed = false;
+
+  static double apply(Op op, double a, double b)
+  {
+    switch (op)
+    {
+    case ADD:
+      return a + b;
+    case SUB:
+      return a - b;
+    case MUL:
+      return a * b;
+    case DIV:
+      return b != 0 ? a / b : 0.0;
+    case MIN:
+      return std::min(a, b);
+    case MAX:
+      return std::max(a, b);
+    case NEG:
+      return -a;
+    case ABS:
+      return std::abs(a);
+    default:
+      return 0;
+    }
+  }
+
+  template <typename F>
+  static void lanes(double *__restrict dst, const double *__restrict a,
+                    const double *__restrict b, F f)
+  {
+    for (size_t l = 0; l < LANES; l++)
+    {
+      dst[l] = f(a[l], b[l]);
+    }
+  }
+
+  static void run(Op op, double *dst, const double *a, const double *b)
+  {
+    switch (op)
+    {
+    case ADD:
+      lanes(dst, a, b, [](double x, double y)
+            { return x + y; });
+      break;
+    case SUB:
+      lanes(dst, a, b, [](double x, double y)
+            { return x - y; });
+      break;
+    case MUL:
+      lanes(dst, a, b, [](double x, double y)
+            { return x * y; });
+      break;
+    case DIV:
+      lanes(dst, a, b, [](double x, double y)
+            { return y != 0 ? x / y : 0.0; });
+      break;
+    case MIN:
+      lanes(dst, a, b, [](double x, double y)
+            { return y < x ? y : x; });
+      break;
+    case MAX:
+      lanes(dst, a, b, [](double x, double y)
+            { return x < y ? y : x; });
+      break;
+    case NEG:
+      lanes(dst, a, b, [](double x, double)
+            { return -x; });
+      break;
+    case ABS:
+      lanes(dst, a, b, [](double x, double)
+            { return std::abs(x); });
+      break;
+    default:
+      break;
+    }
+  }
+
+  // controls and constants into the register file (`width` lanes per
+  // register, `n` of them real instances); width 1 is the scalar path
+  void load(const double *controls, double *registers, size_t width, size_t n) const
+  {
+    size_t C = names.size();
+    if (width == 1)
+    {
+      std::copy(controls, controls + C, registers);
+    }
+    else
+    {
+      for (size_t c = 0; c < C; c++)
+      {
+        double *lane = registers + c * width;
+        for (size_t l = 0; l < n; l++)
+        {
+          lane[l] = controls[l * C + c];
+        }
+        std::fill(lane + n, lane + width, 0.0);
+      }
+    }
+    for (size_t k = 0; k < constants.size(); k++)
+    {
+      std::fill(registers + (C + k) * width, registers + (C + k + 1) * width, constants[k]);
+    }
+  }
+
+  void compile(const DriverSource &driver)
+  {
+    text = driver.expression;
+    pos = 0;
+    failed = false;
+    temp_count = 0;
+    size_t code_size = code.size();
+    size_t constant_count = constants.size();
+
+    Value value = expression();
+    skip_space();
+    if (!failed && pos != text.size())
+    {
+      error("unexpected '" + text.substr(pos) + "'");
+    }
+    if (driver.target < 0)
+    {
+      error("bad target");
+    }
+    if (failed)
+    {
+      code.resize(code_size);
+      constants.resize(constant_count);
+      return;
+    }
+
+    code.push_back({STORE, (uint32_t)driver.target, operand(value), 0});
+    target_count = std::max(target_count, (size_t)driver.target + 1);
+    temp_high = std::max(temp_high, temp_count);
+    driver_count++;
+  }
+
+  // temporaries go above the final constants; STORE's dst is a target
+  void relocate()
+  {
+    uint32_t first = (uint32_t)(names.size() + constants.size());
+    for (Instruction &op : code)
+    {
+      for (uint32_t *reg : {&op.dst, &op.a, &op.b})
+      {
+        if ((*reg & TEMP) && !(reg == &op.dst && op.op == STORE))
+        {
+          *reg = (*reg & ~TEMP) + first;
+        }
+      }
+    }
+  }
+
+  void error(const std::string &message)
+  {
+    if (!failed)
+    {
+      std::cout << "ERROR::DRIVER::COMPILE: " << message << " in '" << text << "'" << std::endl;
+    }
+    failed = true;
+  }
+
+  // register of a value, interning constants
+  uint32_t operand(const Value &value)
+  {
+    if (!value.constant)
+    {
+      return value.reg;
+    }
+    for (size_t k = 0; k < constants.size(); k++)
+    {
+      if (constants[k] == value.number)
+      {
+        return (uint32_t)(names.size() + k);
+      }
+    }
+    constants.push_back(value.number);
+    return (uint32_t)(names.size() + constants.size() - 1);
+  }
+
+  Value emit(Op op, Value a, Value b)
+  {
+    if (failed)
+    {
+      return {true, 0, 0};
+    }
+    if (a.constant && b.constant)
+    {
+      return {true, apply(op, a.number, b.number), 0};
+    }
+    uint32_t ra = operand(a), rb = operand(b);
+    uint32_t dst = TEMP | temp_count++;
+    code.push_back({op, dst, ra, rb});
+    return {false, 0, dst};
+  }
+
+  Value constant(double number)
+  {
+    return {true, number, 0};
+  }
+
+  void skip_space()
+  {
+    while (pos < text.size() && std::isspace((unsigned char)text[pos]))
+    {
+      pos++;
+    }
+  }
+
+  bool accept(char c)
+  {
+    skip_space();
+    if (pos < text.size() && text[pos] == c)
+    {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(char c)
+  {
+    if (!accept(c))
+    {
+      error(std::string("expected '") + c + "'");
+    }
+  }
+
+  // expression := term (('+' | '-') term)*
+  Value expression()
+  {
+    Value value = term();
+    while (!failed)
+    {
+      if (accept('+'))
+      {
+        value = emit(ADD, value, term());
+      }
+      else if (accept('-'))
+      {
+        value = emit(SUB, value, term());
+      }
+      else
+      {
+        break;
+      }
+    }
+    return value;
+  }
+
+  // term := unary (('*' | '/') unary)*
+  Value term()
+  {
+    Value value = unary();
+    while (!failed)
+    {
+      if (accept('*'))
+      {
+        value = emit(MUL, value, unary());
+      }
+      else if (accept('/'))
+      {
+        value = emit(DIV, value, unary());
+      }
+      else
+      {
+        break;
+      }
+    }
+    return value;
+  }
+
+  // unary := '-' unary | primary
+  Value unary()
+  {
+    if (accept('-'))
+    {
+      Value value = unary();
+      return emit(NEG, value, value);
+    }
+    return primary();
+  }
+
+  // primary := number | control | function '(' arguments ')' | '(' expression ')'
+  Value primary()
+  {
+    skip_space();
+    if (accept('('))
+    {
+      Value value = expression();
+      expect(')');
+      return value;
+    }
+    if (pos < text.size() && (std::isdigit((unsigned char)text[pos]) || text[pos] == '.'))
+    {
+      char *end = nullptr;
+      double number = std::strtod(text.c_str() + pos, &end);
+      pos = end - text.c_str();
+      return constant(number);
+    }
+
+    size_t start = pos;
+    while (pos < text.size() && (std::isalnum((unsigned char)text[pos]) || text[pos] == '_'))
+    {
+      pos++;
+    }
+    std::string name = text.substr(start, pos - start);
+    if (name.empty())
+    {
+      error("expected a value");
+      return constant(0);
+    }
+    if (accept('('))
+    {
+      return call(name);
+    }
+    int index = control(name);
+    if (index < 0)
+    {
+      error("unknown control '" + name + "'");
+      return constant(0);
+    }
+    return {false, 0, (uint32_t)index};
+  }
+
+  Value call(const std::string &name)
+  {
+    Value args[5];
+    int count = 0;
+    if (!accept(')'))
+    {
+      do
+      {
+        if (count == 5)
+        {
+          error("too many arguments to " + name);
+          return constant(0);
+        }
+        args[count++] = expression();
+      } while (!failed && accept(','));
+      expect(')');
+    }
+    if (failed)
+    {
+      return constant(0);
+    }
+
+    auto arity = [&](int n)
+    {
+      if (count != n)
+      {
+        error(name + " takes " + std::to_string(n) + " arguments");
+      }
+      return count == n;
+    };
+    if (name == "min" && arity(2))
+    {
+      return emit(MIN, args[0], args[1]);
+    }
+    if (name == "max" && arity(2))
+    {
+      return emit(MAX, args[0], args[1]);
+    }
+    if (name == "abs" && arity(1))
+    {
+      return emit(ABS, args[0], args[0]);
+    }
+    if (name == "pos" && arity(1))
+    {
+      return emit(MAX, args[0], constant(0));
+    }
+    if (name == "neg" && arity(1))
+    {
+      return emit(MAX, emit(SUB, constant(0), args[0]), constant(0));
+    }
+    if (name == "clamp" && arity(3))
+    {
+      return emit(MIN, emit(MAX, args[0], args[1]), args[2]);
+    }
+    if (name == "remap" && arity(5))
+    {
+      // to_lo + (x - from_lo) / (from_hi - from_lo) * (to_hi - to_lo)
+      Value t = emit(DIV, emit(SUB, args[0], args[1]), emit(SUB, args[2], args[1]));
+      return emit(ADD, args[3], emit(MUL, t, emit(SUB, args[4], args[3])));
+    }
+    if (!failed)
+    {
+      error("unknown function '" + name + "'");
+    }
+    return constant(0);
+  }
+};
+
+// controls of one instance, one "<name> <value>" pair per line; controls
+// that are not listed keep their default
+inline std::vector<double> load_controls(const std::string &file_path, const DriverProgram &program)
+{
+  std::vector<double> controls = program.default_controls();
+  std::ifstream file(file_path);
+  std::string name;
+  double value;
+  while (file >> name >> value)
+  {
+    int index = program.control(name);
+    if (index < 0)
+    {
+      std::cout << "ERROR::DRIVER::UNKNOWN_CONTROL: " << name << " in " << file_path << std::endl;
+      continue;
+    }
+    controls[index] = value;
+  }
+  return controls;
+}
+
+#endif // !DRIVERS_H
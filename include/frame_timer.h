@@ -0,0 +1,388 @@
+#ifndef FRAME_TIMER_H
+#define FRAME_TIMER_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <arena.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+// CPU stages of one frame of the render loop
+enum FrameStage
+{
+  STAGE_INPUT,
+  STAGE_BLEND,
+  STAGE_UPLOAD,
+  STAGE_DRAW,
+  STAGE_SWAP,
+  STAGE_COUNT
+};
+
+static const char *const FRAME_STAGE_NAMES[STAGE_COUNT] = {
+    "input", "blend", "upload", "draw", "swap"};
+
+// Per-frame CPU stage timers plus GL_TIME_ELAPSED queries around the GPU
+// work. Frames are kept in a fixed ring for rolling percentiles and export.
+// GPU queries are read back a few frames late from a small ring, and only
+// once GL_QUERY_RESULT_AVAILABLE says so, so the CPU never stalls on them.
+class FrameTimer
+{
+public:
+  struct Frame
+  {
+    uint64_t index;
+    double start_us;
+    double frame_ms;
+    double stage_start_us[STAGE_COUNT];
+    double stage_ms[STAGE_COUNT];
+    double gpu_ms; // negative until (or unless) the query result arrives
+  };
+
+  // RAII stage timer
+  class Scope
+  {
+  public:
+    Scope(FrameTimer &timer, FrameStage stage) : timer(timer), stage(stage)
+    {
+      timer.begin_stage(stage);
+    }
+
+    ~Scope()
+    {
+      timer.end_stage(stage);
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    FrameTimer &timer;
+    FrameStage stage;
+  };
+
+  // history: frames kept for percentiles and export; gpu: issue timer queries
+  // (needs a current GL context)
+  explicit FrameTimer(size_t history = 1024, bool gpu = true)
+      : frames(std::max<size_t>(1, history)), gpu(gpu),
+        epoch(std::chrono::steady_clock::now())
+  {
+    if (gpu)
+    {
+      glGenQueries(QUERY_RING, queries);
+    }
+  }
+
+  ~FrameTimer()
+  {
+    if (gpu)
+    {
+      glDeleteQueries(QUERY_RING, queries);
+    }
+  }
+
+  FrameTimer(const FrameTimer &) = delete;
+  FrameTimer &operator=(const FrameTimer &) = delete;
+
+  void begin_frame()
+  {
+    Frame &frame = frames[count % frames.size()];
+    frame = Frame();
+    frame.index = count;
+    frame.start_us = now_us();
+    frame.gpu_ms = -1.0;
+    poll_queries();
+  }
+
+  void end_frame()
+  {
+    Frame &frame = frames[count % frames.size()];
+    frame.frame_ms = (now_us() - frame.start_us) * 1e-3;
+    count++;
+  }
+
+  void begin_stage(FrameStage stage)
+  {
+    current().stage_start_us[stage] = now_us();
+  }
+
+  void end_stage(FrameStage stage)
+  {
+    Frame &frame = current();
+    frame.stage_ms[stage] += (now_us() - frame.stage_start_us[stage]) * 1e-3;
+  }
+
+  // bracket the GL commands whose GPU time should be measured; at most one
+  // pair per frame (GL_TIME_ELAPSED queries cannot nest)
+  void begin_gpu()
+  {
+    if (!gpu)
+    {
+      return;
+    }
+    Query &query = pending[count % QUERY_RING];
+    if (query.active)
+    {
+      // the ring slot is still in flight: drop this frame's sample rather than wait
+      gpu_skipped++;
+      gpu_open = false;
+      return;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, queries[count % QUERY_RING]);
+    query.frame = count;
+    gpu_open = true;
+  }
+
+  void end_gpu()
+  {
+    if (!gpu_open)
+    {
+      return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[count % QUERY_RING].active = true;
+    gpu_open = false;
+  }
+
+  uint64_t frame_count() const
+  {
+    return count;
+  }
+
+  // p in [0, 100] over the frames still in the ring
+  double frame_percentile(double p) const
+  {
+    return percentile([](const Frame &f)
+                      { return f.frame_ms; },
+                      p);
+  }
+
+  double stage_percentile(FrameStage stage, double p) const
+  {
+    return percentile([stage](const Frame &f)
+                      { return f.stage_ms[stage]; },
+                      p);
+  }
+
+  double gpu_percentile(double p) const
+  {
+    return percentile([](const Frame &f)
+                      { return f.gpu_ms; },
+                      p);
+  }
+
+  // one-line summary suited for a window title, written into `text`
+  // without allocating
+  void summary(char *text, size_t size) const
+  {
+    std::snprintf(text, size,
+                  "frame p50 %.2f p99 %.2f ms | gpu p50 %.2f p99 %.2f ms",
+                  frame_percentile(50), frame_percentile(99),
+                  gpu_percentile(50), gpu_percentile(99));
+  }
+
+  std::string summary() const
+  {
+    char text[160];
+    summary(text, sizeof(text));
+    return text;
+  }
+
+  bool write_csv(const std::string &path) const
+  {
+    std::ofstream out(path);
+    out << "frame,start_us,frame_ms,gpu_ms";
+    for (const char *name : FRAME_STAGE_NAMES)
+    {
+      out << "," << name << "_ms";
+    }
+    out << "\n";
+    for_each_frame([&](const Frame &f)
+                   {
+                     out << f.index << "," << f.start_us << "," << f.frame_ms << "," << f.gpu_ms;
+                     for (int s = 0; s < STAGE_COUNT; s++)
+                     {
+                       out << "," << f.stage_ms[s];
+                     }
+                     out << "\n";
+                   });
+    return (bool)out;
+  }
+
+  // rolling percentiles plus the raw frames
+  bool write_json(const std::string &path) const
+  {
+    std::ofstream out(path);
+    const double ps[] = {50, 90, 99, 99.9};
+    out << "{\n  \"frames\": " << std::min<uint64_t>(count, frames.size())
+        << ",\n  \"gpu_samples_skipped\": " << gpu_skipped
+        << ",\n  \"percentiles_ms\": {\n";
+    auto row = [&](const std::string &name, auto &&value, bool last)
+    {
+      out << "    \"" << name << "\": {";
+      for (size_t i = 0; i < 4; i++)
+      {
+        out << (i ? ", " : "") << "\"p" << ps[i] << "\": " << value(ps[i]);
+      }
+      out << (last ? "}\n" : "},\n");
+    };
+    row("frame", [&](double p)
+        { return frame_percentile(p); },
+        false);
+    row("gpu", [&](double p)
+        { return gpu_percentile(p); },
+        false);
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+      row(FRAME_STAGE_NAMES[s], [&](double p)
+          { return stage_percentile((FrameStage)s, p); },
+          s == STAGE_COUNT - 1);
+    }
+    out << "  },\n  \"raw\": [\n";
+    bool first = true;
+    for_each_frame([&](const Frame &f)
+                   {
+                     out << (first ? "" : ",\n") << "    {\"frame\": " << f.index
+                         << ", \"frame_ms\": " << f.frame_ms << ", \"gpu_ms\": " << f.gpu_ms;
+                     for (int s = 0; s < STAGE_COUNT; s++)
+                     {
+                       out << ", \"" << FRAME_STAGE_NAMES[s] << "_ms\": " << f.stage_ms[s];
+                     }
+                     out << "}";
+                     first = false;
+                   });
+    out << "\n  ]\n}\n";
+    return (bool)out;
+  }
+
+  // Chrome trace event format (chrome://tracing, ui.perfetto.dev); the GPU
+  // time is drawn on its own track, aligned with the draw stage
+  bool write_chrome_trace(const std::string &path) const
+  {
+    std::ofstream out(path);
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"cpu frame\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"gpu\"}}";
+    for_each_frame([&](const Frame &f)
+                   {
+                     out << ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << f.start_us
+                         << ",\"dur\":" << f.frame_ms * 1e3 << ",\"args\":{\"index\":" << f.index << "}}";
+                     for (int s = 0; s < STAGE_COUNT; s++)
+                     {
+                       if (f.stage_ms[s] > 0)
+                       {
+                         out << ",\n{\"name\":\"" << FRAME_STAGE_NAMES[s] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+                             << f.stage_start_us[s] << ",\"dur\":" << f.stage_ms[s] * 1e3 << "}";
+                       }
+                     }
+                     if (f.gpu_ms >= 0)
+                     {
+                       out << ",\n{\"name\":\"gpu draw\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":"
+                           << f.stage_start_us[STAGE_DRAW] << ",\"dur\":" << f.gpu_ms * 1e3 << "}";
+                     }
+                   });
+    out << "\n]}\n";
+    return (bool)out;
+  }
+
+private:
+  static const int QUERY_RING = 4;
+
+  struct Query
+  {
+    uint64_t frame = 0;
+    bool active = false;
+  };
+
+  std::vector<Frame> frames;
+  uint64_t count = 0;
+  bool gpu;
+  bool gpu_open = false;
+  uint64_t gpu_skipped = 0;
+  GLuint queries[QUERY_RING];
+  Query pending[QUERY_RING];
+  std::chrono::steady_clock::time_point epoch;
+
+  Frame &current()
+  {
+    return frames[count % frames.size()];
+  }
+
+  double now_us() const
+  {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+  }
+
+  // collect finished queries without blocking
+  void poll_queries()
+  {
+    if (!gpu)
+    {
+      return;
+    }
+    for (int i = 0; i < QUERY_RING; i++)
+    {
+      if (!pending[i].active)
+      {
+        continue;
+      }
+      GLint available = 0;
+      glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+      {
+        continue;
+      }
+      GLuint64 elapsed_ns = 0;
+      glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed_ns);
+      pending[i].active = false;
+
+      // the frame may already have left the history ring
+      Frame &frame = frames[pending[i].frame % frames.size()];
+      if (frame.index == pending[i].frame)
+      {
+        frame.gpu_ms = elapsed_ns * 1e-6;
+      }
+    }
+  }
+
+  template <typename F>
+  void for_each_frame(F fn) const
+  {
+    uint64_t first = count > frames.size() ? count - frames.size() : 0;
+    for (uint64_t i = first; i < count; i++)
+    {
+      fn(frames[i % frames.size()]);
+    }
+  }
+
+  // negative samples (GPU results not in yet) are ignored; the sample copy
+  // lives in the thread's scratch arena
+  template <typename F>
+  double percentile(F value, double p) const
+  {
+    ArenaScope scratch;
+    std::pmr::vector<double> samples(scratch.resource());
+    samples.reserve(std::min<uint64_t>(count, frames.size()));
+    for_each_frame([&](const Frame &f)
+                   {
+                     double v = value(f);
+                     if (v >= 0)
+                     {
+                       samples.push_back(v);
+                     }
+                   });
+    if (samples.empty())
+    {
+      return 0.0;
+    }
+    size_t k = std::min(samples.size() - 1, (size_t)(p / 100.0 * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+  }
+};
+
+#endif // !FRAME_TIMER_H
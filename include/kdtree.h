@@ -0,0 +1,157 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Static 3D k-d tree over xyz points. The tree is implicit: `order` is
+// arranged so that the middle entry of every range splits it along the
+// range's widest axis, with the lower half before it and the upper half
+// after. Building is O(n log n) (one nth_element per level), a nearest
+// query is O(log n) on well spread points and neither query nor tree use
+// pointers or allocate.
+class KdTree
+{
+public:
+  KdTree() = default;
+
+  // points: interleaved xyz, copied as float
+  template <typename Vector>
+  explicit KdTree(const Vector &points)
+  {
+    size_t n = points.size() / 3;
+    position.resize(n * 3);
+    for (size_t i = 0; i < n * 3; i++)
+    {
+      position[i] = (float)points[i];
+    }
+    order.resize(n);
+    axes.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+      order[i] = (uint32_t)i;
+    }
+    build(0, n);
+  }
+
+  size_t size() const
+  {
+    return order.size();
+  }
+
+  // index of the point closest to q, or -1 if none is within max_distance
+  long nearest(const double q[3],
+               double max_distance = std::numeric_limits<double>::infinity()) const
+  {
+    long best = -1;
+    double best_d2 = max_distance * max_distance;
+
+    // ranges still to visit with the squared distance to their split plane
+    struct Pending
+    {
+      size_t lo, hi;
+      double plane_d2;
+    };
+    Pending stack[128];
+    int top = 0;
+    stack[top++] = {0, order.size(), 0.0};
+    while (top > 0)
+    {
+      Pending range = stack[--top];
+      if (range.lo >= range.hi || range.plane_d2 > best_d2)
+      {
+        continue;
+      }
+      size_t mid = (range.lo + range.hi) / 2;
+      const float *p = &position[order[mid] * 3];
+      double d2 = 0;
+      for (int c = 0; c < 3; c++)
+      {
+        d2 += (q[c] - p[c]) * (q[c] - p[c]);
+      }
+      if (d2 <= best_d2)
+      {
+        best_d2 = d2;
+        best = order[mid];
+      }
+
+      // near side last so it is popped first
+      int axis = axes[mid];
+      double offset = q[axis] - p[axis];
+      Pending lower = {range.lo, mid, offset > 0 ? offset * offset : 0.0};
+      Pending upper = {mid + 1, range.hi, offset < 0 ? offset * offset : 0.0};
+      if (offset < 0)
+      {
+        stack[top++] = upper;
+        stack[top++] = lower;
+      }
+      else
+      {
+        stack[top++] = lower;
+        stack[top++] = upper;
+      }
+    }
+    return best;
+  }
+
+private:
+  std::vector<float> position;
+  std::vector<uint32_t> order;
+  std::vector<uint8_t> axes; // split axis of the range whose middle is i
+
+  void build(size_t lo, size_t hi)
+  {
+    while (hi - lo > 1)
+    {
+      float low[3], high[3];
+      for (int c = 0; c < 3; c++)
+      {
+        low[c] = std::numeric_limits<float>::max();
+        high[c] = std::numeric_limits<float>::lowest();
+      }
+      for (size_t i = lo; i < hi; i++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          low[c] = std::min(low[c], position[order[i] * 3 + c]);
+          high[c] = std::max(high[c], position[order[i] * 3 + c]);
+        }
+      }
+      int axis = 0;
+      for (int c = 1; c < 3; c++)
+      {
+        if (high[c] - low[c] > high[axis] - low[axis])
+        {
+          axis = c;
+        }
+      }
+
+      size_t mid = (lo + hi) / 2;
+      std::nth_element(order.begin() + lo, order.begin() + mid, order.begin() + hi,
+                       [&](uint32_t a, uint32_t b)
+                       { return position[a * 3 + axis] < position[b * 3 + axis]; });
+      axes[mid] = (uint8_t)axis;
+
+      // recurse into the smaller half, loop on the larger one
+      if (mid - lo < hi - mid - 1)
+      {
+        build(lo, mid);
+        lo = mid + 1;
+      }
+      else
+      {
+        build(mid + 1, hi);
+        hi = mid;
+      }
+    }
+    if (hi - lo == 1)
+    {
+      axes[lo] = 0;
+    }
+  }
+};
+
+#endif // !KDTREE_H
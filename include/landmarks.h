@@ -0,0 +1,308 @@
+#ifndef LANDMARKS_H
+#define LANDMARKS_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <arena.h>
+#include <basis.h>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <linalg.h>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <solver.h>
+#include <string>
+#include <trace.h>
+#include <vector>
+
+// base vertex index of every landmark, one per line; empty if an index is
+// not a vertex of a mesh with `num_vertices` vertices
+inline std::vector<int> load_landmarks(const std::string &file_path, size_t num_vertices)
+{
+  std::vector<int> vertices;
+  std::ifstream file(file_path);
+  if (!file)
+  {
+    std::cout << "ERROR::LANDMARKS::FILE_NOT_READ: " << file_path << std::endl;
+    return vertices;
+  }
+  int vertex;
+  while (file >> vertex)
+  {
+    if (vertex < 0 || (size_t)vertex >= num_vertices)
+    {
+      std::cout << "ERROR::LANDMARKS::VERTEX_OUT_OF_RANGE: " << file_path << ": " << vertex
+                << " (" << num_vertices << " vertices)" << std::endl;
+      return {};
+    }
+    vertices.push_back(vertex);
+  }
+  return vertices;
+}
+
+// tracked landmark positions, x y z per landmark and `num_landmarks` of them
+// per frame, frames back to back; empty unless the file holds whole frames
+inline std::vector<std::vector<glm::dvec3>> load_landmark_frames(const std::string &file_path,
+                                                                  size_t num_landmarks)
+{
+  std::vector<std::vector<glm::dvec3>> frames;
+  std::ifstream file(file_path);
+  std::vector<double> values;
+  double value;
+  while (file >> value)
+  {
+    values.push_back(value);
+  }
+  if (num_landmarks == 0 || values.empty() || values.size() % (3 * num_landmarks) != 0)
+  {
+    std::cout << "ERROR::LANDMARKS::FRAMES_NOT_READ: " << file_path << " (expected "
+              << num_landmarks << " x y z triples per frame)" << std::endl;
+    return frames;
+  }
+  frames.resize(values.size() / (3 * num_landmarks));
+  for (size_t f = 0; f < frames.size(); f++)
+  {
+    frames[f].resize(num_landmarks);
+    for (size_t l = 0; l < num_landmarks; l++)
+    {
+      const double *p = &values[(f * num_landmarks + l) * 3];
+      frames[f][l] = glm::dvec3(p[0], p[1], p[2]);
+    }
+  }
+  return frames;
+}
+
+// result of one LandmarkFitter::fit(): observed ~= rotation * model + translation
+struct LandmarkFit
+{
+  std::vector<tinyobj::real_t> weights;
+  glm::dmat3 rotation = glm::dmat3(1.0);
+  glm::dvec3 translation = glm::dvec3(0.0);
+  double rms = 0;     // landmark residual after the last step
+  int iterations = 0; // active-set iterations over all alternations
+};
+
+// Per-frame fit of blend weights and a rigid head pose to tracked landmarks.
+// Only the landmark rows A (3L x T) of the delta basis are kept, so a frame
+// costs O(L T) and never touches the full mesh. Each alternation
+//
+//   1. moves the observations into model space with the current pose and
+//      solves the bounded least squares for the weights,
+//   2. re-fits the pose to the blended landmarks (Horn's closed-form
+//      absolute orientation via the top eigenvector of a 4x4 matrix).
+//
+// Frames are warm-started from the previous fit: pose and weights seed the
+// first alternation and the active set, and a temporal term
+// mu |w - w_prev|^2 keeps weights from jittering where landmarks are
+// ambiguous. The normal matrix A^T A + (lambda + mu) I is factored once.
+class LandmarkFitter
+{
+public:
+  // regularization, temporal: lambda and mu relative to the mean diagonal of
+  // A^T A
+  LandmarkFitter(const BlendBasis &basis, std::vector<int> landmark_vertices,
+                 double regularization = 1e-4, double temporal = 1e-2)
+      : vertices(std::move(landmark_vertices)), T(basis.num_targets())
+  {
+    TRACE_SCOPE("LandmarkFitter::LandmarkFitter");
+    MemScope mem_scope(MEM_BASIS);
+    size_t L = vertices.size();
+    base.resize(3 * L);
+    rows.resize(3 * L * T);
+    for (size_t l = 0; l < L; l++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        base[l * 3 + c] = basis.base(c)[vertices[l]];
+        for (size_t t = 0; t < T; t++)
+        {
+          rows[(l * 3 + c) * T + t] = basis.delta(t, c)[vertices[l]];
+        }
+      }
+    }
+
+    std::vector<double> gram(T * T, 0.0);
+    for (size_t r = 0; r < 3 * L; r++)
+    {
+      for (size_t i = 0; i < T; i++)
+      {
+        for (size_t j = 0; j < T; j++)
+        {
+          gram[i * T + j] += rows[r * T + i] * rows[r * T + j];
+        }
+      }
+    }
+    double trace = 0;
+    for (size_t i = 0; i < T; i++)
+    {
+      trace += gram[i * T + i];
+    }
+    double mean = T ? trace / T : 0.0;
+    mu = temporal * mean;
+    for (size_t i = 0; i < T; i++)
+    {
+      gram[i * T + i] += regularization * mean + mu;
+    }
+    system.set(std::move(gram), T);
+    reset();
+  }
+
+  size_t num_landmarks() const
+  {
+    return vertices.size();
+  }
+
+  // forget the previous frame (e.g. after the tracker lost the face)
+  void reset()
+  {
+    result = LandmarkFit();
+    result.weights.assign(T, 0.0);
+    warm = false;
+  }
+
+  // observed[i] is the tracked position of landmark_vertices[i]; a frame with
+  // the wrong number of landmarks is rejected and the previous fit returned
+  const LandmarkFit &fit(const std::vector<glm::dvec3> &observed,
+                         const SolveOptions &options = SolveOptions(), int alternations = 2)
+  {
+    TRACE_SCOPE("LandmarkFitter::fit");
+    if (observed.size() != vertices.size())
+    {
+      std::cout << "ERROR::LANDMARKS::COUNT_MISMATCH: " << observed.size() << " observed, "
+                << vertices.size() << " expected" << std::endl;
+      return result;
+    }
+    ArenaScope scratch;
+    size_t L = vertices.size();
+    std::pmr::vector<glm::dvec3> model(L, scratch.resource());
+    std::pmr::vector<double> rhs(T, 0.0, scratch.resource());
+    std::pmr::vector<double> previous(result.weights.begin(), result.weights.end(),
+                                      scratch.resource());
+
+    // a cold start has no pose yet: align the neutral face first
+    if (!warm)
+    {
+      blend_landmarks(model);
+      fit_pose(model, observed);
+    }
+
+    SolveOptions solve_options = options;
+    solve_options.warm_start = warm;
+    result.iterations = 0;
+    for (int a = 0; a < alternations; a++)
+    {
+      // weights for the observations in model space
+      glm::dmat3 inverse = glm::transpose(result.rotation);
+      for (size_t t = 0; t < T; t++)
+      {
+        rhs[t] = mu * previous[t];
+      }
+      for (size_t l = 0; l < L; l++)
+      {
+        glm::dvec3 q = inverse * (observed[l] - result.translation);
+        for (int c = 0; c < 3; c++)
+        {
+          double r = q[c] - base[l * 3 + c];
+          const double *row = &rows[(l * 3 + c) * T];
+          for (size_t t = 0; t < T; t++)
+          {
+            rhs[t] += row[t] * r;
+          }
+        }
+      }
+      result.iterations += system.solve(rhs.data(), result.weights, solve_options);
+      solve_options.warm_start = options.box;
+
+      blend_landmarks(model);
+      fit_pose(model, observed);
+    }
+
+    double sum = 0;
+    for (size_t l = 0; l < L; l++)
+    {
+      glm::dvec3 e = result.rotation * model[l] + result.translation - observed[l];
+      sum += glm::dot(e, e);
+    }
+    result.rms = L ? std::sqrt(sum / L) : 0.0;
+    warm = true;
+    return result;
+  }
+
+private:
+  std::vector<int> vertices;
+  size_t T;
+  double mu = 0;
+  std::vector<double> base; // 3L landmark positions of the base
+  std::vector<double> rows; // A, (3L) x T row-major
+  BoxLeastSquares system;
+  LandmarkFit result;
+  bool warm = false;
+
+  template <typename Vector>
+  void blend_landmarks(Vector &model) const
+  {
+    for (size_t l = 0; l < vertices.size(); l++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        const double *row = &rows[(l * 3 + c) * T];
+        double x = base[l * 3 + c];
+        for (size_t t = 0; t < T; t++)
+        {
+          x += row[t] * result.weights[t];
+        }
+        model[l][c] = x;
+      }
+    }
+  }
+
+  // rigid transform taking `model` onto `observed` in the least-squares sense
+  template <typename Vector>
+  void fit_pose(const Vector &model, const std::vector<glm::dvec3> &observed)
+  {
+    size_t L = vertices.size();
+    if (L == 0)
+    {
+      return;
+    }
+    glm::dvec3 model_mean(0.0), observed_mean(0.0);
+    for (size_t l = 0; l < L; l++)
+    {
+      model_mean += model[l];
+      observed_mean += observed[l];
+    }
+    model_mean /= (double)L;
+    observed_mean /= (double)L;
+
+    // S[a][b] = sum (m_a - mean) (p_b - mean)
+    double S[3][3] = {};
+    for (size_t l = 0; l < L; l++)
+    {
+      glm::dvec3 m = model[l] - model_mean, p = observed[l] - observed_mean;
+      for (int a = 0; a < 3; a++)
+      {
+        for (int b = 0; b < 3; b++)
+        {
+          S[a][b] += m[a] * p[b];
+        }
+      }
+    }
+    double N[16] = {
+        S[0][0] + S[1][1] + S[2][2], S[1][2] - S[2][1], S[2][0] - S[0][2], S[0][1] - S[1][0],
+        S[1][2] - S[2][1], S[0][0] - S[1][1] - S[2][2], S[0][1] + S[1][0], S[2][0] + S[0][2],
+        S[2][0] - S[0][2], S[0][1] + S[1][0], -S[0][0] + S[1][1] - S[2][2], S[1][2] + S[2][1],
+        S[0][1] - S[1][0], S[2][0] + S[0][2], S[1][2] + S[2][1], -S[0][0] - S[1][1] + S[2][2]};
+    double values[4], vectors[16];
+    symmetric_eigen(N, 4, values, vectors);
+
+    // the top eigenvector is the rotation as a unit quaternion (w, x, y, z)
+    glm::dquat q(vectors[0], vectors[4], vectors[8], vectors[12]);
+    result.rotation = glm::mat3_cast(glm::normalize(q));
+    result.translation = observed_mean - result.rotation * model_mean;
+  }
+};
+
+#endif // !LANDMARKS_H
@@ -0,0 +1,151 @@
+#ifndef LINALG_H
+#define LINALG_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// Small dense kernels on row-major double matrices, shared by the basis
+// compression and the solvers. None of them allocate.
+
+// eigen-decomposition of the symmetric n x n matrix `a` by cyclic Jacobi
+// rotations; `a` is destroyed. Eigenvalues come back in descending order and
+// eigenvector k is column k of `vectors` (n x n).
+inline void symmetric_eigen(double *a, size_t n, double *values, double *vectors)
+{
+  for (size_t i = 0; i < n * n; i++)
+  {
+    vectors[i] = 0.0;
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    vectors[i * n + i] = 1.0;
+  }
+
+  for (int sweep = 0; sweep < 64; sweep++)
+  {
+    double off = 0, diagonal = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      diagonal += a[i * n + i] * a[i * n + i];
+      for (size_t j = i + 1; j < n; j++)
+      {
+        off += a[i * n + j] * a[i * n + j];
+      }
+    }
+    if (off <= 1e-30 * diagonal)
+    {
+      break;
+    }
+
+    for (size_t p = 0; p < n; p++)
+    {
+      for (size_t q = p + 1; q < n; q++)
+      {
+        double apq = a[p * n + q];
+        if (apq == 0)
+        {
+          continue;
+        }
+        // rotation angle that zeroes a[p][q]
+        double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        double t = (theta >= 0 ? 1.0 : -1.0) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+        double c = 1 / std::sqrt(t * t + 1), s = t * c;
+
+        for (size_t k = 0; k < n; k++)
+        {
+          double akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+          double apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+          double vkp = vectors[k * n + p], vkq = vectors[k * n + q];
+          vectors[k * n + p] = c * vkp - s * vkq;
+          vectors[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+
+  // selection sort by descending eigenvalue, swapping eigenvector columns
+  for (size_t k = 0; k < n; k++)
+  {
+    values[k] = a[k * n + k];
+  }
+  for (size_t k = 0; k < n; k++)
+  {
+    size_t best = k;
+    for (size_t j = k + 1; j < n; j++)
+    {
+      if (values[j] > values[best])
+      {
+        best = j;
+      }
+    }
+    if (best != k)
+    {
+      std::swap(values[k], values[best]);
+      for (size_t i = 0; i < n; i++)
+      {
+        std::swap(vectors[i * n + k], vectors[i * n + best]);
+      }
+    }
+  }
+}
+
+// lower Cholesky factor of the SPD matrix `a` into `l` (both n x n, may
+// alias); returns false if a pivot was not positive
+inline bool cholesky_factor(const double *a, double *l, size_t n)
+{
+  bool definite = true;
+  for (size_t j = 0; j < n; j++)
+  {
+    double d = a[j * n + j];
+    for (size_t k = 0; k < j; k++)
+    {
+      d -= l[j * n + k] * l[j * n + k];
+    }
+    definite = definite && d > 0;
+    l[j * n + j] = std::sqrt(std::max(d, 1e-300));
+    for (size_t i = j + 1; i < n; i++)
+    {
+      double s = a[i * n + j];
+      for (size_t k = 0; k < j; k++)
+      {
+        s -= l[i * n + k] * l[j * n + k];
+      }
+      l[i * n + j] = s / l[j * n + j];
+    }
+  }
+  return definite;
+}
+
+// solve L L^T x = b in place given the factor from cholesky_factor()
+inline void cholesky_substitute(const double *l, double *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    for (size_t k = 0; k < i; k++)
+    {
+      b[i] -= l[i * n + k] * b[k];
+    }
+    b[i] /= l[i * n + i];
+  }
+  for (size_t i = n; i-- > 0;)
+  {
+    for (size_t k = i + 1; k < n; k++)
+    {
+      b[i] -= l[k * n + i] * b[k];
+    }
+    b[i] /= l[i * n + i];
+  }
+}
+
+#endif // !LINALG_H
@@ -0,0 +1,508 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <mem_tracker.h>
+#include <memory_resource>
+#include <obj.h>
+#include <queue>
+#include <trace.h>
+#include <unordered_map>
+#include <vector>
+
+// Chain of simplified versions of the base mesh for distant heads. Edges are
+// collapsed cheapest first under quadric error metrics (Garland-Heckbert),
+// always into one of their endpoints, so every vertex of a level is one of
+// the original vertices.
+//
+// A level's triangles index the original vertices, so it is drawn from the
+// full blended vertex data and is exact at the survivors: a survivor sits at
+// its base position, so its own delta takes it to its target position. The
+// collapse cost adds how far apart the two endpoints' deltas are (worst
+// target), which keeps resolution where expressions move the surface rather
+// than only where the neutral face is curved.
+//
+// Level 0 is the full mesh; each further level has at most half the
+// triangles of the one before, fewer once no collapse is left that keeps the
+// surface manifold and unfolded. Boundary vertices only slide along the
+// boundary.
+class LodChain
+{
+public:
+  struct Level
+  {
+    std::vector<uint32_t> triangles; // corners, as original vertex ids
+    std::vector<uint32_t> sources;   // original id of every level vertex
+    double error;                    // in model units, grows with the level
+  };
+
+  // vertices: 3V base positions; corners: base vertex of every triangle
+  // corner; targets: 3V positions of every target
+  LodChain(const std::vector<tinyobj::real_t> &vertices, const std::pmr::vector<int> &corners,
+           const std::vector<std::vector<tinyobj::real_t>> &targets, size_t max_levels = 5)
+  {
+    TRACE_SCOPE("LodChain::LodChain");
+    MemScope mem_scope(MEM_BASIS);
+    size_t V = vertices.size() / 3;
+
+    // bounding sphere around the box center, for select()
+    glm::dvec3 low(0.0), high(0.0);
+    if (V > 0)
+    {
+      low = high = position(vertices, 0);
+    }
+    for (size_t v = 0; v < V; v++)
+    {
+      glm::dvec3 p = position(vertices, v);
+      low = glm::min(low, p);
+      high = glm::max(high, p);
+    }
+    center = 0.5 * (low + high);
+    bound = 0;
+    for (size_t v = 0; v < V; v++)
+    {
+      bound = std::max(bound, glm::length(position(vertices, v) - center));
+    }
+
+    Level full;
+    full.triangles.assign(corners.begin(), corners.end());
+    full.sources.resize(V);
+    for (size_t v = 0; v < V; v++)
+    {
+      full.sources[v] = (uint32_t)v;
+    }
+    full.error = 0;
+    levels.push_back(std::move(full));
+
+    Simplifier simplifier(vertices, corners, targets);
+    size_t budget = corners.size() / 3;
+    while (levels.size() < max_levels)
+    {
+      budget /= 2;
+      size_t before = simplifier.num_triangles();
+      simplifier.collapse_to(budget);
+      if (simplifier.num_triangles() == before)
+      {
+        break;
+      }
+      levels.push_back(simplifier.snapshot());
+    }
+  }
+
+  size_t size() const
+  {
+    return levels.size();
+  }
+
+  const Level &level(size_t l) const
+  {
+    return levels[l];
+  }
+
+  // bounding sphere of the base mesh
+  glm::vec3 bounds_center() const
+  {
+    return glm::vec3(center);
+  }
+
+  float bounds_radius() const
+  {
+    return (float)bound;
+  }
+
+  // coarsest level whose error stays within `tolerance` pixels when the
+  // bounding sphere projects to a radius of `projected_radius` pixels
+  size_t select(double projected_radius, double tolerance = 1.0) const
+  {
+    double pixels_per_unit = bound > 0 ? projected_radius / bound : 0.0;
+    for (size_t l = levels.size(); l-- > 1;)
+    {
+      if (levels[l].error * pixels_per_unit <= tolerance)
+      {
+        return l;
+      }
+    }
+    return 0;
+  }
+
+private:
+  std::vector<Level> levels;
+  glm::dvec3 center;
+  double bound;
+
+  template <typename Vector>
+  static glm::dvec3 position(const Vector &vertices, size_t v)
+  {
+    return glm::dvec3(vertices[v * 3], vertices[v * 3 + 1], vertices[v * 3 + 2]);
+  }
+
+  // sum of squared plane distances, p^T A p + 2 b.p + c
+  struct Quadric
+  {
+    double a[6] = {0, 0, 0, 0, 0, 0}; // xx xy xz yy yz zz
+    double b[3] = {0, 0, 0};
+    double c = 0;
+
+    void add_plane(const glm::dvec3 &n, double d, double weight)
+    {
+      a[0] += weight * n.x * n.x;
+      a[1] += weight * n.x * n.y;
+      a[2] += weight * n.x * n.z;
+      a[3] += weight * n.y * n.y;
+      a[4] += weight * n.y * n.z;
+      a[5] += weight * n.z * n.z;
+      b[0] += weight * n.x * d;
+      b[1] += weight * n.y * d;
+      b[2] += weight * n.z * d;
+      c += weight * d * d;
+    }
+
+    void operator+=(const Quadric &q)
+    {
+      for (int i = 0; i < 6; i++)
+      {
+        a[i] += q.a[i];
+      }
+      for (int i = 0; i < 3; i++)
+      {
+        b[i] += q.b[i];
+      }
+      c += q.c;
+    }
+
+    double operator()(const glm::dvec3 &p) const
+    {
+      return a[0] * p.x * p.x + 2 * a[1] * p.x * p.y + 2 * a[2] * p.x * p.z + a[3] * p.y * p.y +
+             2 * a[4] * p.y * p.z + a[5] * p.z * p.z + 2 * (b[0] * p.x + b[1] * p.y + b[2] * p.z) + c;
+    }
+  };
+
+  // the collapse state carried from one level to the next
+  class Simplifier
+  {
+  public:
+    Simplifier(const std::vector<tinyobj::real_t> &vertices, const std::pmr::vector<int> &corners,
+               const std::vector<std::vector<tinyobj::real_t>> &targets)
+        : V(vertices.size() / 3), T(targets.size()), positions(V), quadrics(V), area(V, 0.0),
+          deltas(V * T * 3), version(V, 0), alive(V, 1), boundary(V, 0), locked(V, 0),
+          incident(V), corners(corners.begin(), corners.end()), live(corners.size() / 3, 1),
+          live_count(corners.size() / 3)
+    {
+      for (size_t v = 0; v < V; v++)
+      {
+        positions[v] = position(vertices, v);
+        for (size_t t = 0; t < T; t++)
+        {
+          for (int c = 0; c < 3; c++)
+          {
+            deltas[(v * T + t) * 3 + c] = (float)(targets[t][v * 3 + c] - vertices[v * 3 + c]);
+          }
+        }
+      }
+
+      // area-weighted face planes; edges seen once are boundary, more than
+      // twice non-manifold
+      std::unordered_map<uint64_t, uint32_t> edges;
+      for (size_t f = 0; f < live.size(); f++)
+      {
+        const uint32_t *tri = &this->corners[f * 3];
+        glm::dvec3 n = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+        double length = glm::length(n);
+        for (int i = 0; i < 3; i++)
+        {
+          incident[tri[i]].push_back((uint32_t)f);
+          edges[key(tri[i], tri[(i + 1) % 3])]++;
+        }
+        if (length == 0)
+        {
+          continue;
+        }
+        n /= length;
+        for (int i = 0; i < 3; i++)
+        {
+          quadrics[tri[i]].add_plane(n, -glm::dot(n, positions[tri[0]]), 0.5 * length);
+          area[tri[i]] += 0.5 * length;
+        }
+      }
+
+      // boundary edges also get a plane perpendicular to their face, so
+      // collapsing along the boundary costs its deviation from the border
+      for (size_t f = 0; f < live.size(); f++)
+      {
+        const uint32_t *tri = &this->corners[f * 3];
+        glm::dvec3 n = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+        for (int i = 0; i < 3; i++)
+        {
+          uint32_t a = tri[i], b = tri[(i + 1) % 3];
+          uint32_t count = edges[key(a, b)];
+          if (count > 2)
+          {
+            locked[a] = locked[b] = 1;
+          }
+          if (count != 1 || glm::length(n) == 0)
+          {
+            continue;
+          }
+          boundary[a] = boundary[b] = 1;
+          glm::dvec3 edge = positions[b] - positions[a];
+          glm::dvec3 side = glm::cross(edge, n);
+          if (glm::length(side) == 0)
+          {
+            continue;
+          }
+          side = glm::normalize(side);
+          double weight = BOUNDARY_WEIGHT * glm::dot(edge, edge);
+          quadrics[a].add_plane(side, -glm::dot(side, positions[a]), weight);
+          quadrics[b].add_plane(side, -glm::dot(side, positions[a]), weight);
+        }
+      }
+
+      for (size_t v = 0; v < V; v++)
+      {
+        push_edges((uint32_t)v);
+      }
+    }
+
+    size_t num_triangles() const
+    {
+      return live_count;
+    }
+
+    // collapse until at most `budget` triangles are left or nothing valid is
+    void collapse_to(size_t budget)
+    {
+      while (live_count > budget && !heap.empty())
+      {
+        Candidate top = heap.top();
+        heap.pop();
+        if (!alive[top.from] || !alive[top.to] || version[top.from] != top.from_version ||
+            version[top.to] != top.to_version || !valid(top.from, top.to))
+        {
+          continue;
+        }
+        collapse(top.from, top.to);
+        worst = std::max(worst, top.cost);
+      }
+    }
+
+    Level snapshot() const
+    {
+      Level level;
+      std::vector<uint8_t> used(V, 0);
+      for (size_t f = 0; f < live.size(); f++)
+      {
+        if (!live[f])
+        {
+          continue;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+          uint32_t v = corners[f * 3 + i];
+          level.triangles.push_back(v);
+          used[v] = 1;
+        }
+      }
+      for (size_t v = 0; v < V; v++)
+      {
+        if (used[v])
+        {
+          level.sources.push_back((uint32_t)v);
+        }
+      }
+      level.error = std::sqrt(worst);
+      return level;
+    }
+
+  private:
+    // boundary planes count this much per squared edge length
+    static constexpr double BOUNDARY_WEIGHT = 10.0;
+    // collapses that turn a face by more than this (cosine) are rejected
+    static constexpr double MIN_FACE_COSINE = 0.2;
+
+    struct Candidate
+    {
+      double cost;
+      uint32_t from, to;
+      uint32_t from_version, to_version;
+
+      bool operator>(const Candidate &other) const
+      {
+        return cost > other.cost;
+      }
+    };
+
+    size_t V, T;
+    std::vector<glm::dvec3> positions;
+    std::vector<Quadric> quadrics;
+    std::vector<double> area;
+    std::vector<float> deltas; // (v * T + t) * 3 + c
+    std::vector<uint32_t> version;
+    std::vector<uint8_t> alive, boundary, locked;
+    std::vector<std::vector<uint32_t>> incident; // live triangles per vertex
+    std::vector<uint32_t> corners;
+    std::vector<uint8_t> live;
+    size_t live_count;
+    double worst = 0;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+    std::vector<uint32_t> neighbours, others;
+
+    static uint64_t key(uint32_t a, uint32_t b)
+    {
+      return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    }
+
+    // mean squared plane distance of the merged quadric at the survivor,
+    // plus the worst squared delta difference over the targets
+    double cost(uint32_t from, uint32_t to) const
+    {
+      Quadric q = quadrics[from];
+      q += quadrics[to];
+      double weight = area[from] + area[to];
+      double geometric = weight > 0 ? std::max(0.0, q(positions[to])) / weight : 0.0;
+      double expression = 0;
+      const float *a = &deltas[from * T * 3];
+      const float *b = &deltas[to * T * 3];
+      for (size_t t = 0; t < T; t++)
+      {
+        double dx = a[t * 3] - b[t * 3], dy = a[t * 3 + 1] - b[t * 3 + 1], dz = a[t * 3 + 2] - b[t * 3 + 2];
+        expression = std::max(expression, dx * dx + dy * dy + dz * dz);
+      }
+      return geometric + expression;
+    }
+
+    void collect_neighbours(uint32_t v, std::vector<uint32_t> &out) const
+    {
+      out.clear();
+      for (uint32_t f : incident[v])
+      {
+        for (int i = 0; i < 3; i++)
+        {
+          if (corners[f * 3 + i] != v)
+          {
+            out.push_back(corners[f * 3 + i]);
+          }
+        }
+      }
+      std::sort(out.begin(), out.end());
+      out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    void push_edges(uint32_t v)
+    {
+      collect_neighbours(v, neighbours);
+      for (uint32_t n : neighbours)
+      {
+        heap.push({cost(v, n), v, n, version[v], version[n]});
+        heap.push({cost(n, v), n, v, version[n], version[v]});
+      }
+    }
+
+    bool valid(uint32_t from, uint32_t to)
+    {
+      if (locked[from])
+      {
+        return false;
+      }
+      size_t shared = 0;
+      for (uint32_t f : incident[from])
+      {
+        const uint32_t *tri = &corners[f * 3];
+        shared += tri[0] == to || tri[1] == to || tri[2] == to;
+      }
+      // boundary vertices only move along boundary edges
+      if (shared == 0 || (boundary[from] && (!boundary[to] || shared != 1)))
+      {
+        return false;
+      }
+
+      // link condition: the endpoints share exactly the vertices opposite
+      // the edge, otherwise the collapse pinches the surface
+      collect_neighbours(from, neighbours);
+      collect_neighbours(to, others);
+      size_t common = 0;
+      for (size_t i = 0, j = 0; i < neighbours.size() && j < others.size();)
+      {
+        if (neighbours[i] < others[j])
+        {
+          i++;
+        }
+        else if (others[j] < neighbours[i])
+        {
+          j++;
+        }
+        else
+        {
+          common++;
+          i++;
+          j++;
+        }
+      }
+      if (common != shared)
+      {
+        return false;
+      }
+
+      // no remaining face may fold over or degenerate
+      for (uint32_t f : incident[from])
+      {
+        const uint32_t *tri = &corners[f * 3];
+        if (tri[0] == to || tri[1] == to || tri[2] == to)
+        {
+          continue;
+        }
+        glm::dvec3 p[3], q[3];
+        for (int i = 0; i < 3; i++)
+        {
+          p[i] = positions[tri[i]];
+          q[i] = tri[i] == from ? positions[to] : p[i];
+        }
+        glm::dvec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+        glm::dvec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+        double lengths = glm::length(before) * glm::length(after);
+        if (lengths == 0 || glm::dot(before, after) < MIN_FACE_COSINE * lengths)
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void collapse(uint32_t from, uint32_t to)
+    {
+      for (uint32_t f : incident[from])
+      {
+        uint32_t *tri = &corners[f * 3];
+        if (tri[0] == to || tri[1] == to || tri[2] == to)
+        {
+          live[f] = 0;
+          live_count--;
+          for (int i = 0; i < 3; i++)
+          {
+            if (tri[i] != from)
+            {
+              std::vector<uint32_t> &list = incident[tri[i]];
+              list.erase(std::find(list.begin(), list.end(), f));
+            }
+          }
+          continue;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+          tri[i] = tri[i] == from ? to : tri[i];
+        }
+        incident[to].push_back(f);
+      }
+      incident[from].clear();
+      alive[from] = 0;
+      quadrics[to] += quadrics[from];
+      area[to] += area[from];
+      version[to]++;
+      push_edges(to);
+    }
+  };
+};
+
+#endif // !LOD_H
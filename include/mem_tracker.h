@@ -0,0 +1,297 @@
+#ifndef MEM_TRACKER_H
+#define MEM_TRACKER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <ostream>
+#include <string>
+
+// Heap accounting per subsystem. Allocations are attributed to the subsystem
+// of the innermost MemScope on the allocating thread; frees are credited back
+// to the subsystem recorded with the block, whichever thread releases it.
+//
+// The hook is the global operator new/delete, installed by defining
+// MEM_TRACKER_IMPLEMENTATION in exactly one translation unit (the build does
+// this when configured with -DFACIALEXPS_MEM_TRACKING=ON). Without it scopes
+// are still valid but nothing is counted.
+
+enum MemSubsystem
+{
+  MEM_OTHER,
+  MEM_LOADER,
+  MEM_BASIS,
+  MEM_BLEND,
+  MEM_GL_STAGING,
+  MEM_CAPTURE,
+  MEM_COUNT
+};
+
+static const char *const MEM_SUBSYSTEM_NAMES[MEM_COUNT] = {
+    "other", "loader", "basis", "blend scratch", "gl staging", "capture"};
+
+struct MemCounters
+{
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> frees{0};
+  std::atomic<int64_t> live_bytes{0};
+  std::atomic<int64_t> peak_bytes{0};
+};
+
+class MemTracker
+{
+public:
+  static bool compiled()
+  {
+#ifdef MEM_TRACKER_IMPLEMENTATION
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static MemSubsystem &current()
+  {
+    thread_local MemSubsystem subsystem = MEM_OTHER;
+    return subsystem;
+  }
+
+  static MemCounters &counters(MemSubsystem subsystem)
+  {
+    return table[subsystem];
+  }
+
+  // called by the allocation hook
+  static void on_allocate(MemSubsystem subsystem, size_t size)
+  {
+    MemCounters &c = table[subsystem];
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    int64_t live = c.live_bytes.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+    int64_t peak = c.peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !c.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  static void on_free(MemSubsystem subsystem, size_t size)
+  {
+    MemCounters &c = table[subsystem];
+    c.frees.fetch_add(1, std::memory_order_relaxed);
+    c.live_bytes.fetch_sub((int64_t)size, std::memory_order_relaxed);
+  }
+
+  // "VmRSS"/"VmHWM" from /proc/self/status in bytes, 0 where unavailable
+  static uint64_t resident_bytes(const char *field = "VmRSS")
+  {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    std::string key = std::string(field) + ":";
+    while (std::getline(status, line))
+    {
+      if (line.compare(0, key.size(), key) == 0)
+      {
+        return std::strtoull(line.c_str() + key.size(), nullptr, 10) * 1024;
+      }
+    }
+    return 0;
+  }
+
+  static void report(std::ostream &out)
+  {
+    char line[160];
+    out << "memory by subsystem:\n";
+    if (compiled())
+    {
+      std::snprintf(line, sizeof(line), "  %-14s %12s %12s %14s %14s\n", "subsystem",
+                    "allocs", "frees", "live KiB", "peak KiB");
+      out << line;
+      for (int s = 0; s < MEM_COUNT; s++)
+      {
+        const MemCounters &c = table[s];
+        std::snprintf(line, sizeof(line), "  %-14s %12llu %12llu %14.1f %14.1f\n",
+                      MEM_SUBSYSTEM_NAMES[s],
+                      (unsigned long long)c.allocations.load(),
+                      (unsigned long long)c.frees.load(), c.live_bytes.load() / 1024.0,
+                      c.peak_bytes.load() / 1024.0);
+        out << line;
+      }
+    }
+    else
+    {
+      out << "  (allocation tracking not compiled in, configure with "
+             "-DFACIALEXPS_MEM_TRACKING=ON)\n";
+    }
+    std::snprintf(line, sizeof(line), "  resident %.1f MiB, peak resident %.1f MiB\n",
+                  resident_bytes("VmRSS") / 1048576.0, resident_bytes("VmHWM") / 1048576.0);
+    out << line;
+  }
+
+private:
+  inline static MemCounters table[MEM_COUNT];
+};
+
+// attribute allocations on this thread to `subsystem` until end of scope
+class MemScope
+{
+public:
+  explicit MemScope(MemSubsystem subsystem) : previous(MemTracker::current())
+  {
+    MemTracker::current() = subsystem;
+  }
+
+  ~MemScope()
+  {
+    MemTracker::current() = previous;
+  }
+
+  MemScope(const MemScope &) = delete;
+  MemScope &operator=(const MemScope &) = delete;
+
+private:
+  MemSubsystem previous;
+};
+
+#ifdef MEM_TRACKER_IMPLEMENTATION
+
+// every block carries its size, subsystem and the malloc'd address in a
+// max-aligned header right before the returned pointer
+namespace mem_tracker_detail
+{
+  struct alignas(std::max_align_t) Header
+  {
+    size_t size;
+    MemSubsystem subsystem;
+    void *origin;
+  };
+
+  inline void *allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+  {
+    size_t slack = alignment > alignof(Header) ? alignment : 0;
+    void *origin = std::malloc(sizeof(Header) + slack + size);
+    if (!origin)
+    {
+      return nullptr;
+    }
+    uintptr_t p = (uintptr_t)origin + sizeof(Header);
+    if (slack)
+    {
+      p = (p + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    Header *header = (Header *)(p - sizeof(Header));
+    header->size = size;
+    header->subsystem = MemTracker::current();
+    header->origin = origin;
+    MemTracker::on_allocate(header->subsystem, size);
+    return (void *)p;
+  }
+
+  inline void release(void *p)
+  {
+    if (!p)
+    {
+      return;
+    }
+    Header *header = (Header *)((uintptr_t)p - sizeof(Header));
+    MemTracker::on_free(header->subsystem, header->size);
+    std::free(header->origin);
+  }
+} // namespace mem_tracker_detail
+
+void *operator new(size_t size)
+{
+  void *p = mem_tracker_detail::allocate(size);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  return mem_tracker_detail::allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return mem_tracker_detail::allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+  void *p = mem_tracker_detail::allocate(size, (size_t)alignment);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+  return operator new(size, alignment);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept
+{
+  mem_tracker_detail::release(p);
+}
+
+#endif // MEM_TRACKER_IMPLEMENTATION
+
+#endif // !MEM_TRACKER_H
@@ -0,0 +1,585 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <arena.h>
+#include <basis.h>
+#include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <scheduler.h>
+#include <trace.h>
+#include <vector>
+
+// a cluster of at most MeshletBasis::MAX_VERTICES vertices and
+// MAX_TRIANGLES triangles, with bounds that hold for every blend
+struct Meshlet
+{
+  uint32_t vertex_offset, vertex_count;     // into vertices()
+  uint32_t triangle_offset, triangle_count; // into triangles(), 3 local indices each
+  uint32_t owned_offset, owned_count;       // into owned()
+  glm::vec3 center;
+  float radius;       // covers any blend with weights in [0, 1]
+  glm::vec3 cone_axis;
+  float cone_cutoff;  // > 1 when the cone is too wide to ever cull
+};
+
+// BlendBasis split into meshlets, each with a bitmask of the delta blocks
+// (targets, then in-between shapes) that move any of its vertices. The blend
+// copies the base once and then only visits meshlets whose mask meets a
+// non-zero weight: an expression driving the mouth leaves the rest of the
+// head at the base. Every vertex is blended by exactly one meshlet (its
+// owner), so meshlets run in parallel without sharing writes. The basis is
+// copied in meshlet-major order so a meshlet's owned vertices are contiguous
+// lanes; only the results are scattered back to vertex order.
+//
+// Has the evaluate()/to_aos()/padded() contract of the other bases, so
+// blend_shape() takes it in place of the BlendBasis it wraps; the basis must
+// outlive it.
+//
+// The bounds are for culling: the sphere holds the base plus any blend with
+// weights in [0, 1], the normal cone covers the base and each block at full
+// weight, which is a close but not strict bound for intermediate blends.
+class MeshletBasis
+{
+public:
+  static constexpr size_t ALIGNMENT = BlendBasis::ALIGNMENT;
+  static constexpr size_t LANES = BlendBasis::LANES;
+  static constexpr size_t MAX_VERTICES = 64;
+  static constexpr size_t MAX_TRIANGLES = 124;
+
+  // triangles: vertex index of every triangle corner; a block affects a
+  // vertex once it moves it by more than `threshold`. The default keeps every
+  // nonzero delta, so the result matches the wrapped basis exactly; a larger
+  // threshold skips more meshlets at the cost of dropping small deltas.
+  MeshletBasis(const BlendBasis &basis, const std::pmr::vector<int> &triangles,
+               float threshold = 0)
+      : basis(&basis), block_count(basis.num_targets() + basis.num_inbetweens()),
+        words((block_count + 63) / 64)
+  {
+    TRACE_SCOPE("MeshletBasis::MeshletBasis");
+    MemScope mem_scope(MEM_BASIS);
+    partition(triangles);
+    build_masks(threshold);
+    build_bounds();
+    build_slots();
+  }
+
+  size_t size() const
+  {
+    return meshlets.size();
+  }
+
+  const Meshlet &meshlet(size_t m) const
+  {
+    return meshlets[m];
+  }
+
+  // global vertex indices of every meshlet's vertices
+  const std::vector<uint32_t> &vertices() const
+  {
+    return vertex_list;
+  }
+
+  // local (per meshlet) corner indices
+  const std::vector<uint8_t> &triangles() const
+  {
+    return triangle_list;
+  }
+
+  // vertices each meshlet blends
+  const std::vector<uint32_t> &owned() const
+  {
+    return owned_list;
+  }
+
+  // bit b of word b / 64 is set if block b moves meshlet m
+  const uint64_t *mask(size_t m) const
+  {
+    return &masks[m * words];
+  }
+
+  size_t padded() const
+  {
+    return basis->padded();
+  }
+
+  size_t num_vertices() const
+  {
+    return basis->num_vertices();
+  }
+
+  size_t num_targets() const
+  {
+    return basis->num_targets();
+  }
+
+  // meshlets a blend with `weights` has to visit
+  size_t num_active(const std::vector<tinyobj::real_t> &weights) const
+  {
+    std::vector<uint64_t> bits;
+    moved(weights, bits);
+    size_t count = 0;
+    for (uint64_t word : bits)
+    {
+      count += std::bitset<64>(word).count();
+    }
+    return count;
+  }
+
+  // bit m of word m / 64 is set if a blend with `weights` moves an owned
+  // vertex of meshlet m off the base
+  void moved(const std::vector<tinyobj::real_t> &weights, std::vector<uint64_t> &bits) const
+  {
+    ArenaScope scratch;
+    std::pmr::vector<uint64_t> active(scratch.resource());
+    std::pmr::vector<BlendTerm> terms(scratch.resource());
+    active_blocks(weights, active, terms);
+    bits.assign((meshlets.size() + 63) / 64, 0);
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+      if (intersects(m, active.data()))
+      {
+        bits[m / 64] |= uint64_t(1) << (m % 64);
+      }
+    }
+  }
+
+  // same contract as BlendBasis::evaluate
+  void evaluate(JobScheduler &scheduler, const std::vector<tinyobj::real_t> &weights,
+                float *out, const Rig *rig = nullptr, const SkinPose *pose = nullptr) const
+  {
+    TRACE_SCOPE("MeshletBasis::evaluate");
+    ArenaScope scratch;
+    std::pmr::vector<BlendTerm> terms(scratch.resource());
+    std::pmr::vector<uint64_t> active(scratch.resource());
+    active_blocks(weights, active, terms);
+    size_t stride = basis->padded();
+
+    if (terms.empty())
+    {
+      // the neutral face: nothing to scatter, copy the base straight through
+      scheduler.parallel_for(0, stride / LANES, 64, [&](size_t begin, size_t end)
+                             {
+                               for (int c = 0; c < 3; c++)
+                               {
+                                 const float *src = basis->base(c);
+                                 std::copy(src + begin * LANES, src + end * LANES,
+                                           out + c * stride + begin * LANES);
+                               }
+                             });
+    }
+    else
+    {
+      // padding lanes belong to no meshlet, they keep the base values
+      for (int c = 0; c < 3; c++)
+      {
+        const float *src = basis->base(c);
+        std::copy(src + num_vertices(), src + stride, out + c * stride + num_vertices());
+      }
+
+      // every meshlet writes its owned vertices once: inactive ones scatter
+      // the base, active ones blend from the meshlet-major copy (contiguous
+      // lanes) first
+      scheduler.parallel_for(0, meshlets.size(), 8, [&](size_t begin, size_t end)
+                             {
+                               alignas(ALIGNMENT) float blended[MAX_VERTICES];
+                               for (size_t m = begin; m < end; m++)
+                               {
+                                 const Meshlet &meshlet = meshlets[m];
+                                 const uint32_t *own = &owned_list[meshlet.owned_offset];
+                                 size_t n = (meshlet.owned_count + LANES - 1) / LANES * LANES;
+                                 const uint64_t *bits = mask(m);
+                                 bool blend = intersects(m, active.data());
+                                 for (int c = 0; c < 3; c++)
+                                 {
+                                   const float *src = slot(0, c) + slot_offsets[m];
+                                   float *dst = out + c * stride;
+                                   if (!blend)
+                                   {
+                                     for (size_t i = 0; i < meshlet.owned_count; i++)
+                                     {
+                                       dst[own[i]] = src[i];
+                                     }
+                                     continue;
+                                   }
+                                   for (size_t i = 0; i < n; i++)
+                                   {
+                                     blended[i] = src[i];
+                                   }
+                                   for (const BlendTerm &term : terms)
+                                   {
+                                     if (!(bits[term.block / 64] >> (term.block % 64) & 1))
+                                     {
+                                       continue;
+                                     }
+                                     float w = term.coefficient;
+                                     const float *__restrict d = slot(term.block + 1, c) + slot_offsets[m];
+                                     for (size_t i = 0; i < n; i++)
+                                     {
+                                       blended[i] += w * d[i];
+                                     }
+                                   }
+                                   for (size_t i = 0; i < meshlet.owned_count; i++)
+                                   {
+                                     dst[own[i]] = blended[i];
+                                   }
+                                 }
+                               }
+                             });
+    }
+
+    if (rig || pose)
+    {
+      scheduler.parallel_for(0, stride / LANES, 64, [&](size_t begin, size_t end)
+                             { finish_range(weights, rig, pose, out, stride, begin * LANES,
+                                            (end - begin) * LANES); });
+    }
+  }
+
+  template <typename Vector>
+  void to_aos(const float *soa, Vector &aos) const
+  {
+    basis->to_aos(soa, aos);
+  }
+
+  // whether meshlet m can be skipped when drawn from `eye`: every triangle
+  // faces away (rest pose cone test, see above)
+  bool backfacing(size_t m, const glm::vec3 &eye) const
+  {
+    const Meshlet &meshlet = meshlets[m];
+    glm::vec3 view = meshlet.center - eye;
+    return glm::dot(view, meshlet.cone_axis) >= meshlet.cone_cutoff * glm::length(view) + meshlet.radius;
+  }
+
+  // whether meshlet m lies outside one of the planes (xyz normal pointing
+  // inside, w offset), e.g. the six frustum planes in model space
+  bool outside(size_t m, const glm::vec4 *planes, size_t num_planes) const
+  {
+    const Meshlet &meshlet = meshlets[m];
+    for (size_t p = 0; p < num_planes; p++)
+    {
+      if (glm::dot(glm::vec3(planes[p]), meshlet.center) + planes[p].w < -meshlet.radius)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  const BlendBasis *basis;
+  size_t block_count;
+  size_t words; // mask words per meshlet
+  std::vector<Meshlet> meshlets;
+  std::vector<uint32_t> vertex_list;
+  std::vector<uint8_t> triangle_list;
+  std::vector<uint32_t> owned_list;
+  std::vector<uint64_t> masks;
+
+  // base and deltas again in meshlet-major order: the owned vertices of
+  // meshlet m start at slot_offsets[m], padded to LANES
+  std::vector<uint32_t> slot_offsets;
+  size_t slot_stride = 0;
+  BlendBasis::Stream slots;
+
+  // component c of block b (0 is the base, then the delta blocks)
+  const float *slot(size_t b, int c) const
+  {
+    return &slots[(b * 3 + c) * slot_stride];
+  }
+
+  bool intersects(size_t m, const uint64_t *active) const
+  {
+    const uint64_t *bits = mask(m);
+    for (size_t k = 0; k < words; k++)
+    {
+      if (bits[k] & active[k])
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // the terms of a blend and the mask of the blocks they use; both live in
+  // the caller's scratch scope
+  void active_blocks(const std::vector<tinyobj::real_t> &weights,
+                     std::pmr::vector<uint64_t> &active, std::pmr::vector<BlendTerm> &terms) const
+  {
+    active.assign(words, 0);
+    terms.reserve(2 * basis->num_targets());
+    blend_terms(basis->inbetweens(), basis->num_targets(), weights, terms);
+    for (const BlendTerm &term : terms)
+    {
+      active[term.block / 64] |= uint64_t(1) << (term.block % 64);
+    }
+  }
+
+  // greedy clustering: grow each meshlet from a seed triangle, always adding
+  // the neighbouring triangle that brings the fewest new vertices. Vertices
+  // no triangle references still blend (to_aos() writes them out), so they
+  // go to trailing meshlets without triangles
+  void partition(const std::pmr::vector<int> &corners)
+  {
+    size_t V = basis->num_vertices();
+    size_t T = corners.size() / 3;
+    std::vector<uint32_t> offsets(V + 1, 0);
+    for (int v : corners)
+    {
+      offsets[v + 1]++;
+    }
+    for (size_t v = 0; v < V; v++)
+    {
+      offsets[v + 1] += offsets[v];
+    }
+    std::vector<uint32_t> incident(corners.size());
+    {
+      std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+      for (size_t c = 0; c < corners.size(); c++)
+      {
+        incident[cursor[corners[c]]++] = (uint32_t)(c / 3);
+      }
+    }
+
+    std::vector<int> local(V, -1);
+    std::vector<bool> used(T, false), owned(V, false);
+    std::vector<uint32_t> candidates;
+    size_t seed = 0;
+    while (true)
+    {
+      while (seed < T && used[seed])
+      {
+        seed++;
+      }
+      if (seed == T)
+      {
+        break;
+      }
+      Meshlet meshlet = {};
+      meshlet.vertex_offset = (uint32_t)vertex_list.size();
+      meshlet.triangle_offset = (uint32_t)(triangle_list.size() / 3);
+      candidates.assign(1, (uint32_t)seed);
+      while (true)
+      {
+        long best = -1;
+        int best_new = 4;
+        size_t kept = 0;
+        for (uint32_t t : candidates)
+        {
+          if (used[t])
+          {
+            continue;
+          }
+          candidates[kept++] = t;
+          int fresh = 0;
+          for (int i = 0; i < 3; i++)
+          {
+            fresh += local[corners[t * 3 + i]] < 0 ? 1 : 0;
+          }
+          if (fresh < best_new)
+          {
+            best_new = fresh;
+            best = t;
+          }
+        }
+        candidates.resize(kept);
+        if (best < 0 || meshlet.vertex_count + best_new > MAX_VERTICES ||
+            meshlet.triangle_count + 1 > MAX_TRIANGLES)
+        {
+          break;
+        }
+        used[best] = true;
+        for (int i = 0; i < 3; i++)
+        {
+          int v = corners[best * 3 + i];
+          if (local[v] < 0)
+          {
+            local[v] = (int)meshlet.vertex_count++;
+            vertex_list.push_back((uint32_t)v);
+            candidates.insert(candidates.end(), &incident[offsets[v]], &incident[offsets[v + 1]]);
+          }
+          triangle_list.push_back((uint8_t)local[v]);
+        }
+        meshlet.triangle_count++;
+      }
+
+      meshlet.owned_offset = (uint32_t)owned_list.size();
+      for (uint32_t k = 0; k < meshlet.vertex_count; k++)
+      {
+        uint32_t v = vertex_list[meshlet.vertex_offset + k];
+        local[v] = -1;
+        if (!owned[v])
+        {
+          owned[v] = true;
+          owned_list.push_back(v);
+        }
+      }
+      meshlet.owned_count = (uint32_t)(owned_list.size() - meshlet.owned_offset);
+      std::sort(owned_list.begin() + meshlet.owned_offset, owned_list.end());
+      meshlets.push_back(meshlet);
+    }
+
+    Meshlet loose = {};
+    for (size_t v = 0; v < V; v++)
+    {
+      if (owned[v])
+      {
+        continue;
+      }
+      if (loose.vertex_count == 0)
+      {
+        loose.vertex_offset = (uint32_t)vertex_list.size();
+        loose.triangle_offset = (uint32_t)(triangle_list.size() / 3);
+        loose.owned_offset = (uint32_t)owned_list.size();
+      }
+      vertex_list.push_back((uint32_t)v);
+      owned_list.push_back((uint32_t)v);
+      loose.vertex_count++;
+      loose.owned_count++;
+      if (loose.vertex_count == MAX_VERTICES)
+      {
+        meshlets.push_back(loose);
+        loose = {};
+      }
+    }
+    if (loose.vertex_count > 0)
+    {
+      meshlets.push_back(loose);
+    }
+  }
+
+  void build_masks(float threshold)
+  {
+    masks.assign(meshlets.size() * words, 0);
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+      const Meshlet &meshlet = meshlets[m];
+      for (size_t b = 0; b < block_count; b++)
+      {
+        for (uint32_t k = 0; k < meshlet.vertex_count; k++)
+        {
+          uint32_t v = vertex_list[meshlet.vertex_offset + k];
+          if (std::abs(basis->delta(b, 0)[v]) > threshold ||
+              std::abs(basis->delta(b, 1)[v]) > threshold ||
+              std::abs(basis->delta(b, 2)[v]) > threshold)
+          {
+            masks[m * words + b / 64] |= uint64_t(1) << (b % 64);
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  glm::vec3 position(uint32_t v, long block) const
+  {
+    glm::vec3 p(basis->base(0)[v], basis->base(1)[v], basis->base(2)[v]);
+    if (block >= 0)
+    {
+      p += glm::vec3(basis->delta(block, 0)[v], basis->delta(block, 1)[v], basis->delta(block, 2)[v]);
+    }
+    return p;
+  }
+
+  void build_bounds()
+  {
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+      Meshlet &meshlet = meshlets[m];
+      const uint32_t *verts = &vertex_list[meshlet.vertex_offset];
+      const uint8_t *tris = &triangle_list[meshlet.triangle_offset * 3];
+
+      // sphere around the base, grown by the largest displacement any blend
+      // with weights in [0, 1] can add
+      glm::vec3 low(position(verts[0], -1)), high(low);
+      for (uint32_t k = 1; k < meshlet.vertex_count; k++)
+      {
+        low = glm::min(low, position(verts[k], -1));
+        high = glm::max(high, position(verts[k], -1));
+      }
+      meshlet.center = 0.5f * (low + high);
+      meshlet.radius = 0;
+      for (uint32_t k = 0; k < meshlet.vertex_count; k++)
+      {
+        float reach = glm::length(position(verts[k], -1) - meshlet.center);
+        for (size_t b = 0; b < block_count; b++)
+        {
+          if (mask(m)[b / 64] >> (b % 64) & 1)
+          {
+            reach += glm::length(position(verts[k], (long)b) - position(verts[k], -1));
+          }
+        }
+        meshlet.radius = std::max(meshlet.radius, reach);
+      }
+
+      // normal cone over the base and every moving block at weight 1
+      std::vector<glm::vec3> normals;
+      for (long b = -1; b < (long)block_count; b++)
+      {
+        if (b >= 0 && !(mask(m)[b / 64] >> (b % 64) & 1))
+        {
+          continue;
+        }
+        for (uint32_t t = 0; t < meshlet.triangle_count; t++)
+        {
+          glm::vec3 p0 = position(verts[tris[t * 3]], b);
+          glm::vec3 n = glm::cross(position(verts[tris[t * 3 + 1]], b) - p0,
+                                   position(verts[tris[t * 3 + 2]], b) - p0);
+          float length = glm::length(n);
+          if (length > 0)
+          {
+            normals.push_back(n / length);
+          }
+        }
+      }
+      glm::vec3 axis(0.0f);
+      for (const glm::vec3 &n : normals)
+      {
+        axis += n;
+      }
+      float length = glm::length(axis);
+      meshlet.cone_axis = length > 0 ? axis / length : glm::vec3(0, 0, 1);
+      float min_dot = length > 0 ? 1.0f : -1.0f;
+      for (const glm::vec3 &n : normals)
+      {
+        min_dot = std::min(min_dot, glm::dot(n, meshlet.cone_axis));
+      }
+      // backfacing from direction d once angle(d, axis) < 90 degrees minus
+      // the cone's half angle
+      meshlet.cone_cutoff = min_dot <= 0 ? 2.0f : std::sqrt(1 - min_dot * min_dot);
+    }
+  }
+
+  void build_slots()
+  {
+    slot_offsets.resize(meshlets.size());
+    for (size_t m = 0; m < meshlets.size(); m++)
+    {
+      slot_offsets[m] = (uint32_t)slot_stride;
+      slot_stride += (meshlets[m].owned_count + LANES - 1) / LANES * LANES;
+    }
+    slots.assign((block_count + 1) * 3 * slot_stride, 0.0f);
+    for (size_t b = 0; b <= block_count; b++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        const float *src = b == 0 ? basis->base(c) : basis->delta(b - 1, c);
+        float *dst = &slots[(b * 3 + c) * slot_stride];
+        for (size_t m = 0; m < meshlets.size(); m++)
+        {
+          for (uint32_t i = 0; i < meshlets[m].owned_count; i++)
+          {
+            dst[slot_offsets[m] + i] = src[owned_list[meshlets[m].owned_offset + i]];
+          }
+        }
+      }
+    }
+  }
+};
+
+#endif // !MESHLETS_H
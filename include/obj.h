@@ -4,15 +4,21 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #define TINYOBJLOADER_USE_DOUBLE
 #include <tiny_obj_loader.h>
+#include <mem_tracker.h>
+#include <trace.h>
 
 class Obj
 {
 public:
-  Obj(const std::string &file_path) : obj_path(file_path)
+  // triangulate = false keeps polygons as authored; shape.mesh
+  // .num_face_vertices then gives the corner count of every face
+  Obj(const std::string &file_path, bool triangulate = true) : obj_path(file_path)
   {
+    TRACE_SCOPE("Obj::Obj");
+    MemScope mem_scope(MEM_LOADER);
     std::string warn, err;
 
-    bool bTriangulate = true;
+    bool bTriangulate = triangulate;
     bool bSuc = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
                                  obj_path.c_str(), nullptr, bTriangulate);
 
@@ -22,17 +28,17 @@ public:
     }
   }
 
-  std::vector<tinyobj::shape_t> getShapes()
+  const std::vector<tinyobj::shape_t> &getShapes() const
   {
     return shapes;
   }
 
-  std::vector<tinyobj::real_t> getVertices()
+  const std::vector<tinyobj::real_t> &getVertices() const
   {
     return attrib.vertices;
   }
 
-  std::vector<tinyobj::real_t> getNormals()
+  const std::vector<tinyobj::real_t> &getNormals() const
   {
     return attrib.normals;
   }
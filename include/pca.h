@@ -0,0 +1,278 @@
+#ifndef PCA_H
+#define PCA_H
+
+#include <algorithm>
+#include <arena.h>
+#include <basis.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <linalg.h>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <scheduler.h>
+#include <string>
+#include <trace.h>
+#include <vector>
+
+// Low-rank blend basis: the 3V x T delta matrix D is replaced by its
+// truncated SVD D ~= U S Q^T, computed from the eigen-decomposition of the
+// small T x T Gram matrix D^T D = Q S^2 Q^T. U (K orthonormal components) is
+// stored as SoA float streams like BlendBasis, and P = Q S (T x K) maps a
+// weight vector onto component coefficients, so
+//
+//   blended = base + U (P^T w)
+//
+// costs O(T K + K V) instead of O(T V). K is the smallest rank whose
+// relative Frobenius error sqrt(sum_{k >= K} s_k^2 / sum_k s_k^2) is within
+// the requested tolerance.
+//
+// In-between shapes are not part of the low-rank basis: targets respond
+// linearly here even if the source basis has in-betweens.
+//
+// build() is the offline step; save()/load() keep the result in a cache file
+// that is much smaller than the targets when K << T. The cache is keyed to a
+// checksum of the source basis, so editing a target invalidates it.
+class PcaBasis
+{
+public:
+  static constexpr size_t ALIGNMENT = BlendBasis::ALIGNMENT;
+  static constexpr size_t LANES = BlendBasis::LANES;
+
+  PcaBasis() = default;
+
+  static PcaBasis build(JobScheduler &scheduler, const BlendBasis &basis, double tolerance)
+  {
+    TRACE_SCOPE("PcaBasis::build");
+    MemScope mem_scope(MEM_BASIS);
+    PcaBasis pca;
+    pca.key = basis.checksum();
+    pca.vertex_count = basis.num_vertices();
+    pca.target_count = basis.num_targets();
+    pca.stride = basis.padded();
+    pca.requested = tolerance;
+    size_t T = pca.target_count;
+
+    std::vector<double> gram;
+    basis.gram(scheduler, gram);
+
+    std::vector<double> values(T), vectors(T * T);
+    symmetric_eigen(gram.data(), T, values.data(), vectors.data());
+    double total = 0;
+    for (double &value : values)
+    {
+      value = std::max(0.0, value);
+      total += value;
+    }
+
+    // smallest K with the discarded energy inside the tolerance
+    size_t K = T;
+    double discarded = 0;
+    while (K > 0 && total > 0 &&
+           std::sqrt((discarded + values[K - 1]) / total) <= tolerance)
+    {
+      discarded += values[K - 1];
+      K--;
+    }
+    // drop numerically null directions
+    while (K > 0 && values[K - 1] <= 1e-12 * total)
+    {
+      discarded += values[K - 1];
+      K--;
+    }
+    pca.component_count = K;
+    pca.error = total > 0 ? std::sqrt(discarded / total) : 0.0;
+
+    pca.data.assign((K + 1) * 3 * pca.stride, 0.0f);
+    for (int c = 0; c < 3; c++)
+    {
+      std::copy(basis.base(c), basis.base(c) + pca.vertex_count, &pca.data[c * pca.stride]);
+    }
+
+    // U_k = D q_k / s_k, P[t][k] = q_k[t] * s_k
+    pca.projection.assign(T * K, 0.0f);
+    scheduler.parallel_for(0, K, 1, [&](size_t begin, size_t end)
+                           {
+                             for (size_t k = begin; k < end; k++)
+                             {
+                               double s = std::sqrt(values[k]);
+                               for (int c = 0; c < 3; c++)
+                               {
+                                 float *u = &pca.data[((k + 1) * 3 + c) * pca.stride];
+                                 for (size_t t = 0; t < T; t++)
+                                 {
+                                   float q = (float)(vectors[t * T + k] / s);
+                                   const float *d = basis.delta(t, c);
+                                   for (size_t v = 0; v < pca.vertex_count; v++)
+                                   {
+                                     u[v] += q * d[v];
+                                   }
+                                 }
+                               }
+                               for (size_t t = 0; t < T; t++)
+                               {
+                                 pca.projection[t * K + k] = (float)(vectors[t * T + k] * s);
+                               }
+                             }
+                           });
+    return pca;
+  }
+
+  size_t num_vertices() const
+  {
+    return vertex_count;
+  }
+
+  size_t num_targets() const
+  {
+    return target_count;
+  }
+
+  size_t num_components() const
+  {
+    return component_count;
+  }
+
+  size_t padded() const
+  {
+    return stride;
+  }
+
+  // tolerance requested at build time
+  double tolerance() const
+  {
+    return requested;
+  }
+
+  // relative Frobenius error of the truncated delta matrix
+  double relative_error() const
+  {
+    return error;
+  }
+
+  // same contract as BlendBasis::evaluate
+  void evaluate(JobScheduler &scheduler, const std::vector<tinyobj::real_t> &weights,
+                float *out, const Rig *rig = nullptr, const SkinPose *pose = nullptr) const
+  {
+    TRACE_SCOPE("PcaBasis::evaluate");
+    ArenaScope scratch;
+    std::pmr::vector<float> coefficients(component_count, 0.0f, scratch.resource());
+    size_t num_weights = std::min(weights.size(), target_count);
+    for (size_t t = 0; t < num_weights; t++)
+    {
+      if (weights[t] == 0)
+      {
+        continue;
+      }
+      float w = (float)weights[t];
+      for (size_t k = 0; k < component_count; k++)
+      {
+        coefficients[k] += w * projection[t * component_count + k];
+      }
+    }
+
+    scheduler.parallel_for(0, stride / LANES, 64, [&](size_t begin, size_t end)
+                           {
+                             size_t lo = begin * LANES;
+                             size_t n = (end - begin) * LANES;
+                             for (int c = 0; c < 3; c++)
+                             {
+                               float *__restrict dst = out + c * stride + lo;
+                               const float *src = &data[c * stride + lo];
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                 dst[i] = src[i];
+                               }
+                               for (size_t k = 0; k < component_count; k++)
+                               {
+                                 float a = coefficients[k];
+                                 const float *__restrict u = &data[((k + 1) * 3 + c) * stride + lo];
+                                 for (size_t i = 0; i < n; i++)
+                                 {
+                                   dst[i] += a * u[i];
+                                 }
+                               }
+                             }
+                             finish_range(weights, rig, pose, out, stride, lo, n);
+                           });
+  }
+
+  template <typename Vector>
+  void to_aos(const float *soa, Vector &aos) const
+  {
+    soa_to_aos(soa, stride, vertex_count, aos);
+  }
+
+  size_t size_bytes() const
+  {
+    return data.size() * sizeof(float) + projection.size() * sizeof(float);
+  }
+
+  bool save(const std::string &path) const
+  {
+    std::ofstream file(path, std::ios::binary);
+    uint64_t header[7] = {MAGIC, key, vertex_count, target_count, component_count, stride, 0};
+    std::memcpy(&header[6], &requested, sizeof(double));
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)&error, sizeof(error));
+    file.write((const char *)data.data(), data.size() * sizeof(float));
+    file.write((const char *)projection.data(), projection.size() * sizeof(float));
+    if (!file)
+    {
+      std::cout << "ERROR::PCA::CACHE_NOT_WRITTEN: " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // false if the file is missing, truncated, from another format or was
+  // built from another basis
+  bool load(const std::string &path, const BlendBasis &basis)
+  {
+    MemScope mem_scope(MEM_BASIS);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::streamoff size = file ? (std::streamoff)file.tellg() : 0;
+    file.seekg(0);
+    uint64_t header[7];
+    if (!file.read((char *)header, sizeof(header)) || header[0] != MAGIC ||
+        header[1] != basis.checksum() || header[2] != basis.num_vertices() ||
+        header[3] != basis.num_targets() || header[4] > header[3] || header[5] != basis.padded())
+    {
+      return false;
+    }
+    // the header fields are trusted now; the payload must match them exactly
+    size_t floats = (header[4] + 1) * 3 * header[5] + header[3] * header[4];
+    if ((uint64_t)size != sizeof(header) + sizeof(double) + floats * sizeof(float))
+    {
+      return false;
+    }
+    key = header[1];
+    vertex_count = header[2];
+    target_count = header[3];
+    component_count = header[4];
+    stride = header[5];
+    std::memcpy(&requested, &header[6], sizeof(double));
+    data.resize((component_count + 1) * 3 * stride);
+    projection.resize(target_count * component_count);
+    return (bool)file.read((char *)&error, sizeof(error)) &&
+           file.read((char *)data.data(), data.size() * sizeof(float)) &&
+           file.read((char *)projection.data(), projection.size() * sizeof(float));
+  }
+
+private:
+  static constexpr uint64_t MAGIC = 0x3241435053454146ull; // "FAESPCA2"
+
+  uint64_t key = 0; // checksum of the basis it was built from
+  size_t vertex_count = 0;
+  size_t target_count = 0;
+  size_t component_count = 0;
+  size_t stride = 0;
+  double requested = 0;
+  double error = 0;
+  BlendBasis::Stream data; // base streams, then K component streams
+  std::vector<float> projection; // T x K, row-major
+};
+
+#endif // !PCA_H
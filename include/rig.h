@@ -0,0 +1,495 @@
+#ifndef RIG_H
+#define RIG_H
+
+#include <algorithm>
+#include <cmath>
+#include <drivers.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mem_tracker.h>
+#include <obj.h>
+#include <skinning.h>
+#include <sstream>
+#include <string>
+#include <trace.h>
+#include <vector>
+
+// Optional rig manifest next to the targets (data/faces/rig.txt). One entry
+// per line, '#' starts a comment, paths are relative to the manifest:
+//
+//   corrective <obj> <driver> <driver> [...]
+//   inbetween <target> <weight> <obj>
+//   control <name> [default]
+//   driver <target> <expression>
+//   joint <name> <parent|-> <x> <y> <z> [<rx> <ry> <rz>]
+//   skin <file>
+//
+// A corrective is sculpted with all of its drivers (target indices) at 1:
+// its delta is the sculpt minus base + the drivers' deltas, and it is added
+// with the product of the driver weights.
+//
+// An in-between is the full shape of <target> at <weight> (> 0, != 1); the
+// target then responds piecewise-linearly through 0, its in-betweens and 1,
+// extrapolating the first and last segments.
+//
+// Drivers compute target weights from the declared controls, see
+// DriverProgram for the expressions.
+//
+// Joints pivot about <x y z> and are declared parents first, the root with
+// parent '-'; the optional angles (degrees) are a preview pose. The skin
+// file binds vertices to joints, see SkinBinding.
+struct RigManifest
+{
+  struct Corrective
+  {
+    std::string path;
+    std::vector<int> drivers;
+  };
+
+  struct InBetween
+  {
+    int target;
+    double weight;
+    std::string path;
+  };
+
+  std::vector<Corrective> correctives;
+  std::vector<InBetween> inbetweens;
+  std::vector<DriverControl> controls;
+  std::vector<DriverSource> drivers;
+  std::vector<SkinJoint> joints;
+  std::string skin;
+};
+
+// an absent manifest is an empty rig
+inline RigManifest load_rig_manifest(const std::string &faces_path)
+{
+  RigManifest manifest;
+  std::ifstream file(faces_path + "rig.txt");
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line))
+  {
+    line_number++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string kind;
+    if (!(fields >> kind))
+    {
+      continue;
+    }
+
+    if (kind == "corrective")
+    {
+      RigManifest::Corrective corrective;
+      fields >> corrective.path;
+      int driver;
+      while (fields >> driver)
+      {
+        corrective.drivers.push_back(driver);
+      }
+      if (corrective.path.empty() || corrective.drivers.size() < 2)
+      {
+        std::cout << "ERROR::RIG::CORRECTIVE_NEEDS_TWO_DRIVERS: line " << line_number << std::endl;
+        continue;
+      }
+      corrective.path = faces_path + corrective.path;
+      manifest.correctives.push_back(corrective);
+    }
+    else if (kind == "inbetween")
+    {
+      RigManifest::InBetween inbetween;
+      if (!(fields >> inbetween.target >> inbetween.weight >> inbetween.path) ||
+          inbetween.weight <= 0 || inbetween.weight == 1)
+      {
+        std::cout << "ERROR::RIG::BAD_INBETWEEN: line " << line_number << std::endl;
+        continue;
+      }
+      // two breakpoints at one weight would leave a zero-width segment
+      bool duplicate = false;
+      for (const auto &existing : manifest.inbetweens)
+      {
+        duplicate |= existing.target == inbetween.target && existing.weight == inbetween.weight;
+      }
+      if (duplicate)
+      {
+        std::cout << "ERROR::RIG::DUPLICATE_INBETWEEN: line " << line_number << std::endl;
+        continue;
+      }
+      inbetween.path = faces_path + inbetween.path;
+      manifest.inbetweens.push_back(inbetween);
+    }
+    else if (kind == "control")
+    {
+      DriverControl control;
+      if (!(fields >> control.name))
+      {
+        std::cout << "ERROR::RIG::BAD_CONTROL: line " << line_number << std::endl;
+        continue;
+      }
+      fields >> control.value;
+      manifest.controls.push_back(control);
+    }
+    else if (kind == "driver")
+    {
+      DriverSource driver;
+      if (!(fields >> driver.target) || !std::getline(fields, driver.expression))
+      {
+        std::cout << "ERROR::RIG::BAD_DRIVER: line " << line_number << std::endl;
+        continue;
+      }
+      manifest.drivers.push_back(driver);
+    }
+    else if (kind == "joint")
+    {
+      SkinJoint joint;
+      if (!(fields >> joint.name >> joint.parent >> joint.pivot.x >> joint.pivot.y >> joint.pivot.z))
+      {
+        std::cout << "ERROR::RIG::BAD_JOINT: line " << line_number << std::endl;
+        continue;
+      }
+      fields >> joint.rotation.x >> joint.rotation.y >> joint.rotation.z;
+      manifest.joints.push_back(joint);
+    }
+    else if (kind == "skin")
+    {
+      if (!(fields >> manifest.skin))
+      {
+        std::cout << "ERROR::RIG::BAD_SKIN: line " << line_number << std::endl;
+        continue;
+      }
+      manifest.skin = faces_path + manifest.skin;
+    }
+    else
+    {
+      std::cout << "ERROR::RIG::UNKNOWN_ENTRY: " << kind << " on line " << line_number << std::endl;
+    }
+  }
+  return manifest;
+}
+
+// Per-target breakpoint table of the in-between response. terms() turns a
+// weight into at most two (delta, coefficient) pairs: the bracketing
+// breakpoints, interpolated linearly. Targets without in-betweens yield the
+// plain (target delta, w) term.
+class InBetweenLookup
+{
+public:
+  // which delta a term scales: TARGET is the target's own (weight 1) delta,
+  // otherwise the index of an in-between shape
+  static const long TARGET = -1;
+
+  struct Term
+  {
+    long shape;
+    double coefficient;
+  };
+
+  void resize(size_t num_targets)
+  {
+    table.resize(num_targets);
+  }
+
+  void add(size_t target, double weight, long shape)
+  {
+    std::vector<Breakpoint> &points = table[target];
+    if (points.empty())
+    {
+      points.push_back({0.0, ZERO});
+      points.push_back({1.0, TARGET});
+    }
+    points.push_back({weight, shape});
+    std::sort(points.begin(), points.end(), [](const Breakpoint &a, const Breakpoint &b)
+              { return a.weight < b.weight; });
+  }
+
+  bool empty() const
+  {
+    for (const auto &points : table)
+    {
+      if (!points.empty())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // returns the number of terms written to `out`
+  int terms(size_t target, double w, Term out[2]) const
+  {
+    if (target >= table.size() || table[target].empty())
+    {
+      out[0] = {TARGET, w};
+      return 1;
+    }
+    const std::vector<Breakpoint> &points = table[target];
+    size_t k = 1;
+    while (k + 1 < points.size() && points[k].weight < w)
+    {
+      k++;
+    }
+    const Breakpoint &a = points[k - 1], &b = points[k];
+    double alpha = (w - a.weight) / (b.weight - a.weight);
+    int count = 0;
+    if (a.shape != ZERO)
+    {
+      out[count++] = {a.shape, 1.0 - alpha};
+    }
+    if (b.shape != ZERO)
+    {
+      out[count++] = {b.shape, alpha};
+    }
+    return count;
+  }
+
+private:
+  static const long ZERO = -2; // the implicit breakpoint (0, no delta)
+
+  struct Breakpoint
+  {
+    double weight;
+    long shape;
+  };
+
+  std::vector<std::vector<Breakpoint>> table;
+};
+
+// In-between shapes from the manifest, as double deltas from the base
+class InBetweenSet
+{
+public:
+  InBetweenSet() = default;
+
+  InBetweenSet(const Obj &base_obj, size_t num_targets, const RigManifest &manifest)
+  {
+    TRACE_SCOPE("InBetweenSet::InBetweenSet");
+    MemScope mem_scope(MEM_BASIS);
+    const std::vector<tinyobj::real_t> &base = base_obj.getVertices();
+    table.resize(num_targets);
+    for (const auto &entry : manifest.inbetweens)
+    {
+      Obj shape(entry.path);
+      const std::vector<tinyobj::real_t> &vertices = shape.getVertices();
+      if (entry.target < 0 || (size_t)entry.target >= num_targets ||
+          vertices.size() != base.size())
+      {
+        std::cout << "ERROR::RIG::INBETWEEN_MISMATCH: " << entry.path << std::endl;
+        continue;
+      }
+      std::vector<tinyobj::real_t> delta(base.size());
+      for (size_t j = 0; j < base.size(); j++)
+      {
+        delta[j] = vertices[j] - base[j];
+      }
+      table.add(entry.target, entry.weight, (long)deltas.size());
+      deltas.push_back(std::move(delta));
+    }
+  }
+
+  size_t size() const
+  {
+    return deltas.size();
+  }
+
+  const std::vector<tinyobj::real_t> &delta(size_t shape) const
+  {
+    return deltas[shape];
+  }
+
+  const InBetweenLookup &lookup() const
+  {
+    return table;
+  }
+
+private:
+  InBetweenLookup table;
+  std::vector<std::vector<tinyobj::real_t>> deltas;
+};
+
+// Corrective combination shapes stored sparsely: only vertices the sculpt
+// actually moves are kept. Correctives are bucketed by their first driver,
+// so evaluation only visits correctives whose first driver is non-zero and
+// the cost follows the active correctives rather than the total.
+class CorrectiveSet
+{
+public:
+  CorrectiveSet() = default;
+
+  CorrectiveSet(const Obj &base_obj, const std::vector<Obj> &face_objs,
+                const RigManifest &manifest, double threshold = 1e-6)
+  {
+    TRACE_SCOPE("CorrectiveSet::CorrectiveSet");
+    MemScope mem_scope(MEM_BASIS);
+    const std::vector<tinyobj::real_t> &base = base_obj.getVertices();
+    size_t num_vertices = base.size() / 3;
+    by_driver.assign(face_objs.size(), {});
+
+    for (const auto &entry : manifest.correctives)
+    {
+      bool valid = true;
+      for (int driver : entry.drivers)
+      {
+        valid = valid && driver >= 0 && (size_t)driver < face_objs.size();
+      }
+      Obj sculpt(entry.path);
+      const std::vector<tinyobj::real_t> &sculpted = sculpt.getVertices();
+      if (!valid || sculpted.size() != base.size())
+      {
+        std::cout << "ERROR::RIG::CORRECTIVE_MISMATCH: " << entry.path << std::endl;
+        continue;
+      }
+
+      Corrective corrective;
+      corrective.drivers = entry.drivers;
+      std::sort(corrective.drivers.begin(), corrective.drivers.end());
+      corrective.first = entries.size();
+      for (size_t v = 0; v < num_vertices; v++)
+      {
+        float delta[3];
+        bool moved = false;
+        for (int c = 0; c < 3; c++)
+        {
+          double linear = base[v * 3 + c];
+          for (int driver : corrective.drivers)
+          {
+            linear += face_objs[driver].getVertices()[v * 3 + c] - base[v * 3 + c];
+          }
+          delta[c] = (float)(sculpted[v * 3 + c] - linear);
+          moved = moved || std::abs(delta[c]) > threshold;
+        }
+        if (moved)
+        {
+          entries.push_back({(uint32_t)v, {delta[0], delta[1], delta[2]}});
+        }
+      }
+      corrective.last = entries.size();
+      by_driver[corrective.drivers[0]].push_back(correctives.size());
+      correctives.push_back(corrective);
+    }
+  }
+
+  size_t size() const
+  {
+    return correctives.size();
+  }
+
+  // sparse entries over all correctives
+  size_t num_entries() const
+  {
+    return entries.size();
+  }
+
+  // add every active corrective to interleaved xyz positions
+  template <typename Vector>
+  void apply(const std::vector<tinyobj::real_t> &weights, Vector &vertices) const
+  {
+    for_each_active(weights, [&](const Corrective &corrective, double product)
+                    {
+                      for (size_t e = corrective.first; e < corrective.last; e++)
+                      {
+                        for (int c = 0; c < 3; c++)
+                        {
+                          vertices[entries[e].vertex * 3 + c] += product * entries[e].delta[c];
+                        }
+                      }
+                    });
+  }
+
+  // add every active corrective to SoA streams `stride` floats apart
+  void apply(const std::vector<tinyobj::real_t> &weights, float *streams, size_t stride) const
+  {
+    apply(weights, streams, stride, 0, stride);
+  }
+
+  // the same restricted to vertices [lo, hi), so it can follow a blend
+  // chunk while the chunk is still in cache
+  void apply(const std::vector<tinyobj::real_t> &weights, float *streams, size_t stride,
+             size_t lo, size_t hi) const
+  {
+    for_each_active(weights, [&](const Corrective &corrective, double product)
+                    {
+                      auto first = entries.begin() + corrective.first;
+                      auto last = entries.begin() + corrective.last;
+                      if (lo > 0)
+                      {
+                        first = std::lower_bound(first, last, lo, [](const Entry &entry, size_t v)
+                                                 { return entry.vertex < v; });
+                      }
+                      for (; first != last && first->vertex < hi; ++first)
+                      {
+                        for (int c = 0; c < 3; c++)
+                        {
+                          streams[c * stride + first->vertex] += (float)product * first->delta[c];
+                        }
+                      }
+                    });
+  }
+
+private:
+  struct Entry
+  {
+    uint32_t vertex;
+    float delta[3];
+  };
+
+  struct Corrective
+  {
+    std::vector<int> drivers; // ascending
+    size_t first, last;       // range in `entries`
+  };
+
+  std::vector<Entry> entries; // ascending vertex within each corrective
+  std::vector<Corrective> correctives;
+  std::vector<std::vector<size_t>> by_driver; // lowest driver -> correctives
+
+  template <typename F>
+  void for_each_active(const std::vector<tinyobj::real_t> &weights, F fn) const
+  {
+    TRACE_SCOPE("CorrectiveSet::apply");
+    size_t num_weights = std::min(weights.size(), by_driver.size());
+    for (size_t d = 0; d < num_weights; d++)
+    {
+      if (weights[d] == 0)
+      {
+        continue;
+      }
+      for (size_t index : by_driver[d])
+      {
+        const Corrective &corrective = correctives[index];
+        double product = 1;
+        for (int driver : corrective.drivers)
+        {
+          product *= (size_t)driver < weights.size() ? weights[driver] : 0.0;
+        }
+        if (product == 0)
+        {
+          continue;
+        }
+        fn(corrective, product);
+      }
+    }
+  }
+};
+
+// everything the manifest adds on top of the linear targets; drivers run
+// before the blend (DriverProgram) and are not part of it, the skin binding
+// is posed per frame by a SkinPose
+struct Rig
+{
+  InBetweenSet inbetweens;
+  CorrectiveSet correctives;
+  SkinBinding skin;
+
+  Rig() = default;
+
+  Rig(const Obj &base_obj, const std::vector<Obj> &face_objs, const RigManifest &manifest)
+      : inbetweens(base_obj, face_objs.size(), manifest),
+        correctives(base_obj, face_objs, manifest),
+        skin(manifest.joints, manifest.skin, base_obj.getVertices().size() / 3)
+  {
+  }
+};
+
+#endif // !RIG_H
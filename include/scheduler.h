@@ -0,0 +1,539 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A node in the task graph. `pending` counts unfinished predecessors plus one
+// hold that submit() releases, so a task never starts before it is submitted.
+// A failed predecessor hands its error on instead of letting `fn` run, so the
+// first exception reaches whoever waits on the end of the graph.
+struct Task
+{
+  std::function<void()> fn;
+  std::atomic<int> pending{1};
+  std::atomic<bool> done{false};
+  std::exception_ptr error;
+
+  std::mutex lock;
+  std::vector<std::shared_ptr<Task>> continuations;
+};
+
+using TaskHandle = std::shared_ptr<Task>;
+
+// Work-stealing task scheduler. Every worker owns a deque: it pushes and pops
+// at the back (LIFO, cache friendly) while idle workers steal from the front.
+// Threads that wait() on a task help execute queued work instead of blocking.
+// Finished tasks nobody else references are pooled and the deques only grow,
+// so the synchronous parallel_for does not allocate once warmed up.
+class JobScheduler
+{
+public:
+  explicit JobScheduler(
+      unsigned int num_workers = std::thread::hardware_concurrency())
+  {
+    num_workers = std::max(1u, num_workers);
+    for (unsigned int i = 0; i < num_workers; i++)
+    {
+      queues.push_back(std::make_unique<WorkQueue>());
+    }
+    for (unsigned int i = 0; i < num_workers; i++)
+    {
+      workers.emplace_back(&JobScheduler::worker_loop, this, (int)i);
+    }
+  }
+
+  ~JobScheduler()
+  {
+    wait_idle();
+    {
+      std::lock_guard<std::mutex> guard(sleep_mutex);
+      stopping = true;
+    }
+    sleep_cv.notify_all();
+    for (auto &worker : workers)
+    {
+      worker.join();
+    }
+  }
+
+  JobScheduler(const JobScheduler &) = delete;
+  JobScheduler &operator=(const JobScheduler &) = delete;
+
+  unsigned int size() const
+  {
+    return (unsigned int)workers.size();
+  }
+
+  // create a task that runs once it is submitted and its predecessors are done
+  TaskHandle create(std::function<void()> fn)
+  {
+    TaskHandle task;
+    {
+      std::lock_guard<std::mutex> guard(pool_lock);
+      if (!pool.empty())
+      {
+        task = std::move(pool.back());
+        pool.pop_back();
+      }
+    }
+    if (!task)
+    {
+      task = std::make_shared<Task>();
+    }
+    task->fn = std::move(fn);
+    return task;
+  }
+
+  // make `after` wait for `before`; must be called before `after` is submitted
+  void precede(const TaskHandle &before, const TaskHandle &after)
+  {
+    {
+      std::lock_guard<std::mutex> guard(before->lock);
+      if (!before->done.load(std::memory_order_acquire))
+      {
+        after->pending.fetch_add(1, std::memory_order_relaxed);
+        before->continuations.push_back(after);
+        return;
+      }
+    }
+    inherit_error(before->error, after);
+  }
+
+  void submit(const TaskHandle &task)
+  {
+    release(task);
+  }
+
+  TaskHandle async(std::function<void()> fn)
+  {
+    TaskHandle task = create(std::move(fn));
+    submit(task);
+    return task;
+  }
+
+  // continuation: run `fn` once `before` has finished; if `before` failed, `fn`
+  // is skipped and waiting on the result rethrows that error
+  TaskHandle then(const TaskHandle &before, std::function<void()> fn)
+  {
+    return when_all({before}, std::move(fn));
+  }
+
+  // join: run `fn` (may be empty) once every task in `before` has finished;
+  // skipped, carrying the first error, if any of them failed
+  TaskHandle when_all(const std::vector<TaskHandle> &before,
+                      std::function<void()> fn = {})
+  {
+    TaskHandle task = create(std::move(fn));
+    for (const auto &dependency : before)
+    {
+      precede(dependency, task);
+    }
+    submit(task);
+    return task;
+  }
+
+  // split [begin, end) into chunks of at most `grain` items and call
+  // fn(chunk_begin, chunk_end) on each; the returned task completes (and
+  // carries the first exception thrown) once every chunk is done
+  template <typename F>
+  TaskHandle parallel_for_async(size_t begin, size_t end, size_t grain, F fn)
+  {
+    grain = std::max<size_t>(1, grain);
+
+    struct Shared
+    {
+      explicit Shared(F f) : fn(std::move(f)) {}
+
+      F fn;
+      std::mutex lock;
+      std::exception_ptr error;
+    };
+    auto shared = std::make_shared<Shared>(std::move(fn));
+
+    TaskHandle join = create([shared]()
+                             {
+                               if (shared->error)
+                               {
+                                 std::rethrow_exception(shared->error);
+                               }
+                             });
+    for (size_t lo = begin; lo < end; lo += grain)
+    {
+      size_t hi = std::min(end, lo + grain);
+      TaskHandle chunk = create([shared, lo, hi]()
+                                {
+                                  try
+                                  {
+                                    shared->fn(lo, hi);
+                                  }
+                                  catch (...)
+                                  {
+                                    std::lock_guard<std::mutex> guard(shared->lock);
+                                    if (!shared->error)
+                                    {
+                                      shared->error = std::current_exception();
+                                    }
+                                  }
+                                });
+      precede(chunk, join);
+      submit(chunk);
+    }
+    submit(join);
+    return join;
+  }
+
+  // synchronous variant: chunks are claimed from a shared counter by the
+  // caller and at most one helper task per worker, all state lives on the
+  // caller's stack
+  template <typename F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F fn)
+  {
+    grain = std::max<size_t>(1, grain);
+    if (begin >= end)
+    {
+      return;
+    }
+    size_t chunks = (end - begin + grain - 1) / grain;
+    if (chunks == 1)
+    {
+      fn(begin, end);
+      return;
+    }
+
+    struct Range
+    {
+      F &fn;
+      size_t begin, end, grain, chunks;
+      std::atomic<size_t> next{0};
+      std::atomic<size_t> helpers_done{0};
+      std::mutex lock;
+      std::exception_ptr error;
+
+      Range(F &fn, size_t begin, size_t end, size_t grain, size_t chunks)
+          : fn(fn), begin(begin), end(end), grain(grain), chunks(chunks)
+      {
+      }
+
+      void run()
+      {
+        for (size_t c = next.fetch_add(1); c < chunks; c = next.fetch_add(1))
+        {
+          size_t lo = begin + c * grain;
+          try
+          {
+            fn(lo, std::min(end, lo + grain));
+          }
+          catch (...)
+          {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error)
+            {
+              error = std::current_exception();
+            }
+          }
+        }
+      }
+    };
+    Range range(fn, begin, end, grain, chunks);
+
+    // the lambda only captures a pointer, so std::function stores it inline
+    size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+    for (size_t h = 0; h < helpers; h++)
+    {
+      release(create([&range]()
+                    {
+                      range.run();
+                      range.helpers_done.fetch_add(1, std::memory_order_release);
+                    }));
+    }
+    range.run();
+
+    // helpers reference `range`, so every one of them must have finished
+    while (range.helpers_done.load(std::memory_order_acquire) != helpers)
+    {
+      if (!run_one(current_worker()))
+      {
+        std::this_thread::yield();
+      }
+    }
+    if (range.error)
+    {
+      std::rethrow_exception(range.error);
+    }
+  }
+
+  // block until `task` is done, running queued work meanwhile; rethrows any
+  // exception the task raised
+  void wait(const TaskHandle &task)
+  {
+    while (!task->done.load(std::memory_order_acquire))
+    {
+      if (!run_one(current_worker()))
+      {
+        std::this_thread::yield();
+      }
+    }
+    if (task->error)
+    {
+      std::rethrow_exception(task->error);
+    }
+  }
+
+  // block until every submitted task has finished
+  void wait_idle()
+  {
+    while (outstanding.load(std::memory_order_acquire) != 0)
+    {
+      if (!run_one(current_worker()))
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+private:
+  // growable ring; capacity is never given back
+  struct WorkQueue
+  {
+    std::mutex lock;
+    std::vector<TaskHandle> ring = std::vector<TaskHandle>(64);
+    size_t head = 0;
+    size_t count = 0;
+
+    void push_back(TaskHandle task)
+    {
+      if (count == ring.size())
+      {
+        std::vector<TaskHandle> larger(ring.size() * 2);
+        for (size_t i = 0; i < count; i++)
+        {
+          larger[i] = std::move(ring[(head + i) % ring.size()]);
+        }
+        ring.swap(larger);
+        head = 0;
+      }
+      ring[(head + count) % ring.size()] = std::move(task);
+      count++;
+    }
+
+    TaskHandle pop_back()
+    {
+      count--;
+      return std::move(ring[(head + count) % ring.size()]);
+    }
+
+    TaskHandle pop_front()
+    {
+      TaskHandle task = std::move(ring[head]);
+      head = (head + 1) % ring.size();
+      count--;
+      return task;
+    }
+  };
+
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex pool_lock;
+  std::vector<TaskHandle> pool;
+
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> outstanding{0};
+  std::atomic<size_t> next_queue{0};
+
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+  bool stopping = false;
+
+  // index of the calling thread's own queue, or -1 outside this scheduler
+  int current_worker() const
+  {
+    return tls_owner() == this ? tls_index() : -1;
+  }
+
+  static const JobScheduler *&tls_owner()
+  {
+    static thread_local const JobScheduler *owner = nullptr;
+    return owner;
+  }
+
+  static int &tls_index()
+  {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  void release(const TaskHandle &task)
+  {
+    if (task->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      enqueue(task);
+    }
+  }
+
+  // hand over the caller's only handle, so the task can be pooled as soon as
+  // it has run
+  void release(TaskHandle &&task)
+  {
+    if (task->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      enqueue(std::move(task));
+    }
+  }
+
+  void enqueue(TaskHandle task)
+  {
+    outstanding.fetch_add(1, std::memory_order_relaxed);
+
+    int self = current_worker();
+    size_t target = self >= 0 ? (size_t)self
+                              : next_queue.fetch_add(1, std::memory_order_relaxed) %
+                                    queues.size();
+    {
+      std::lock_guard<std::mutex> guard(queues[target]->lock);
+      queues[target]->push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_release);
+
+    // taking the sleep lock orders this wake-up after a worker's predicate
+    // check, so the notification cannot be lost
+    {
+      std::lock_guard<std::mutex> guard(sleep_mutex);
+    }
+    sleep_cv.notify_one();
+  }
+
+  TaskHandle pop(int self)
+  {
+    // own queue first, newest task
+    if (self >= 0)
+    {
+      WorkQueue &own = *queues[self];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (own.count != 0)
+      {
+        return own.pop_back();
+      }
+    }
+
+    // steal the oldest task from a victim
+    size_t count = queues.size();
+    size_t start = self >= 0 ? (size_t)self + 1
+                             : next_queue.load(std::memory_order_relaxed);
+    for (size_t k = 0; k < count; k++)
+    {
+      WorkQueue &victim = *queues[(start + k) % count];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (victim.count != 0)
+      {
+        return victim.pop_front();
+      }
+    }
+    return nullptr;
+  }
+
+  bool run_one(int self)
+  {
+    if (queued.load(std::memory_order_acquire) == 0)
+    {
+      return false;
+    }
+    TaskHandle task = pop(self);
+    if (!task)
+    {
+      return false;
+    }
+    queued.fetch_sub(1, std::memory_order_relaxed);
+
+    if (task->fn && !task->error)
+    {
+      try
+      {
+        task->fn();
+      }
+      catch (...)
+      {
+        task->error = std::current_exception();
+      }
+    }
+
+    std::vector<TaskHandle> continuations;
+    {
+      std::lock_guard<std::mutex> guard(task->lock);
+      task->done.store(true, std::memory_order_release);
+      continuations.swap(task->continuations);
+    }
+    for (const auto &next : continuations)
+    {
+      inherit_error(task->error, next);
+      release(next);
+    }
+
+    outstanding.fetch_sub(1, std::memory_order_acq_rel);
+    recycle(task);
+    return true;
+  }
+
+  // keep the first error of any predecessor; `next` has not started yet
+  static void inherit_error(const std::exception_ptr &error, const TaskHandle &next)
+  {
+    if (!error)
+    {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(next->lock);
+    if (!next->error)
+    {
+      next->error = error;
+    }
+  }
+
+  // pool a finished task that no handle outside the scheduler refers to
+  void recycle(TaskHandle &task)
+  {
+    if (task.use_count() != 1)
+    {
+      return;
+    }
+    task->fn = nullptr;
+    task->pending.store(1, std::memory_order_relaxed);
+    task->done.store(false, std::memory_order_relaxed);
+    task->error = nullptr;
+    task->continuations.clear();
+
+    std::lock_guard<std::mutex> guard(pool_lock);
+    pool.push_back(std::move(task));
+  }
+
+  void worker_loop(int index)
+  {
+    tls_owner() = this;
+    tls_index() = index;
+
+    while (true)
+    {
+      if (run_one(index))
+      {
+        continue;
+      }
+
+      std::unique_lock<std::mutex> guard(sleep_mutex);
+      sleep_cv.wait(guard, [this]()
+                    { return stopping || queued.load(std::memory_order_acquire) > 0; });
+      if (stopping && queued.load(std::memory_order_acquire) == 0)
+      {
+        return;
+      }
+    }
+  }
+};
+
+#endif // !SCHEDULER_H
@@ -5,9 +5,73 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+// typed reference to an active uniform, resolved once after linking
+template <typename T>
+struct UniformHandle {
+    GLint location = -1;
+    int slot = -1;
+
+    bool valid() const { return slot >= 0; }
+};
+
+// ARB_get_program_binary (core in GL 4.1) is not part of the GL 3.3 glad
+// loader, so its entry points are resolved by Shader::enableBinaryCache()
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei *length,
+                                                   GLenum *binaryFormat, void *binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void *binary,
+                                                GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+
+// GLSL types a C++ uniform value may be uploaded to
+template <typename T>
+struct UniformType;
+
+template <>
+struct UniformType<int> {
+    // samplers are set through glUniform1i as well
+    static bool matches(GLenum type) {
+        switch (type) {
+            case GL_INT:
+            case GL_BOOL:
+            case GL_SAMPLER_1D:
+            case GL_SAMPLER_2D:
+            case GL_SAMPLER_3D:
+            case GL_SAMPLER_CUBE:
+            case GL_SAMPLER_BUFFER:
+            case GL_SAMPLER_2D_ARRAY:
+            case GL_INT_SAMPLER_BUFFER:
+            case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+                return true;
+            default:
+                return false;
+        }
+    }
+};
+
+template <> struct UniformType<float> { static bool matches(GLenum type) { return type == GL_FLOAT; } };
+template <> struct UniformType<glm::vec2> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC2; } };
+template <> struct UniformType<glm::vec3> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC3; } };
+template <> struct UniformType<glm::vec4> { static bool matches(GLenum type) { return type == GL_FLOAT_VEC4; } };
+template <> struct UniformType<glm::mat2> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT2; } };
+template <> struct UniformType<glm::mat3> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT3; } };
+template <> struct UniformType<glm::mat4> { static bool matches(GLenum type) { return type == GL_FLOAT_MAT4; } };
 
 class Shader {
 public:
@@ -44,6 +108,16 @@ public:
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
         }
 
+        // warm start: reuse the driver's binary for exactly these sources
+        std::string cachePath;
+        if (binaryCache().enabled) {
+            cachePath = binaryCachePath(vertexCode, fragmentCode);
+            if (loadBinary(cachePath)) {
+                introspect();
+                return;
+            }
+        }
+
         const char *vShaderCode = vertexCode.c_str();
         const char *fShaderCode = fragmentCode.c_str();
 
@@ -66,12 +140,52 @@ public:
         ID = glCreateProgram();
         glAttachShader(ID, vertex);
         glAttachShader(ID, fragment);
+        if (binaryCache().enabled) {
+            binaryCache().programParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
         glLinkProgram(ID);
         checkCompileErrors(ID, "PROGRAM");
 
         // delete the shaders as they're linked into our program now and no longer necessary
         glDeleteShader(vertex);
         glDeleteShader(fragment);
+
+        if (binaryCache().enabled) {
+            saveBinary(cachePath);
+        }
+
+        introspect();
+    }
+
+    // Turn on the program binary cache for every Shader built afterwards. Needs a
+    // current context; `loader` is the proc address loader glad was set up with.
+    // Returns false (and leaves the cache off) if the driver cannot export binaries.
+    static bool enableBinaryCache(GLADloadproc loader, const std::string &directory) {
+        BinaryCache &cache = binaryCache();
+        cache.getProgramBinary = (PFNGLGETPROGRAMBINARYPROC) loader("glGetProgramBinary");
+        cache.programBinary = (PFNGLPROGRAMBINARYPROC) loader("glProgramBinary");
+        cache.programParameteri = (PFNGLPROGRAMPARAMETERIPROC) loader("glProgramParameteri");
+
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        glGetError(); // the enum is unknown to drivers without the extension
+
+        cache.enabled = cache.getProgramBinary && cache.programBinary && cache.programParameteri &&
+                        formats > 0;
+        if (!cache.enabled) {
+            return false;
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        cache.directory = directory;
+        // binaries are only valid for the exact driver that produced them
+        for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+            const GLubyte *value = glGetString(name);
+            cache.driver += value ? (const char *) value : "";
+            cache.driver += '\n';
+        }
+        return true;
     }
 
     // activate the shader
@@ -79,71 +193,268 @@ public:
         glUseProgram(ID);
     }
 
+    // typed uniform handle; invalid (and ignored by set) if the uniform is not active
+    // or its GLSL type does not match T
+    template <typename T>
+    UniformHandle<T> uniform(const std::string &name) const {
+        UniformHandle<T> handle;
+        auto it = uniformSlots.find(name);
+        if (it == uniformSlots.end()) {
+            return handle;
+        }
+        const UniformSlot &slot = uniforms[it->second];
+        if (!UniformType<T>::matches(slot.type)) {
+            std::cout << "ERROR::SHADER::UNIFORM_TYPE_MISMATCH: " << name << std::endl;
+            return handle;
+        }
+        handle.location = slot.location;
+        handle.slot = it->second;
+        return handle;
+    }
+
+    // upload through a handle; skipped when the program already holds this value
+    template <typename T>
+    void set(const UniformHandle<T> &handle, const T &value) const {
+        static_assert(sizeof(T) <= sizeof(UniformSlot::value), "uniform value too large");
+        if (!handle.valid()) {
+            return;
+        }
+        UniformSlot &slot = uniforms[handle.slot];
+        if (slot.cached && std::memcmp(slot.value, &value, sizeof(T)) == 0) {
+            return;
+        }
+        std::memcpy(slot.value, &value, sizeof(T));
+        slot.cached = true;
+        upload(handle.location, value);
+    }
+
+    // attach the uniform block `name` to a shared binding point; T is the C++
+    // struct mirroring the block, used to catch std140 layout drift
+    template <typename T>
+    void bindUniformBlock(const std::string &name, GLuint binding) const {
+        GLuint index = glGetUniformBlockIndex(ID, name.c_str());
+        if (index == GL_INVALID_INDEX) {
+            return;
+        }
+        GLint size = 0;
+        glGetActiveUniformBlockiv(ID, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+        if (size != (GLint) sizeof(T)) {
+            std::cout << "ERROR::SHADER::UNIFORM_BLOCK_SIZE_MISMATCH: " << name << " is " << size
+                      << " bytes, expected " << sizeof(T) << std::endl;
+        }
+        glUniformBlockBinding(ID, index, binding);
+    }
+
     // utility uniform functions
-    GLuint getAttribLocation(const std::string &name){
-        return glGetAttribLocation(ID, name.c_str());
+    GLuint getAttribLocation(const std::string &name) const {
+        auto it = attributes.find(name);
+        return it == attributes.end() ? (GLuint) -1 : (GLuint) it->second;
     }
 
     void setBool(const std::string &name, bool value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int) value);
+        set(uniform<int>(name), (int) value);
     }
 
     void setInt(const std::string &name, int value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        set(uniform<int>(name), value);
     }
 
     void setFloat(const std::string &name, float value) const {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        set(uniform<float>(name), value);
     }
 
     void setVec2(const std::string &name, const glm::vec2 &value) const
     {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        set(uniform<glm::vec2>(name), value);
     }
 
     void setVec2(const std::string &name, float x, float y) const
     {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+        set(uniform<glm::vec2>(name), glm::vec2(x, y));
     }
 
     void setVec3(const std::string &name, const glm::vec3 &value) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        set(uniform<glm::vec3>(name), value);
     }
 
     void setVec3(const std::string &name, float x, float y, float z) const
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        set(uniform<glm::vec3>(name), glm::vec3(x, y, z));
     }
 
     void setVec4(const std::string &name, const glm::vec4 &value) const
     {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        set(uniform<glm::vec4>(name), value);
     }
 
     void setVec4(const std::string &name, float x, float y, float z, float w) const
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+        set(uniform<glm::vec4>(name), glm::vec4(x, y, z, w));
     }
 
     void setMat2(const std::string &name, const glm::mat2 &mat) const
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        set(uniform<glm::mat2>(name), mat);
     }
 
     void setMat3(const std::string &name, const glm::mat3 &mat) const
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        set(uniform<glm::mat3>(name), mat);
     }
 
     void setMat4(const std::string &name, const glm::mat4 &mat) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        set(uniform<glm::mat4>(name), mat);
     }
 
 private:
     unsigned int ID;
 
+    struct BinaryCache {
+        bool enabled = false;
+        std::string directory;
+        std::string driver;
+        PFNGLGETPROGRAMBINARYPROC getProgramBinary = nullptr;
+        PFNGLPROGRAMBINARYPROC programBinary = nullptr;
+        PFNGLPROGRAMPARAMETERIPROC programParameteri = nullptr;
+    };
+
+    static BinaryCache &binaryCache() {
+        static BinaryCache cache;
+        return cache;
+    }
+
+    // cache file named by a 64-bit FNV-1a hash of both sources and the driver identity
+    static std::string binaryCachePath(const std::string &vertexCode, const std::string &fragmentCode) {
+        uint64_t hash = 1469598103934665603ull;
+        const std::string *parts[] = {&vertexCode, &fragmentCode, &binaryCache().driver};
+        for (const std::string *part : parts) {
+            for (unsigned char c : *part) {
+                hash = (hash ^ c) * 1099511628211ull;
+            }
+            hash = (hash ^ 0xff) * 1099511628211ull;
+        }
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) hash);
+        return (std::filesystem::path(binaryCache().directory) / name).string();
+    }
+
+    // file layout: GLenum binary format followed by the driver's blob
+    bool loadBinary(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        GLenum format = 0;
+        if (!file.read((char *) &format, sizeof(format))) {
+            return false;
+        }
+        std::vector<char> blob((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (blob.empty()) {
+            return false;
+        }
+
+        ID = glCreateProgram();
+        binaryCache().programBinary(ID, format, blob.data(), (GLsizei) blob.size());
+        GLint success = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (!success) {
+            // rejected (driver update, corrupt file): drop it and compile from source
+            glDeleteProgram(ID);
+            std::error_code error;
+            std::filesystem::remove(path, error);
+            return false;
+        }
+        return true;
+    }
+
+    void saveBinary(const std::string &path) const {
+        GLint success = 0, length = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (!success || length <= 0) {
+            return;
+        }
+        std::vector<char> blob(length);
+        GLenum format = 0;
+        binaryCache().getProgramBinary(ID, length, NULL, &format, blob.data());
+
+        // write to a private file and rename, so concurrent processes never read a partial binary
+        std::string tmpPath = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary);
+            file.write((const char *) &format, sizeof(format));
+            file.write(blob.data(), blob.size());
+            if (!file) {
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(tmpPath, path, error);
+        if (error) {
+            std::filesystem::remove(tmpPath, error);
+        }
+    }
+
+    // active uniform with a shadow copy of the last uploaded value
+    struct UniformSlot {
+        GLint location;
+        GLenum type;
+        bool cached;
+        float value[16];
+    };
+
+    mutable std::vector<UniformSlot> uniforms;
+    std::unordered_map<std::string, int> uniformSlots;
+    std::unordered_map<std::string, GLint> attributes;
+
+    // query active uniforms and attributes once, so no per-frame call has to
+    // go through the driver's name lookup
+    void introspect() {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<char> name(maxLength + 1);
+        for (GLint i = 0; i < count; i++) {
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(ID, i, (GLsizei) name.size(), NULL, &size, &type, name.data());
+            GLint location = glGetUniformLocation(ID, name.data());
+            // members of uniform blocks have no location
+            if (location < 0) {
+                continue;
+            }
+
+            std::string key = name.data();
+            // arrays are reported as "name[0]"; make them reachable by the bare name too
+            if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) {
+                uniformSlots[key.substr(0, key.size() - 3)] = (int) uniforms.size();
+            }
+            uniformSlots[key] = (int) uniforms.size();
+            uniforms.push_back({location, type, false, {}});
+        }
+
+        glGetProgramiv(ID, GL_ACTIVE_ATTRIBUTES, &count);
+        glGetProgramiv(ID, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+        name.assign(maxLength + 1, 0);
+        for (GLint i = 0; i < count; i++) {
+            GLint size;
+            GLenum type;
+            glGetActiveAttrib(ID, i, (GLsizei) name.size(), NULL, &size, &type, name.data());
+            attributes[name.data()] = glGetAttribLocation(ID, name.data());
+        }
+    }
+
+    static void upload(GLint location, int value) { glUniform1i(location, value); }
+    static void upload(GLint location, float value) { glUniform1f(location, value); }
+    static void upload(GLint location, const glm::vec2 &value) { glUniform2fv(location, 1, &value[0]); }
+    static void upload(GLint location, const glm::vec3 &value) { glUniform3fv(location, 1, &value[0]); }
+    static void upload(GLint location, const glm::vec4 &value) { glUniform4fv(location, 1, &value[0]); }
+    static void upload(GLint location, const glm::mat2 &mat) { glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]); }
+    static void upload(GLint location, const glm::mat3 &mat) { glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]); }
+    static void upload(GLint location, const glm::mat4 &mat) { glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]); }
+
     // utility function for checking shader compilation/linking errors.
     static void checkCompileErrors(unsigned int shader, const std::string& type) {
         int success;
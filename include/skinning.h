@@ -0,0 +1,428 @@
+#ifndef SKINNING_H
+#define SKINNING_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mem_tracker.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// a joint as declared in the rig manifest: it rotates about `pivot` (bind
+// pose, model space) relative to its parent. `rotation` is the preview pose
+// in degrees (XYZ Euler).
+struct SkinJoint
+{
+  std::string name;
+  std::string parent; // "-" for the root
+  glm::vec3 pivot = glm::vec3(0.0f);
+  glm::vec3 rotation = glm::vec3(0.0f);
+};
+
+enum SkinMethod
+{
+  SKIN_NONE,
+  SKIN_LBS, // linear blend of joint matrices
+  SKIN_DQS, // normalized blend of dual quaternions, no candy-wrapper collapse
+};
+
+// Joints and per-vertex influences. Influences are stored as SoA streams
+// like BlendBasis: INFLUENCES joint-index and weight streams, padded to
+// LANES vertices; padding lanes are bound to the root with weight 1.
+//
+// The skin file lists one vertex per line:
+//
+//   <vertex> <joint> <weight> [<joint> <weight> ...]
+//
+// Only the INFLUENCES largest weights are kept and renormalized; vertices
+// that are not listed follow the root.
+class SkinBinding
+{
+public:
+  static constexpr size_t INFLUENCES = 4;
+  static constexpr size_t LANES = 16;
+  static constexpr size_t MAX_JOINTS = 64; // size of the GPU joint block
+
+  SkinBinding() = default;
+
+  SkinBinding(const std::vector<SkinJoint> &declared, const std::string &skin_path,
+              size_t num_vertices)
+  {
+    MemScope mem_scope(MEM_BASIS);
+    for (const auto &entry : declared)
+    {
+      int parent = entry.parent == "-" ? -1 : joint(entry.parent);
+      if ((entry.parent != "-" && parent < 0) || (parent < 0 && !joints.empty()) ||
+          joints.size() == MAX_JOINTS)
+      {
+        std::cout << "ERROR::SKIN::BAD_JOINT: " << entry.name
+                  << " (one root first, parents before children, at most " << MAX_JOINTS << ")"
+                  << std::endl;
+        continue;
+      }
+      joints.push_back({entry.name, parent, entry.pivot, entry.rotation});
+    }
+    if (joints.empty())
+    {
+      return;
+    }
+
+    vertex_count = num_vertices;
+    stride = (num_vertices + LANES - 1) / LANES * LANES;
+    indices.assign(INFLUENCES * stride, 0);
+    weights.assign(INFLUENCES * stride, 0.0f);
+    for (size_t v = 0; v < stride; v++)
+    {
+      weights[v] = 1.0f;
+    }
+
+    std::ifstream file(skin_path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      std::istringstream fields(line);
+      size_t v;
+      if (!(fields >> v))
+      {
+        continue;
+      }
+      std::vector<std::pair<float, int>> influences;
+      std::string name;
+      float weight;
+      while (fields >> name >> weight)
+      {
+        int index = joint(name);
+        if (index < 0 || v >= num_vertices)
+        {
+          std::cout << "ERROR::SKIN::BAD_INFLUENCE: vertex " << v << " joint " << name << std::endl;
+          continue;
+        }
+        influences.push_back({weight, index});
+      }
+      std::sort(influences.begin(), influences.end(), [](const auto &a, const auto &b)
+                { return a.first > b.first; });
+      influences.resize(std::min(influences.size(), INFLUENCES));
+      float total = 0;
+      for (const auto &influence : influences)
+      {
+        total += influence.first;
+      }
+      if (total <= 0)
+      {
+        continue;
+      }
+      for (size_t k = 0; k < INFLUENCES; k++)
+      {
+        indices[k * stride + v] = k < influences.size() ? influences[k].second : 0;
+        weights[k * stride + v] = k < influences.size() ? influences[k].first / total : 0.0f;
+      }
+    }
+  }
+
+  bool empty() const
+  {
+    return joints.empty();
+  }
+
+  size_t num_joints() const
+  {
+    return joints.size();
+  }
+
+  size_t num_vertices() const
+  {
+    return vertex_count;
+  }
+
+  // vertices per stream, a multiple of LANES
+  size_t padded() const
+  {
+    return stride;
+  }
+
+  // index of a joint, or -1
+  int joint(const std::string &name) const
+  {
+    for (size_t j = 0; j < joints.size(); j++)
+    {
+      if (joints[j].name == name)
+      {
+        return (int)j;
+      }
+    }
+    return -1;
+  }
+
+  int parent(size_t j) const
+  {
+    return joints[j].parent;
+  }
+
+  const glm::vec3 &pivot(size_t j) const
+  {
+    return joints[j].pivot;
+  }
+
+  // local rotations of the manifest's preview pose
+  std::vector<glm::quat> preview() const
+  {
+    std::vector<glm::quat> rotations;
+    for (const auto &j : joints)
+    {
+      rotations.push_back(glm::quat(glm::radians(j.rotation)));
+    }
+    return rotations;
+  }
+
+  // influence k of every vertex
+  const int32_t *joint_stream(size_t k) const
+  {
+    return &indices[k * stride];
+  }
+
+  const float *weight_stream(size_t k) const
+  {
+    return &weights[k * stride];
+  }
+
+private:
+  struct Joint
+  {
+    std::string name;
+    int parent;
+    glm::vec3 pivot;
+    glm::vec3 rotation;
+  };
+
+  std::vector<Joint> joints; // parents before children
+  size_t vertex_count = 0;
+  size_t stride = 0;
+  std::vector<int32_t> indices;
+  std::vector<float> weights;
+};
+
+// Joint transforms of one frame, kept in the layout of the GPU Skin block:
+// three rows of a 3x4 matrix per joint for LBS, and the rotation and dual
+// part of the unit dual quaternion (xyzw) for DQS. apply() is the CPU
+// kernel; Basis::evaluate runs it on each vertex range right after the
+// range is blended, so positions make one trip through memory.
+class SkinPose
+{
+public:
+  static constexpr size_t LANES = SkinBinding::LANES;
+
+  SkinPose() = default;
+
+  SkinPose(const SkinBinding &binding, SkinMethod method)
+      : binding(&binding), skin_method(method)
+  {
+    size_t J = binding.num_joints();
+    matrix_rows.assign(3 * J, glm::vec4(0.0f));
+    real.assign(J, glm::vec4(0, 0, 0, 1));
+    dual.assign(J, glm::vec4(0.0f));
+    std::vector<glm::quat> identity(J, glm::quat(1, 0, 0, 0));
+    set(identity);
+  }
+
+  SkinMethod method() const
+  {
+    return skin_method;
+  }
+
+  size_t num_joints() const
+  {
+    return real.size();
+  }
+
+  // local rotations about each joint's pivot (one per joint) and a
+  // translation of the whole skeleton
+  void set(const std::vector<glm::quat> &rotations, const glm::vec3 &translation = glm::vec3(0.0f))
+  {
+    size_t J = real.size();
+    // world transform x -> rotation * x + offset of every joint
+    std::vector<glm::quat> world(J);
+    std::vector<glm::vec3> offset(J);
+    for (size_t j = 0; j < J; j++)
+    {
+      int parent = binding->parent(j);
+      glm::quat parent_rotation = parent < 0 ? glm::quat(1, 0, 0, 0) : world[parent];
+      glm::vec3 parent_offset = parent < 0 ? translation : offset[parent];
+      glm::quat local = j < rotations.size() ? glm::normalize(rotations[j]) : glm::quat(1, 0, 0, 0);
+      glm::vec3 pivot = binding->pivot(j);
+      world[j] = parent_rotation * local;
+      offset[j] = parent_rotation * (pivot - local * pivot) + parent_offset;
+
+      glm::mat3 m = glm::mat3_cast(world[j]);
+      for (int r = 0; r < 3; r++)
+      {
+        matrix_rows[j * 3 + r] = glm::vec4(m[0][r], m[1][r], m[2][r], offset[j][r]);
+      }
+      const glm::quat &q = world[j];
+      glm::quat d = glm::quat(0, offset[j].x, offset[j].y, offset[j].z) * q * 0.5f;
+      real[j] = glm::vec4(q.x, q.y, q.z, q.w);
+      dual[j] = glm::vec4(d.x, d.y, d.z, d.w);
+    }
+  }
+
+  const std::vector<glm::vec4> &rows() const
+  {
+    return matrix_rows;
+  }
+
+  const std::vector<glm::vec4> &rotations() const
+  {
+    return real;
+  }
+
+  const std::vector<glm::vec4> &duals() const
+  {
+    return dual;
+  }
+
+  // skin vertices [lo, lo + n) of SoA streams `stride` floats apart in
+  // place; lo is a multiple of LANES, lanes past the binding are left alone.
+  // Padding lanes ride along with the root joint, so they are zeroed again
+  // afterwards to keep the streams' padding contract.
+  void apply(float *streams, size_t stride, size_t lo, size_t n) const
+  {
+    if (skin_method == SKIN_NONE || !binding || binding->empty())
+    {
+      return;
+    }
+    size_t hi = std::min(lo + n, binding->padded());
+    for (size_t v = lo; v < hi; v += LANES)
+    {
+      float *x = streams + v, *y = streams + stride + v, *z = streams + 2 * stride + v;
+      if (skin_method == SKIN_LBS)
+      {
+        linear(x, y, z, v);
+      }
+      else
+      {
+        dual_quaternion(x, y, z, v);
+      }
+    }
+    for (size_t v = std::max(lo, binding->num_vertices()); v < hi; v++)
+    {
+      streams[v] = streams[stride + v] = streams[2 * stride + v] = 0;
+    }
+  }
+
+private:
+  const SkinBinding *binding = nullptr;
+  SkinMethod skin_method = SKIN_NONE;
+  std::vector<glm::vec4> matrix_rows;
+  std::vector<glm::vec4> real;
+  std::vector<glm::vec4> dual;
+
+  // influences are sorted by weight, so trailing ones are often zero for a
+  // whole lane group and their gathers can be skipped
+  static bool any_weight(const float *weight)
+  {
+    bool any = false;
+    for (size_t l = 0; l < LANES; l++)
+    {
+      any = any || weight[l] != 0;
+    }
+    return any;
+  }
+
+  // one lane group: (sum_k w_k M_k) p. The weighted joint matrices are
+  // gathered into lane-major registers first so the blend and the transform
+  // run as plain SIMD loops over the lanes.
+  void linear(float *__restrict x, float *__restrict y, float *__restrict z, size_t v) const
+  {
+    const float *m = &matrix_rows[0].x;
+    alignas(64) float blended[12][LANES] = {};
+    for (size_t k = 0; k < SkinBinding::INFLUENCES; k++)
+    {
+      const int32_t *joint = binding->joint_stream(k) + v;
+      const float *weight = binding->weight_stream(k) + v;
+      if (!any_weight(weight))
+      {
+        continue;
+      }
+      alignas(64) float gathered[12][LANES];
+      for (size_t l = 0; l < LANES; l++)
+      {
+        const float *r = m + joint[l] * 12;
+        for (int e = 0; e < 12; e++)
+        {
+          gathered[e][l] = r[e];
+        }
+      }
+      for (int e = 0; e < 12; e++)
+      {
+        for (size_t l = 0; l < LANES; l++)
+        {
+          blended[e][l] += weight[l] * gathered[e][l];
+        }
+      }
+    }
+    for (size_t l = 0; l < LANES; l++)
+    {
+      float px = x[l], py = y[l], pz = z[l];
+      x[l] = blended[0][l] * px + blended[1][l] * py + blended[2][l] * pz + blended[3][l];
+      y[l] = blended[4][l] * px + blended[5][l] * py + blended[6][l] * pz + blended[7][l];
+      z[l] = blended[8][l] * px + blended[9][l] * py + blended[10][l] * pz + blended[11][l];
+    }
+  }
+
+  // one lane group: blend the dual quaternions in the hemisphere of the
+  // first influence, normalize, then rotate and translate
+  void dual_quaternion(float *__restrict x, float *__restrict y, float *__restrict z, size_t v) const
+  {
+    const float *rq = &real[0].x, *dq = &dual[0].x;
+    float r[4][LANES] = {}, d[4][LANES] = {};
+    const int32_t *first = binding->joint_stream(0) + v;
+    for (size_t k = 0; k < SkinBinding::INFLUENCES; k++)
+    {
+      const int32_t *joint = binding->joint_stream(k) + v;
+      const float *weight = binding->weight_stream(k) + v;
+      if (!any_weight(weight))
+      {
+        continue;
+      }
+      for (size_t l = 0; l < LANES; l++)
+      {
+        const float *a = rq + joint[l] * 4, *b = dq + joint[l] * 4, *a0 = rq + first[l] * 4;
+        float hemisphere = a[0] * a0[0] + a[1] * a0[1] + a[2] * a0[2] + a[3] * a0[3];
+        float w = hemisphere < 0 ? -weight[l] : weight[l];
+        for (int c = 0; c < 4; c++)
+        {
+          r[c][l] += w * a[c];
+          d[c][l] += w * b[c];
+        }
+      }
+    }
+    for (size_t l = 0; l < LANES; l++)
+    {
+      float inv = 1.0f / std::sqrt(r[0][l] * r[0][l] + r[1][l] * r[1][l] + r[2][l] * r[2][l] +
+                                   r[3][l] * r[3][l]);
+      float rx = r[0][l] * inv, ry = r[1][l] * inv, rz = r[2][l] * inv, rw = r[3][l] * inv;
+      float dx = d[0][l] * inv, dy = d[1][l] * inv, dz = d[2][l] * inv, dw = d[3][l] * inv;
+
+      // translation 2 (rw d - dw r + r x d), rotation p + 2 r x (r x p + rw p)
+      float tx = 2 * (rw * dx - dw * rx + ry * dz - rz * dy);
+      float ty = 2 * (rw * dy - dw * ry + rz * dx - rx * dz);
+      float tz = 2 * (rw * dz - dw * rz + rx * dy - ry * dx);
+      float cx = ry * z[l] - rz * y[l] + rw * x[l];
+      float cy = rz * x[l] - rx * z[l] + rw * y[l];
+      float cz = rx * y[l] - ry * x[l] + rw * z[l];
+      float px = x[l] + 2 * (ry * cz - rz * cy) + tx;
+      float py = y[l] + 2 * (rz * cx - rx * cz) + ty;
+      float pz = z[l] + 2 * (rx * cy - ry * cx) + tz;
+      x[l] = px;
+      y[l] = py;
+      z[l] = pz;
+    }
+  }
+};
+
+#endif // !SKINNING_H
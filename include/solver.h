@@ -0,0 +1,373 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <algorithm>
+#include <arena.h>
+#include <basis.h>
+#include <cmath>
+#include <linalg.h>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <scheduler.h>
+#include <trace.h>
+#include <vector>
+
+// bounds and stopping rule for BoxLeastSquares / WeightSolver
+struct SolveOptions
+{
+  bool box = true;   // clamp weights to [lower, upper]
+  double lower = 0.0;
+  double upper = 1.0; // some rigs drive past 1; use infinity to disable
+  int max_iterations = 1000; // active-set changes before giving up
+  bool warm_start = false;   // start the active set from the weights passed in
+  double tolerance = 1e-9;   // KKT violation, relative to the largest |D^T b|
+};
+
+// Bounded least squares in normal-equation form: minimise
+// w^T G w / 2 - b^T w for a fixed SPD matrix G, unconstrained (one Cholesky
+// substitution) or inside the box [lower, upper]. Bounds use a
+// Lawson-Hanson style active-set method: solve on the free weights, step
+// back to the first bound that blocks, and free the bound weight whose
+// gradient violates the KKT conditions most, until none does.
+class BoxLeastSquares
+{
+public:
+  // G is n x n, row-major
+  void set(std::vector<double> matrix, size_t n)
+  {
+    T = n;
+    gram = std::move(matrix);
+    factor.assign(T * T, 0.0);
+    definite = cholesky_factor(gram.data(), factor.data(), T);
+  }
+
+  size_t size() const
+  {
+    return T;
+  }
+
+  // false if G was singular to working precision
+  bool well_posed() const
+  {
+    return definite;
+  }
+
+  // minimise w^T G w / 2 - rhs^T w under the options' bounds; `weights`
+  // must hold n entries (the previous solution when warm starting)
+  int solve(const double *rhs, std::vector<tinyobj::real_t> &weights,
+            const SolveOptions &options) const
+  {
+    if (options.box && options.warm_start)
+    {
+      return solve_box(rhs, weights, options);
+    }
+
+    for (size_t i = 0; i < T; i++)
+    {
+      weights[i] = rhs[i];
+    }
+    cholesky_substitute(factor.data(), weights.data(), T);
+    if (!options.box)
+    {
+      return 0;
+    }
+
+    bool feasible = true;
+    for (tinyobj::real_t &w : weights)
+    {
+      feasible = feasible && w >= options.lower && w <= options.upper;
+    }
+    if (feasible)
+    {
+      return 0;
+    }
+    return solve_box(rhs, weights, options);
+  }
+
+private:
+  size_t T = 0;
+  bool definite = true;
+  std::vector<double> gram;
+  std::vector<double> factor; // lower Cholesky factor of gram
+
+  // active-set iterations from the clamped starting point
+  int solve_box(const double *rhs, std::vector<tinyobj::real_t> &weights,
+                const SolveOptions &options) const
+  {
+    ArenaScope scratch;
+    // -1 at the lower bound, +1 at the upper bound, 0 free
+    std::pmr::vector<int> side(T, 0, scratch.resource());
+    for (size_t i = 0; i < T; i++)
+    {
+      if (weights[i] <= options.lower)
+      {
+        side[i] = -1;
+        weights[i] = options.lower;
+      }
+      else if (weights[i] >= options.upper)
+      {
+        side[i] = 1;
+        weights[i] = options.upper;
+      }
+    }
+
+    double scale = 0;
+    for (size_t i = 0; i < T; i++)
+    {
+      scale = std::max(scale, std::abs(rhs[i]));
+    }
+    double threshold = options.tolerance * std::max(scale, 1e-300);
+
+    std::pmr::vector<size_t> free_set(scratch.resource());
+    std::pmr::vector<double> system(scratch.resource()), target(scratch.resource());
+    free_set.reserve(T);
+    system.reserve(T * T);
+    target.reserve(T);
+
+    int iteration = 0;
+    while (iteration < options.max_iterations)
+    {
+      iteration++;
+
+      // minimise over the free weights with the bound ones held fixed
+      free_set.clear();
+      for (size_t i = 0; i < T; i++)
+      {
+        if (side[i] == 0)
+        {
+          free_set.push_back(i);
+        }
+      }
+      size_t n = free_set.size();
+      if (n > 0)
+      {
+        system.assign(n * n, 0.0);
+        target.assign(n, 0.0);
+        for (size_t a = 0; a < n; a++)
+        {
+          size_t i = free_set[a];
+          double b = rhs[i];
+          for (size_t j = 0; j < T; j++)
+          {
+            if (side[j] != 0)
+            {
+              b -= gram[i * T + j] * weights[j];
+            }
+          }
+          target[a] = b;
+          for (size_t k = 0; k < n; k++)
+          {
+            system[a * n + k] = gram[i * T + free_set[k]];
+          }
+        }
+        cholesky_factor(system.data(), system.data(), n);
+        cholesky_substitute(system.data(), target.data(), n);
+
+        // walk towards the subproblem optimum, stopping at the first bound
+        double alpha = 1.0;
+        size_t blocking = T;
+        int blocking_side = 0;
+        for (size_t a = 0; a < n; a++)
+        {
+          double w = weights[free_set[a]], z = target[a];
+          if (z < options.lower && w - z > 0)
+          {
+            double step = (w - options.lower) / (w - z);
+            if (step < alpha)
+            {
+              alpha = step, blocking = free_set[a], blocking_side = -1;
+            }
+          }
+          else if (z > options.upper && z - w > 0)
+          {
+            double step = (options.upper - w) / (z - w);
+            if (step < alpha)
+            {
+              alpha = step, blocking = free_set[a], blocking_side = 1;
+            }
+          }
+        }
+        for (size_t a = 0; a < n; a++)
+        {
+          double &w = weights[free_set[a]];
+          w += alpha * (target[a] - w);
+        }
+        if (blocking < T)
+        {
+          side[blocking] = blocking_side;
+          weights[blocking] = blocking_side < 0 ? options.lower : options.upper;
+          continue;
+        }
+      }
+
+      // free the bound weight whose gradient points most into the box
+      size_t release = T;
+      double worst = threshold;
+      for (size_t i = 0; i < T; i++)
+      {
+        if (side[i] == 0)
+        {
+          continue;
+        }
+        double gradient = -rhs[i];
+        for (size_t j = 0; j < T; j++)
+        {
+          gradient += gram[i * T + j] * weights[j];
+        }
+        double violation = side[i] < 0 ? -gradient : gradient;
+        if (violation > worst)
+        {
+          worst = violation;
+          release = i;
+        }
+      }
+      if (release == T)
+      {
+        break;
+      }
+      side[release] = 0;
+    }
+    return iteration;
+  }
+};
+
+// Inverse of blend_shape(): the weights w minimising
+//
+//   |D w - (x - base)|^2 + lambda |w|^2
+//
+// for a mesh x with the base topology. The T x T normal matrix
+// G = D^T D + lambda I is built and Cholesky-factored once per basis, so a
+// solve only projects the mesh onto the targets (b = D^T (x - base), O(T V))
+// and then works in T dimensions with BoxLeastSquares.
+class WeightSolver
+{
+public:
+  // regularization: Tikhonov lambda, relative to the mean diagonal of D^T D
+  WeightSolver(JobScheduler &scheduler, const BlendBasis &basis, double regularization = 1e-6)
+      : basis(basis), T(basis.num_targets())
+  {
+    TRACE_SCOPE("WeightSolver::WeightSolver");
+    MemScope mem_scope(MEM_BASIS);
+    std::vector<double> gram;
+    basis.gram(scheduler, gram);
+
+    double trace = 0;
+    for (size_t i = 0; i < T; i++)
+    {
+      trace += gram[i * T + i];
+    }
+    lambda = regularization * (T ? trace / T : 0.0);
+    for (size_t i = 0; i < T; i++)
+    {
+      gram[i * T + i] += lambda;
+    }
+    system.set(gram, T);
+  }
+
+  size_t num_targets() const
+  {
+    return T;
+  }
+
+  // false if D^T D + lambda I was singular to working precision
+  bool well_posed() const
+  {
+    return system.well_posed();
+  }
+
+  // mesh: interleaved xyz of every base vertex; returns the number of
+  // active-set iterations (0 when no bound was active)
+  template <typename Vector>
+  int solve(const Vector &mesh, std::vector<tinyobj::real_t> &weights,
+            const SolveOptions &options = SolveOptions()) const
+  {
+    TRACE_SCOPE("WeightSolver::solve");
+    ArenaScope scratch;
+    size_t V = basis.num_vertices();
+    size_t stride = basis.padded();
+
+    // residual to the base as zero-padded SoA, so the dot products below
+    // run over whole lane groups
+    std::pmr::vector<double> offset(3 * stride, 0.0, scratch.resource());
+    for (int c = 0; c < 3; c++)
+    {
+      const float *base = basis.base(c);
+      for (size_t v = 0; v < V; v++)
+      {
+        offset[c * stride + v] = mesh[v * 3 + c] - (double)base[v];
+      }
+    }
+
+    std::pmr::vector<double> rhs(T, 0.0, scratch.resource());
+    for (size_t t = 0; t < T; t++)
+    {
+      // independent partial sums let the compiler vectorize the reduction
+      double lanes[BlendBasis::LANES] = {};
+      for (int c = 0; c < 3; c++)
+      {
+        const float *d = basis.delta(t, c);
+        const double *r = &offset[c * stride];
+        for (size_t v = 0; v < stride; v += BlendBasis::LANES)
+        {
+          for (size_t l = 0; l < BlendBasis::LANES; l++)
+          {
+            lanes[l] += d[v + l] * r[v + l];
+          }
+        }
+      }
+      for (double lane : lanes)
+      {
+        rhs[t] += lane;
+      }
+    }
+    weights.resize(T);
+    return system.solve(rhs.data(), weights, options);
+  }
+
+  // one solve per mesh, meshes spread over the scheduler's workers
+  template <typename Vector>
+  void solve_batch(JobScheduler &scheduler, const std::vector<Vector> &meshes,
+                   std::vector<std::vector<tinyobj::real_t>> &weights,
+                   const SolveOptions &options = SolveOptions()) const
+  {
+    TRACE_SCOPE("WeightSolver::solve_batch");
+    weights.resize(meshes.size());
+    scheduler.parallel_for(0, meshes.size(), 1, [&](size_t begin, size_t end)
+                           {
+                             for (size_t i = begin; i < end; i++)
+                             {
+                               solve(meshes[i], weights[i], options);
+                             }
+                           });
+  }
+
+  // root mean square distance between `mesh` and the blend of `weights`
+  template <typename Vector>
+  double rms_error(const Vector &mesh, const std::vector<tinyobj::real_t> &weights) const
+  {
+    size_t V = basis.num_vertices();
+    double sum = 0;
+    for (int c = 0; c < 3; c++)
+    {
+      for (size_t v = 0; v < V; v++)
+      {
+        double x = basis.base(c)[v];
+        for (size_t t = 0; t < T && t < weights.size(); t++)
+        {
+          x += weights[t] * basis.delta(t, c)[v];
+        }
+        double e = x - mesh[v * 3 + c];
+        sum += e * e;
+      }
+    }
+    return V ? std::sqrt(sum / V) : 0.0;
+  }
+
+private:
+  const BlendBasis &basis;
+  size_t T;
+  double lambda = 0;
+  BoxLeastSquares system; // D^T D + lambda I
+};
+
+#endif // !SOLVER_H
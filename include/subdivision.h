@@ -0,0 +1,478 @@
+#ifndef SUBDIVISION_H
+#define SUBDIVISION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory_resource>
+#include <mem_tracker.h>
+#include <obj.h>
+#include <scheduler.h>
+#include <trace.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Catmull-Clark refinement of the polygon cage as a precomputed stencil
+// table: every refined vertex is a fixed weighted sum of cage vertices, so
+// once the table is built (once per topology) subdividing a blended frame is
+// a sparse matrix-vector product instead of a topological pass.
+//
+// Rows are stored as sliced ELLPACK: LANES rows per slice, each slice padded
+// to its longest stencil and stored entry-major, so the kernel runs every
+// entry over a whole lane group. Padding entries have weight 0.
+//
+// Rules: face points are the face average; interior edge points average the
+// edge ends and both face points; interior vertices move to
+// ((n - 2) P + R + F) / n with R, F the averages of the n edge neighbours and
+// face points. Boundary edges are split at the midpoint and boundary
+// vertices take the cubic B-spline rule along the boundary; non-manifold
+// vertices stay put.
+class SubdivisionStencils
+{
+public:
+  static constexpr size_t ALIGNMENT = 64;
+  static constexpr size_t LANES = ALIGNMENT / sizeof(float);
+  static constexpr int MAX_LEVEL = 3;
+
+  SubdivisionStencils() = default;
+
+  // cage: loaded with triangulate = false; level in [1, MAX_LEVEL]
+  SubdivisionStencils(const Obj &cage, int level)
+  {
+    TRACE_SCOPE("SubdivisionStencils::SubdivisionStencils");
+    MemScope mem_scope(MEM_BASIS);
+    level_count = level < 1 ? 1 : level > MAX_LEVEL ? MAX_LEVEL : level;
+    cage_count = cage.getVertices().size() / 3;
+
+    Polygons faces;
+    uint32_t end = 0;
+    for (const auto &shape : cage.getShapes())
+    {
+      for (unsigned char n : shape.mesh.num_face_vertices)
+      {
+        end += n;
+        faces.offsets.push_back(end);
+      }
+      for (const auto &index : shape.mesh.indices)
+      {
+        faces.corners.push_back((uint32_t)index.vertex_index);
+      }
+    }
+
+    // rows over the cage, composed level by level
+    Rows total;
+    size_t count = cage_count;
+    for (int l = 0; l < level_count; l++)
+    {
+      Rows local;
+      Polygons refined;
+      refine(faces, count, local, refined);
+      total = l == 0 ? std::move(local) : compose(local, total);
+      faces = std::move(refined);
+      count = total.offsets.size() - 1;
+    }
+    refined_count = count;
+
+    triangle_list.reserve(faces.corners.size() / 4 * 6);
+    for (size_t q = 0; q < faces.corners.size(); q += 4)
+    {
+      const uint32_t *c = &faces.corners[q];
+      for (uint32_t k : {c[0], c[1], c[2], c[0], c[2], c[3]})
+      {
+        triangle_list.push_back((int)k);
+      }
+    }
+    pack(total);
+  }
+
+  int level() const
+  {
+    return level_count;
+  }
+
+  size_t num_cage_vertices() const
+  {
+    return cage_count;
+  }
+
+  size_t num_vertices() const
+  {
+    return refined_count;
+  }
+
+  // refined vertices per output stream, a multiple of LANES
+  size_t padded() const
+  {
+    return slice_offsets.empty() ? 0 : (slice_offsets.size() - 1) * LANES;
+  }
+
+  // stored entries including padding
+  size_t num_entries() const
+  {
+    return indices.size();
+  }
+
+  size_t size_bytes() const
+  {
+    return indices.size() * (sizeof(uint32_t) + sizeof(float)) +
+           slice_offsets.size() * sizeof(uint32_t);
+  }
+
+  // refined vertex index of every triangle corner (two per refined quad)
+  const std::pmr::vector<int> &triangles() const
+  {
+    return triangle_list;
+  }
+
+  // refined = S * cage on SoA streams: cage x/y/z `cage_stride` floats
+  // apart, refined x/y/z padded() floats apart
+  void apply(JobScheduler &scheduler, const float *cage, size_t cage_stride, float *refined) const
+  {
+    TRACE_SCOPE("SubdivisionStencils::apply");
+    size_t out_stride = padded();
+    scheduler.parallel_for(0, slice_offsets.size() - 1, 32, [&](size_t begin, size_t end)
+                           {
+                             for (size_t s = begin; s < end; s++)
+                             {
+                               float ax[LANES] = {}, ay[LANES] = {}, az[LANES] = {};
+                               for (uint32_t e = slice_offsets[s]; e < slice_offsets[s + 1]; e += LANES)
+                               {
+                                 const uint32_t *__restrict index = &indices[e];
+                                 const float *__restrict weight = &weights[e];
+                                 for (size_t l = 0; l < LANES; l++)
+                                 {
+                                   uint32_t v = index[l];
+                                   ax[l] += weight[l] * cage[v];
+                                   ay[l] += weight[l] * cage[cage_stride + v];
+                                   az[l] += weight[l] * cage[2 * cage_stride + v];
+                                 }
+                               }
+                               float *x = refined + s * LANES;
+                               for (size_t l = 0; l < LANES; l++)
+                               {
+                                 x[l] = ax[l];
+                                 x[out_stride + l] = ay[l];
+                                 x[2 * out_stride + l] = az[l];
+                               }
+                             }
+                           });
+  }
+
+  // the same on interleaved xyz, in the precision of `Vector`
+  template <typename InVector, typename OutVector>
+  void apply(const InVector &cage, OutVector &refined) const
+  {
+    refined.assign(refined_count * 3, 0);
+    for (size_t s = 0; s + 1 < slice_offsets.size(); s++)
+    {
+      for (uint32_t e = slice_offsets[s]; e < slice_offsets[s + 1]; e++)
+      {
+        size_t r = s * LANES + (e - slice_offsets[s]) % LANES;
+        if (r < refined_count)
+        {
+          for (int c = 0; c < 3; c++)
+          {
+            refined[r * 3 + c] += weights[e] * cage[indices[e] * 3 + c];
+          }
+        }
+      }
+    }
+  }
+
+private:
+  // faces as a corner list; offsets[f] is one past face f's last corner
+  struct Polygons
+  {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> corners;
+  };
+
+  // CSR rows of (vertex, weight)
+  struct Rows
+  {
+    std::vector<uint32_t> offsets = {0};
+    std::vector<uint32_t> columns;
+    std::vector<double> values;
+
+    // append a row, merging repeated columns
+    void push(std::vector<std::pair<uint32_t, double>> &row)
+    {
+      std::sort(row.begin(), row.end());
+      for (size_t i = 0; i < row.size(); i++)
+      {
+        if (i > 0 && row[i].first == row[i - 1].first)
+        {
+          values.back() += row[i].second;
+          continue;
+        }
+        columns.push_back(row[i].first);
+        values.push_back(row[i].second);
+      }
+      offsets.push_back((uint32_t)columns.size());
+      row.clear();
+    }
+  };
+
+  int level_count = 0;
+  size_t cage_count = 0;
+  size_t refined_count = 0;
+  std::vector<uint32_t> slice_offsets; // first entry of each slice
+  std::vector<uint32_t> indices;
+  std::vector<float> weights;
+  std::pmr::vector<int> triangle_list;
+
+  // one Catmull-Clark step: stencils of the refined vertices over the
+  // `count` input vertices (vertex points, then edge points, then face
+  // points) and the refined quads
+  static void refine(const Polygons &faces, size_t count, Rows &rows, Polygons &refined)
+  {
+    size_t F = faces.offsets.size();
+    auto first = [&](size_t f)
+    { return f == 0 ? 0u : faces.offsets[f - 1]; };
+
+    // edges with up to two incident faces; more marks the edge non-manifold
+    struct Edge
+    {
+      uint32_t a, b;
+      uint32_t faces[2];
+      uint32_t face_count;
+    };
+    std::vector<Edge> edges;
+    std::unordered_map<uint64_t, uint32_t> edge_index;
+    std::vector<uint32_t> face_edges(faces.corners.size()); // edge after each corner
+    for (size_t f = 0; f < F; f++)
+    {
+      uint32_t lo = first(f), n = faces.offsets[f] - lo;
+      for (uint32_t i = 0; i < n; i++)
+      {
+        uint32_t a = faces.corners[lo + i], b = faces.corners[lo + (i + 1) % n];
+        uint64_t key = (uint64_t)std::min(a, b) << 32 | std::max(a, b);
+        auto inserted = edge_index.emplace(key, (uint32_t)edges.size());
+        if (inserted.second)
+        {
+          edges.push_back({a, b, {(uint32_t)f, 0}, 0});
+        }
+        Edge &edge = edges[inserted.first->second];
+        if (edge.face_count < 2)
+        {
+          edge.faces[edge.face_count] = (uint32_t)f;
+        }
+        edge.face_count++;
+        face_edges[lo + i] = inserted.first->second;
+      }
+    }
+    size_t E = edges.size();
+
+    // vertex -> incident edges and faces
+    std::vector<uint32_t> edge_offsets(count + 1, 0), face_offsets(count + 1, 0);
+    for (const Edge &edge : edges)
+    {
+      edge_offsets[edge.a + 1]++;
+      edge_offsets[edge.b + 1]++;
+    }
+    for (uint32_t v : faces.corners)
+    {
+      face_offsets[v + 1]++;
+    }
+    for (size_t v = 0; v < count; v++)
+    {
+      edge_offsets[v + 1] += edge_offsets[v];
+      face_offsets[v + 1] += face_offsets[v];
+    }
+    std::vector<uint32_t> vertex_edges(edge_offsets.back()), vertex_faces(face_offsets.back());
+    {
+      std::vector<uint32_t> edge_cursor(edge_offsets.begin(), edge_offsets.end() - 1);
+      std::vector<uint32_t> face_cursor(face_offsets.begin(), face_offsets.end() - 1);
+      for (size_t e = 0; e < E; e++)
+      {
+        vertex_edges[edge_cursor[edges[e].a]++] = (uint32_t)e;
+        vertex_edges[edge_cursor[edges[e].b]++] = (uint32_t)e;
+      }
+      for (size_t f = 0; f < F; f++)
+      {
+        for (uint32_t k = first(f); k < faces.offsets[f]; k++)
+        {
+          vertex_faces[face_cursor[faces.corners[k]]++] = (uint32_t)f;
+        }
+      }
+    }
+
+    std::vector<std::pair<uint32_t, double>> row;
+    auto add_face_point = [&](size_t f, double w)
+    {
+      uint32_t lo = first(f), n = faces.offsets[f] - lo;
+      for (uint32_t k = lo; k < lo + n; k++)
+      {
+        row.push_back({faces.corners[k], w / n});
+      }
+    };
+
+    // vertex points
+    for (size_t v = 0; v < count; v++)
+    {
+      uint32_t valence = edge_offsets[v + 1] - edge_offsets[v];
+      uint32_t boundary[2], boundary_count = 0;
+      bool manifold = valence > 0;
+      for (uint32_t k = edge_offsets[v]; k < edge_offsets[v + 1]; k++)
+      {
+        const Edge &edge = edges[vertex_edges[k]];
+        manifold = manifold && edge.face_count <= 2;
+        if (edge.face_count == 1)
+        {
+          if (boundary_count < 2)
+          {
+            boundary[boundary_count] = edge.a == v ? edge.b : edge.a;
+          }
+          boundary_count++;
+        }
+      }
+      if (!manifold || (boundary_count != 0 && boundary_count != 2))
+      {
+        row.push_back({(uint32_t)v, 1.0});
+      }
+      else if (boundary_count == 2)
+      {
+        row.push_back({(uint32_t)v, 0.75});
+        row.push_back({boundary[0], 0.125});
+        row.push_back({boundary[1], 0.125});
+      }
+      else
+      {
+        double n = valence;
+        row.push_back({(uint32_t)v, (n - 2) / n});
+        for (uint32_t k = edge_offsets[v]; k < edge_offsets[v + 1]; k++)
+        {
+          const Edge &edge = edges[vertex_edges[k]];
+          row.push_back({edge.a == v ? edge.b : edge.a, 1 / (n * n)});
+        }
+        for (uint32_t k = face_offsets[v]; k < face_offsets[v + 1]; k++)
+        {
+          add_face_point(vertex_faces[k], 1 / (n * n));
+        }
+      }
+      rows.push(row);
+    }
+
+    // edge points
+    for (const Edge &edge : edges)
+    {
+      if (edge.face_count == 2)
+      {
+        row.push_back({edge.a, 0.25});
+        row.push_back({edge.b, 0.25});
+        add_face_point(edge.faces[0], 0.25);
+        add_face_point(edge.faces[1], 0.25);
+      }
+      else
+      {
+        row.push_back({edge.a, 0.5});
+        row.push_back({edge.b, 0.5});
+      }
+      rows.push(row);
+    }
+
+    // face points
+    for (size_t f = 0; f < F; f++)
+    {
+      add_face_point(f, 1.0);
+      rows.push(row);
+    }
+
+    // corner i of a face becomes the quad (corner, next edge, face, previous edge)
+    for (size_t f = 0; f < F; f++)
+    {
+      uint32_t lo = first(f), n = faces.offsets[f] - lo;
+      for (uint32_t i = 0; i < n; i++)
+      {
+        uint32_t next = face_edges[lo + i], previous = face_edges[lo + (i + n - 1) % n];
+        for (uint32_t k : {faces.corners[lo + i], (uint32_t)(count + next),
+                           (uint32_t)(count + E + f), (uint32_t)(count + previous)})
+        {
+          refined.corners.push_back(k);
+        }
+        refined.offsets.push_back((uint32_t)refined.corners.size());
+      }
+    }
+  }
+
+  // rows of local * previous: stencils over the cage
+  static Rows compose(const Rows &local, const Rows &previous)
+  {
+    Rows out;
+    size_t cage = 0;
+    for (uint32_t column : previous.columns)
+    {
+      cage = std::max(cage, (size_t)column + 1);
+    }
+    std::vector<double> accumulator(cage, 0.0);
+    std::vector<uint32_t> touched;
+    std::vector<std::pair<uint32_t, double>> row;
+    for (size_t r = 0; r + 1 < local.offsets.size(); r++)
+    {
+      for (uint32_t k = local.offsets[r]; k < local.offsets[r + 1]; k++)
+      {
+        uint32_t source = local.columns[k];
+        double w = local.values[k];
+        for (uint32_t j = previous.offsets[source]; j < previous.offsets[source + 1]; j++)
+        {
+          uint32_t v = previous.columns[j];
+          if (accumulator[v] == 0)
+          {
+            touched.push_back(v);
+          }
+          accumulator[v] += w * previous.values[j];
+        }
+      }
+      for (uint32_t v : touched)
+      {
+        if (accumulator[v] != 0)
+        {
+          row.push_back({v, accumulator[v]});
+        }
+        accumulator[v] = 0;
+      }
+      touched.clear();
+      out.push(row);
+    }
+    return out;
+  }
+
+  // CSR rows -> LANES-row slices, entry-major, zero padded
+  void pack(const Rows &rows)
+  {
+    size_t slices = (refined_count + LANES - 1) / LANES;
+    slice_offsets.assign(1, 0);
+    for (size_t s = 0; s < slices; s++)
+    {
+      uint32_t width = 0;
+      for (size_t l = 0; l < LANES; l++)
+      {
+        size_t r = s * LANES + l;
+        if (r < refined_count)
+        {
+          width = std::max(width, rows.offsets[r + 1] - rows.offsets[r]);
+        }
+      }
+      size_t base = indices.size();
+      indices.resize(base + width * LANES, 0);
+      weights.resize(base + width * LANES, 0.0f);
+      for (size_t l = 0; l < LANES; l++)
+      {
+        size_t r = s * LANES + l;
+        if (r >= refined_count)
+        {
+          continue;
+        }
+        for (uint32_t k = rows.offsets[r]; k < rows.offsets[r + 1]; k++)
+        {
+          size_t e = base + (k - rows.offsets[r]) * LANES + l;
+          indices[e] = rows.columns[k];
+          weights[e] = (float)rows.values[k];
+        }
+      }
+      slice_offsets.push_back((uint32_t)indices.size());
+    }
+  }
+};
+
+#endif // !SUBDIVISION_H
@@ -0,0 +1,212 @@
+#ifndef SYMMETRY_H
+#define SYMMETRY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <kdtree.h>
+#include <mem_tracker.h>
+#include <scheduler.h>
+#include <string>
+#include <trace.h>
+#include <vector>
+
+// Left/right vertex correspondence of a mesh that is mirror symmetric across
+// a plane x = plane(). Every vertex is mirrored and matched to the closest
+// vertex of a k-d tree over the mesh, O(V log V) in total; vertices with no
+// match within the tolerance (asymmetric details) map to -1, vertices on the
+// plane map to themselves.
+//
+// The map is keyed to the exact base positions; save()/load() keep it in a
+// cache file that load() rejects once the base mesh changes.
+class SymmetryMap
+{
+public:
+  SymmetryMap() = default;
+
+  // tolerance: match distance relative to the bounding box diagonal
+  template <typename Vector>
+  static SymmetryMap build(JobScheduler &scheduler, const Vector &vertices, double tolerance = 1e-3)
+  {
+    TRACE_SCOPE("SymmetryMap::build");
+    MemScope mem_scope(MEM_BASIS);
+    SymmetryMap map;
+    size_t V = vertices.size() / 3;
+    map.key = checksum(vertices);
+
+    // the plane through the middle of the x extent, the centroid would be
+    // biased by asymmetric detail
+    double low[3], high[3];
+    bounds(vertices, low, high);
+    map.center = V ? 0.5 * (low[0] + high[0]) : 0.0;
+    double diagonal = std::sqrt((high[0] - low[0]) * (high[0] - low[0]) +
+                                (high[1] - low[1]) * (high[1] - low[1]) +
+                                (high[2] - low[2]) * (high[2] - low[2]));
+
+    KdTree tree(vertices);
+    map.mirrors.assign(V, -1);
+    scheduler.parallel_for(0, V, 1024, [&](size_t begin, size_t end)
+                           {
+                             for (size_t v = begin; v < end; v++)
+                             {
+                               double q[3] = {2 * map.center - vertices[v * 3], vertices[v * 3 + 1],
+                                              vertices[v * 3 + 2]};
+                               map.mirrors[v] = (int32_t)tree.nearest(q, tolerance * diagonal);
+                             }
+                           });
+    return map;
+  }
+
+  size_t size() const
+  {
+    return mirrors.size();
+  }
+
+  // x of the symmetry plane
+  double plane() const
+  {
+    return center;
+  }
+
+  // mirror partner of vertex v, or -1
+  int mirror(size_t v) const
+  {
+    return mirrors[v];
+  }
+
+  size_t num_paired() const
+  {
+    return (size_t)std::count_if(mirrors.begin(), mirrors.end(), [](int32_t m)
+                                 { return m >= 0; });
+  }
+
+  // Split a delta (3V, interleaved) into left (x > plane) and right parts
+  // with left + right == delta. The left share ramps smoothly from 0 to 1
+  // over [plane - falloff, plane + falloff] (falloff > 0) and is averaged
+  // with the right share of the mirror vertex, so the two halves are exact
+  // mirrors on a symmetric mesh.
+  template <typename InVector, typename Vector>
+  void split(const InVector &vertices, const InVector &delta, double falloff,
+             Vector &left, Vector &right) const
+  {
+    size_t V = mirrors.size();
+    left.resize(V * 3);
+    right.resize(V * 3);
+    auto share = [&](size_t v)
+    {
+      double t = std::max(-1.0, std::min(1.0, (vertices[v * 3] - center) / falloff));
+      t = 0.5 * (t + 1);
+      return t * t * (3 - 2 * t);
+    };
+    for (size_t v = 0; v < V; v++)
+    {
+      double s = share(v);
+      if (mirrors[v] >= 0)
+      {
+        s = 0.5 * (s + 1 - share(mirrors[v]));
+      }
+      for (int c = 0; c < 3; c++)
+      {
+        left[v * 3 + c] = s * delta[v * 3 + c];
+        right[v * 3 + c] = delta[v * 3 + c] - left[v * 3 + c];
+      }
+    }
+  }
+
+  // fraction of the delta's squared length on its weaker side; near 0.5 for
+  // bilateral shapes, near 0 for one-sided ones
+  template <typename InVector>
+  double balance(const InVector &vertices, const InVector &delta) const
+  {
+    double sides[2] = {0, 0};
+    for (size_t v = 0; v < mirrors.size(); v++)
+    {
+      double d2 = 0;
+      for (int c = 0; c < 3; c++)
+      {
+        d2 += delta[v * 3 + c] * delta[v * 3 + c];
+      }
+      sides[vertices[v * 3] > center ? 0 : 1] += d2;
+    }
+    double total = sides[0] + sides[1];
+    return total > 0 ? std::min(sides[0], sides[1]) / total : 0.0;
+  }
+
+  bool save(const std::string &path) const
+  {
+    std::ofstream file(path, std::ios::binary);
+    uint64_t header[4] = {MAGIC, key, mirrors.size(), 0};
+    std::memcpy(&header[3], &center, sizeof(double));
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)mirrors.data(), mirrors.size() * sizeof(int32_t));
+    if (!file)
+    {
+      std::cout << "ERROR::SYMMETRY::CACHE_NOT_WRITTEN: " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // false if the file is missing, truncated or was built for other vertices
+  template <typename Vector>
+  bool load(const std::string &path, const Vector &vertices)
+  {
+    MemScope mem_scope(MEM_BASIS);
+    std::ifstream file(path, std::ios::binary);
+    uint64_t header[4];
+    if (!file.read((char *)header, sizeof(header)) || header[0] != MAGIC ||
+        header[1] != checksum(vertices) || header[2] != vertices.size() / 3)
+    {
+      return false;
+    }
+    key = header[1];
+    std::memcpy(&center, &header[3], sizeof(double));
+    mirrors.resize(header[2]);
+    return (bool)file.read((char *)mirrors.data(), mirrors.size() * sizeof(int32_t));
+  }
+
+private:
+  static const uint64_t MAGIC = 0x314d4d5953454146ull; // "FAESYMM1"
+
+  uint64_t key = 0; // checksum of the positions the map was built on
+  double center = 0;
+  std::vector<int32_t> mirrors;
+
+  // FNV-1a over the position bits
+  template <typename Vector>
+  static uint64_t checksum(const Vector &vertices)
+  {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+      double value = vertices[i];
+      unsigned char bytes[sizeof(double)];
+      std::memcpy(bytes, &value, sizeof(double));
+      for (unsigned char byte : bytes)
+      {
+        hash = (hash ^ byte) * 0x100000001b3ull;
+      }
+    }
+    return hash;
+  }
+
+  template <typename Vector>
+  static void bounds(const Vector &vertices, double low[3], double high[3])
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      low[c] = vertices.empty() ? 0.0 : vertices[c];
+      high[c] = low[c];
+    }
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+      low[i % 3] = std::min(low[i % 3], (double)vertices[i]);
+      high[i % 3] = std::max(high[i % 3], (double)vertices[i]);
+    }
+  }
+};
+
+#endif // !SYMMETRY_H
@@ -0,0 +1,208 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped tracing in Chrome trace event format (chrome://tracing,
+// ui.perfetto.dev).
+//
+//   TRACE_SCOPE("blend_vertices");
+//
+// records a complete event from that line to the end of the scope. Events go
+// to a fixed ring per thread that only its owner writes, so recording takes
+// no lock. While tracing is off a scope costs one relaxed load and one branch.
+// Names must be string literals (or otherwise outlive the trace).
+
+struct TraceEvent
+{
+  const char *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+// single-producer ring; the oldest events are overwritten once it is full.
+// Slots are relaxed atomics so a snapshot may copy them while the owner
+// records: the owner bumps `claimed` before it overwrites a slot and
+// publishes `head` after, and the reader drops whatever a claim overlapped
+struct TraceBuffer
+{
+  static constexpr uint64_t CAPACITY = 1 << 16;
+
+  struct Slot
+  {
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> duration_ns;
+  };
+
+  std::unique_ptr<Slot[]> events{new Slot[CAPACITY]};
+  std::atomic<uint64_t> head{0};    // events [0, head) are complete
+  std::atomic<uint64_t> claimed{0}; // events [0, claimed) may be in their slots
+  uint32_t tid = 0;
+  std::string thread_name;
+};
+
+class Trace
+{
+public:
+  static bool enabled()
+  {
+    return on.load(std::memory_order_relaxed);
+  }
+
+  static void enable(bool enable)
+  {
+    on.store(enable, std::memory_order_relaxed);
+  }
+
+  static uint64_t now_ns()
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch)
+        .count();
+  }
+
+  static void record(const char *name, uint64_t start_ns, uint64_t end_ns)
+  {
+    TraceBuffer &buffer = local_buffer();
+    uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    buffer.claimed.store(head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    TraceBuffer::Slot &slot = buffer.events[head % TraceBuffer::CAPACITY];
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.duration_ns.store(end_ns - start_ns, std::memory_order_relaxed);
+    buffer.head.store(head + 1, std::memory_order_release);
+  }
+
+  // label the calling thread's track in the trace viewer
+  static void set_thread_name(const std::string &name)
+  {
+    TraceBuffer &buffer = local_buffer();
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    buffer.thread_name = name;
+  }
+
+  // Snapshot every thread's ring into a trace file. Threads may keep
+  // recording meanwhile; events whose slot was reclaimed while it was being
+  // copied are dropped.
+  static bool write_chrome_trace(const std::string &path)
+  {
+    std::vector<std::shared_ptr<TraceBuffer>> snapshot;
+    {
+      std::lock_guard<std::mutex> guard(registry_mutex);
+      snapshot = buffers;
+    }
+
+    std::ofstream out(path);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : snapshot)
+    {
+      std::string thread_name;
+      {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        thread_name = buffer->thread_name;
+      }
+      if (thread_name.empty())
+      {
+        thread_name = "thread " + std::to_string(buffer->tid);
+      }
+      out << (first ? "\n" : ",\n")
+          << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+          << ",\"args\":{\"name\":\"" << thread_name << "\"}}";
+      first = false;
+
+      // copy first, then check which of the copied slots a later event
+      // claimed (the fence pairs with the release fence in record())
+      uint64_t head = buffer->head.load(std::memory_order_acquire);
+      uint64_t begin = head > TraceBuffer::CAPACITY ? head - TraceBuffer::CAPACITY : 0;
+      std::vector<TraceEvent> events(head - begin);
+      for (uint64_t i = begin; i < head; i++)
+      {
+        const TraceBuffer::Slot &slot = buffer->events[i % TraceBuffer::CAPACITY];
+        events[i - begin] = {slot.name.load(std::memory_order_relaxed),
+                             slot.start_ns.load(std::memory_order_relaxed),
+                             slot.duration_ns.load(std::memory_order_relaxed)};
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t claimed = buffer->claimed.load(std::memory_order_relaxed);
+      // event i is intact unless event i + CAPACITY has been claimed
+      uint64_t valid = claimed > TraceBuffer::CAPACITY + begin ? claimed - TraceBuffer::CAPACITY : begin;
+      for (uint64_t i = std::min(valid, head); i < head; i++)
+      {
+        const TraceEvent &event = events[i - begin];
+        out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << buffer->tid << ",\"ts\":" << event.start_ns * 1e-3
+            << ",\"dur\":" << event.duration_ns * 1e-3 << "}";
+      }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+  }
+
+private:
+  inline static std::atomic<bool> on{false};
+  inline static const std::chrono::steady_clock::time_point epoch =
+      std::chrono::steady_clock::now();
+
+  inline static std::mutex registry_mutex;
+  inline static std::vector<std::shared_ptr<TraceBuffer>> buffers;
+
+  // the registry keeps buffers alive after their thread exits
+  static TraceBuffer &local_buffer()
+  {
+    thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer)
+    {
+      auto created = std::make_shared<TraceBuffer>();
+      std::lock_guard<std::mutex> guard(registry_mutex);
+      created->tid = (uint32_t)buffers.size() + 1;
+      buffers.push_back(created);
+      buffer = created.get();
+    }
+    return *buffer;
+  }
+};
+
+class TraceScope
+{
+public:
+  explicit TraceScope(const char *name)
+  {
+    if (Trace::enabled())
+    {
+      this->name = name;
+      start_ns = Trace::now_ns();
+    }
+  }
+
+  ~TraceScope()
+  {
+    if (name)
+    {
+      Trace::record(name, start_ns, Trace::now_ns());
+    }
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  const char *name = nullptr;
+  uint64_t start_ns = 0;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif // !TRACE_H
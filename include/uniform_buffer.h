@@ -0,0 +1,176 @@
+#ifndef UNIFORM_BUFFER_H
+#define UNIFORM_BUFFER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <mem_tracker.h>
+#include <vector>
+
+// Binding points shared by every program; each Shader maps its blocks onto
+// these with bindUniformBlock().
+enum UniformBinding : GLuint
+{
+  CAMERA_BINDING = 0,
+  MODEL_BINDING = 1,
+  SKIN_BINDING = 2,
+};
+
+// The C++ structs below are the source of truth for the std140 blocks in
+// shaders/*.vs. Only mat4/vec4/float-quadruple members are used, so std140
+// and the C++ layout coincide; the static_asserts pin that down, and
+// Shader::bindUniformBlock() checks the size the driver reports.
+
+// per-frame data shared across programs:
+//   layout(std140) uniform Camera { mat4 view; mat4 projection; vec4 eye; };
+struct CameraBlock
+{
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::vec4 eye;
+};
+
+static_assert(offsetof(CameraBlock, view) == 0, "std140 mismatch");
+static_assert(offsetof(CameraBlock, projection) == 64, "std140 mismatch");
+static_assert(offsetof(CameraBlock, eye) == 128, "std140 mismatch");
+static_assert(sizeof(CameraBlock) == 144, "std140 mismatch");
+
+// per-draw data:
+//   layout(std140) uniform Model { mat4 model; mat4 normalMatrix; };
+struct ModelBlock
+{
+  glm::mat4 model;
+  glm::mat4 normal_matrix;
+};
+
+static_assert(offsetof(ModelBlock, model) == 0, "std140 mismatch");
+static_assert(offsetof(ModelBlock, normal_matrix) == 64, "std140 mismatch");
+static_assert(sizeof(ModelBlock) == 128, "std140 mismatch");
+
+// joint transforms of the current skin pose (SkinPose), 64 joints:
+//   layout(std140) uniform Skin { vec4 jointRows[192]; vec4 jointReal[64];
+//                                 vec4 jointDual[64]; };
+struct SkinBlock
+{
+  glm::vec4 rows[3 * 64]; // 3x4 matrix rows per joint
+  glm::vec4 real[64];     // rotation quaternion (xyzw)
+  glm::vec4 dual[64];     // dual part (xyzw)
+};
+
+static_assert(offsetof(SkinBlock, rows) == 0, "std140 mismatch");
+static_assert(offsetof(SkinBlock, real) == 3072, "std140 mismatch");
+static_assert(offsetof(SkinBlock, dual) == 4096, "std140 mismatch");
+static_assert(sizeof(SkinBlock) == 5120, "std140 mismatch");
+
+// A single block instance bound to a fixed binding point, updated with one
+// glBufferSubData call.
+template <typename T>
+class UniformBuffer
+{
+public:
+  explicit UniformBuffer(GLuint binding) : binding(binding)
+  {
+    glGenBuffers(1, &ID);
+    glBindBuffer(GL_UNIFORM_BUFFER, ID);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(T), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, ID);
+  }
+
+  ~UniformBuffer()
+  {
+    glDeleteBuffers(1, &ID);
+  }
+
+  UniformBuffer(const UniformBuffer &) = delete;
+  UniformBuffer &operator=(const UniformBuffer &) = delete;
+
+  void update(const T &value)
+  {
+    glBindBuffer(GL_UNIFORM_BUFFER, ID);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &value);
+  }
+
+  // re-attach to the binding point, e.g. after another buffer took it
+  void bind() const
+  {
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, ID);
+  }
+
+private:
+  GLuint ID;
+  GLuint binding;
+};
+
+// Per-draw blocks for a whole frame: draws are staged on the CPU with push(),
+// uploaded with one glBufferSubData in flush(), and selected per draw with
+// glBindBufferRange in bind().
+template <typename T>
+class UniformArrayBuffer
+{
+public:
+  explicit UniformArrayBuffer(GLuint binding) : binding(binding)
+  {
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    stride = (sizeof(T) + alignment - 1) / alignment * alignment;
+    glGenBuffers(1, &ID);
+  }
+
+  ~UniformArrayBuffer()
+  {
+    glDeleteBuffers(1, &ID);
+  }
+
+  UniformArrayBuffer(const UniformArrayBuffer &) = delete;
+  UniformArrayBuffer &operator=(const UniformArrayBuffer &) = delete;
+
+  // start a new frame
+  void clear()
+  {
+    count = 0;
+  }
+
+  // stage one draw's block and return its index for bind()
+  size_t push(const T &value)
+  {
+    if ((count + 1) * stride > staging.size())
+    {
+      MemScope mem_scope(MEM_GL_STAGING);
+      staging.resize((count + 1) * stride);
+    }
+    std::memcpy(&staging[count * stride], &value, sizeof(T));
+    return count++;
+  }
+
+  void flush()
+  {
+    if (count == 0)
+    {
+      return;
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, ID);
+    if (staging.size() > capacity)
+    {
+      capacity = staging.size();
+      glBufferData(GL_UNIFORM_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+    }
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, count * stride, staging.data());
+  }
+
+  void bind(size_t index) const
+  {
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, ID, index * stride, sizeof(T));
+  }
+
+private:
+  GLuint ID;
+  GLuint binding;
+  size_t stride;
+  size_t count = 0;
+  size_t capacity = 0;
+  std::vector<unsigned char> staging;
+};
+
+#endif // !UNIFORM_BUFFER_H
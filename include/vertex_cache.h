@@ -0,0 +1,214 @@
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <trace.h>
+#include <vector>
+
+// Load-time reordering of an indexed triangle list for the GPU: triangles
+// are reordered for post-transform cache hits (Forsyth's linear-speed
+// optimizer), then vertices are renumbered in first-use order so vertex
+// fetches walk memory forwards. Neither changes the mesh, only the order.
+
+// average cache miss ratio: vertex shader invocations per triangle under a
+// FIFO post-transform cache of `cache_size` entries (3.0 is no reuse, the
+// ideal for a closed mesh approaches 0.5)
+inline double acmr(const std::vector<uint32_t> &indices, size_t num_vertices, size_t cache_size = 16)
+{
+  if (indices.empty())
+  {
+    return 0.0;
+  }
+  // the FIFO as insertion timestamps: a vertex hits while it was inserted
+  // within the last cache_size misses
+  std::vector<size_t> inserted(num_vertices, 0);
+  size_t misses = 0;
+  for (uint32_t v : indices)
+  {
+    if (inserted[v] == 0 || misses - inserted[v] + 1 > cache_size)
+    {
+      misses++;
+      inserted[v] = misses;
+    }
+  }
+  return (double)misses / (indices.size() / 3);
+}
+
+// reorder triangles in place for vertex cache locality
+inline void optimize_vertex_cache(std::vector<uint32_t> &indices, size_t num_vertices)
+{
+  TRACE_SCOPE("optimize_vertex_cache");
+  const int CACHE_SIZE = 32;
+  const size_t num_triangles = indices.size() / 3;
+
+  // vertex score: recently used vertices and vertices with few triangles
+  // left score higher, so the optimizer finishes off fans before moving on
+  float cache_score[CACHE_SIZE];
+  for (int p = 0; p < CACHE_SIZE; p++)
+  {
+    cache_score[p] = p < 3 ? 0.75f : std::pow(1.0f - (p - 3) / (float)(CACHE_SIZE - 3), 1.5f);
+  }
+  const int MAX_VALENCE = 32;
+  float valence_score[MAX_VALENCE];
+  for (int n = 0; n < MAX_VALENCE; n++)
+  {
+    valence_score[n] = n == 0 ? 0.0f : 2.0f / std::sqrt((float)n);
+  }
+
+  // vertex -> remaining triangles (CSR; live entries are kept in front)
+  std::vector<uint32_t> offsets(num_vertices + 1, 0);
+  for (uint32_t v : indices)
+  {
+    offsets[v + 1]++;
+  }
+  for (size_t v = 0; v < num_vertices; v++)
+  {
+    offsets[v + 1] += offsets[v];
+  }
+  std::vector<uint32_t> adjacency(indices.size());
+  std::vector<uint32_t> remaining(num_vertices, 0);
+  for (size_t c = 0; c < indices.size(); c++)
+  {
+    uint32_t v = indices[c];
+    adjacency[offsets[v] + remaining[v]++] = (uint32_t)(c / 3);
+  }
+
+  std::vector<int> position(num_vertices, -1);
+  std::vector<float> vertex_score(num_vertices);
+  auto score = [&](uint32_t v)
+  {
+    if (remaining[v] == 0)
+    {
+      return -1.0f;
+    }
+    float s = position[v] < 0 ? 0.0f : cache_score[position[v]];
+    return s + valence_score[std::min<uint32_t>(remaining[v], MAX_VALENCE - 1)];
+  };
+  for (size_t v = 0; v < num_vertices; v++)
+  {
+    vertex_score[v] = score((uint32_t)v);
+  }
+  std::vector<float> triangle_score(num_triangles);
+  for (size_t t = 0; t < num_triangles; t++)
+  {
+    triangle_score[t] = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]] +
+                        vertex_score[indices[t * 3 + 2]];
+  }
+
+  std::vector<bool> emitted(num_triangles, false);
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+  std::vector<uint32_t> cache, next_cache;
+  size_t scan = 0; // every triangle before this one is emitted
+  long best = -1;
+  for (size_t k = 0; k < num_triangles; k++)
+  {
+    if (best < 0)
+    {
+      // nothing adjacent to the cache: take the best remaining triangle
+      float best_score = -1.0f;
+      while (scan < num_triangles && emitted[scan])
+      {
+        scan++;
+      }
+      for (size_t t = scan; t < num_triangles; t++)
+      {
+        if (!emitted[t] && triangle_score[t] > best_score)
+        {
+          best_score = triangle_score[t];
+          best = (long)t;
+        }
+      }
+    }
+
+    const uint32_t *tri = &indices[best * 3];
+    output.insert(output.end(), tri, tri + 3);
+    emitted[best] = true;
+
+    // drop the triangle from its vertices' live lists
+    for (int i = 0; i < 3; i++)
+    {
+      uint32_t v = tri[i];
+      uint32_t *list = &adjacency[offsets[v]];
+      std::swap(*std::find(list, list + remaining[v], (uint32_t)best), list[remaining[v] - 1]);
+      remaining[v]--;
+    }
+
+    // LRU: the triangle's vertices move to the front
+    next_cache.assign(tri, tri + 3);
+    for (uint32_t v : cache)
+    {
+      if (v != tri[0] && v != tri[1] && v != tri[2])
+      {
+        next_cache.push_back(v);
+      }
+    }
+    std::swap(cache, next_cache);
+    for (size_t p = 0; p < cache.size(); p++)
+    {
+      position[cache[p]] = p < (size_t)CACHE_SIZE ? (int)p : -1;
+    }
+
+    // rescore what the cache touched and pick the best neighbouring triangle
+    float best_score = -1.0f;
+    best = -1;
+    for (uint32_t v : cache)
+    {
+      float s = score(v);
+      float change = s - vertex_score[v];
+      vertex_score[v] = s;
+      for (uint32_t j = offsets[v]; j < offsets[v] + remaining[v]; j++)
+      {
+        uint32_t t = adjacency[j];
+        triangle_score[t] += change;
+      }
+    }
+    for (size_t p = 0; p < cache.size() && p < (size_t)CACHE_SIZE; p++)
+    {
+      uint32_t v = cache[p];
+      for (uint32_t j = offsets[v]; j < offsets[v] + remaining[v]; j++)
+      {
+        uint32_t t = adjacency[j];
+        if (triangle_score[t] > best_score)
+        {
+          best_score = triangle_score[t];
+          best = (long)t;
+        }
+      }
+    }
+    if (cache.size() > (size_t)CACHE_SIZE)
+    {
+      cache.resize(CACHE_SIZE);
+    }
+  }
+  indices.swap(output);
+}
+
+// renumber vertices in first-use order; rewrites `indices` and returns
+// old -> new. Unreferenced vertices go last, keeping their relative order
+inline std::vector<uint32_t> optimize_vertex_fetch(std::vector<uint32_t> &indices, size_t num_vertices)
+{
+  const uint32_t UNSET = ~0u;
+  std::vector<uint32_t> remap(num_vertices, UNSET);
+  uint32_t next = 0;
+  for (uint32_t &v : indices)
+  {
+    if (remap[v] == UNSET)
+    {
+      remap[v] = next++;
+    }
+    v = remap[v];
+  }
+  for (uint32_t &r : remap)
+  {
+    if (r == UNSET)
+    {
+      r = next++;
+    }
+  }
+  return remap;
+}
+
+#endif // !VERTEX_CACHE_H
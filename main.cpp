@@ -1,40 +1,181 @@
+// -DFACIALEXPS_MEM_TRACKING=ON installs the allocation hook in this binary
+#ifdef FACIALEXPS_MEM_TRACKING
+#define MEM_TRACKER_IMPLEMENTATION
+#endif
+#include <mem_tracker.h>
+
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <GLFW/glfw3.h>
 
+#include <arena.h>
+#include <basis.h>
+#include <blendshape.h>
+#include <capture.h>
+#include <crowd.h>
+#include <drivers.h>
+#include <frame_timer.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <landmarks.h>
+#include <lod.h>
+#include <meshlets.h>
 #include <obj.h>
+#include <pca.h>
+#include <optional>
+#include <scheduler.h>
 #include <shader.h>
+#include <solver.h>
+#include <subdivision.h>
+#include <symmetry.h>
+#include <trace.h>
+#include <uniform_buffer.h>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <assert.h>
-
-void dump_framebuffer_to_ppm(std::string prefix, uint32_t width,
-                             uint32_t height);
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+// command line: an optional mode in argv[1] followed by its operands, and
+// flags anywhere after it
+struct Options
+{
+  // --batch [out], --fit <mesh|dir> [out], --split-lr [out], --crowd <n>, or
+  // empty for the viewer
+  std::string mode;
+  std::vector<std::string> operands;
+  // --trace <file>: record scoped trace events
+  std::string trace_path;
+  // --frame-log <prefix>: write frame timings as <prefix>.csv, <prefix>.json
+  // and <prefix>.trace.json on exit
+  std::string frame_log;
+  // --max-weight <w>: raise the fit's [0, 1] weight bound
+  SolveOptions solve;
+  // --falloff <width>: blend width across the symmetry plane for --split-lr
+  double falloff = 2.0;
+  // --quantized: blend from the int16 delta basis
+  bool quantized = false;
+  // --pca <tolerance>: blend from a low-rank basis with at most this relative
+  // error, cached in data/faces/pca.cache
+  double pca_tolerance = -1;
+  // --skin lbs|dqs: pose the rig's skeleton (manifest preview pose) after
+  // the blend, with linear blend or dual-quaternion skinning
+  SkinMethod skin_method = SKIN_NONE;
+  // --subdivide <level>: draw the blended cage refined by Catmull-Clark
+  // stencils, level 1 to 3
+  int subdivision_level = 0;
+  // --meshlets: blend only the meshlets the current weights move
+  bool use_meshlets = false;
+  // --track <landmarks> <observations>: fit the weights and head pose to one
+  // frame of tracked landmarks per rendered frame (see load_landmarks and
+  // load_landmark_frames), looping over the recording
+  std::string track_landmarks, track_observations;
+};
+
+Options parse_options(int argc, char **argv);
+
+void dump_framebuffer_to_ppm(JobScheduler &scheduler, std::string prefix,
+                             uint32_t width, uint32_t height);
 
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 
-void process_input(GLFWwindow *window);
+bool process_input(GLFWwindow *window, JobScheduler &scheduler);
+
+int run_batch(JobScheduler &scheduler, const std::string weights_path,
+              const std::string faces_path, const std::string out_path);
+
+int run_fit(JobScheduler &scheduler, const std::string faces_path,
+            const std::string input_path, const std::string out_path,
+            const SolveOptions &options);
 
-std::vector<Obj> load_face_objs(const std::string faces_path, const int num_faces);
-std::vector<tinyobj::real_t> get_weights(const char *file_path);
-void blend_shape(Obj base_obj, std::vector<Obj> face_objs,
-                 std::vector<tinyobj::real_t> weights,
-                 std::vector<tinyobj::real_t> &vbuffer,
-                 std::vector<tinyobj::real_t> &nbuffer);
+int run_split(JobScheduler &scheduler, const std::string faces_path,
+              const std::string out_path, double falloff);
 
 static uint32_t ss_id = 0;
 
+// where --trace writes the Chrome trace (on exit and when t is pressed)
+static std::string trace_path;
+
 const unsigned int SCR_WIDTH = 1024;
 const unsigned int SCR_HEIGHT = 768;
 
-int main()
+int main(int argc, char **argv)
 {
+  JobScheduler scheduler;
+  Options options = parse_options(argc, argv);
+
+  trace_path = options.trace_path;
+  if (!trace_path.empty())
+  {
+    Trace::enable(true);
+    Trace::set_thread_name("main");
+  }
+
+  // batch mode: blend every weights file without opening a window
+  if (options.mode == "--batch")
+  {
+    std::string out_path = options.operands.empty() ? "out/" : options.operands[0];
+    int status = run_batch(scheduler, "data/weights/", "data/faces/", out_path);
+    scheduler.wait_idle();
+    if (!trace_path.empty())
+    {
+      Trace::write_chrome_trace(trace_path);
+    }
+    if (MemTracker::compiled())
+    {
+      MemTracker::report(std::cout);
+    }
+    return status;
+  }
+
+  // fit mode: recover weights for one mesh or every *.obj in a directory
+  // (base topology)
+  if (options.mode == "--fit" && !options.operands.empty())
+  {
+    std::string out_path = options.operands.size() > 1 ? options.operands[1] : "out/";
+    int status = run_fit(scheduler, "data/faces/", options.operands[0], out_path, options.solve);
+    scheduler.wait_idle();
+    if (!trace_path.empty())
+    {
+      Trace::write_chrome_trace(trace_path);
+    }
+    return status;
+  }
+
+  // split mode: write left/right halves of every bilateral target
+  if (options.mode == "--split-lr")
+  {
+    std::string out_path = options.operands.empty() ? "split/" : options.operands[0];
+    int status = run_split(scheduler, "data/faces/", out_path, options.falloff);
+    scheduler.wait_idle();
+    if (!trace_path.empty())
+    {
+      Trace::write_chrome_trace(trace_path);
+    }
+    return status;
+  }
+
+  // crowd mode: render a grid of heads cycling through data/weights
+  int crowd_size = 0;
+  if (options.mode == "--crowd" && !options.operands.empty())
+  {
+    crowd_size = std::max(1, std::atoi(options.operands[0].c_str()));
+  }
+
+  const std::string &frame_log = options.frame_log;
+  bool quantized = options.quantized;
+  double pca_tolerance = options.pca_tolerance;
+  SkinMethod skin_method = options.skin_method;
+  int subdivision_level = options.subdivision_level;
+  bool use_meshlets = options.use_meshlets;
+
   // initialize and configure
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -64,6 +205,9 @@ int main()
     return -1;
   }
 
+  // reuse linked programs across launches instead of recompiling GLSL
+  Shader::enableBinaryCache((GLADloadproc)glfwGetProcAddress, "shader_cache");
+
   // configure global OpenGL state
   glEnable(GL_DEPTH_TEST);
   glEnable(GL_CULL_FACE);
@@ -73,16 +217,112 @@ int main()
   // build and compile shader program
   Shader shader("shaders/shader.vs", "shaders/shader.fs");
 
-  // load weights
+  // load weights; n steps through the other files in data/weights
+  std::vector<std::filesystem::path> weight_files = list_weight_files("data/weights/");
+  size_t weights_index = std::find(weight_files.begin(), weight_files.end(),
+                                   std::filesystem::path("data/weights/11.weights")) -
+                         weight_files.begin();
   std::vector<tinyobj::real_t> weights = get_weights("data/weights/11.weights");
 
   // load base and file objs
   Obj base_obj("data/faces/base.obj");
-  std::vector<Obj> face_objs = load_face_objs("data/faces/", weights.size());
+  std::vector<Obj> face_objs =
+      load_face_objs(scheduler, "data/faces/", weights.size());
+  // float SoA copy for interactive blending
+  Rig rig(base_obj, face_objs, load_rig_manifest("data/faces/"));
+  BlendBasis basis(base_obj, face_objs, &rig.inbetweens);
+  std::optional<QuantizedBasis> quantized_basis;
+  if (quantized)
+  {
+    quantized_basis.emplace(basis);
+    std::cout << "Quantized basis: " << quantized_basis->size_bytes() / 1024 << " KiB (float "
+              << basis.size_bytes() / 1024 << " KiB), max delta error "
+              << quantized_basis->max_error() << std::endl;
+  }
+  std::optional<PcaBasis> pca_basis;
+  if (pca_tolerance >= 0)
+  {
+    const std::string cache_path = "data/faces/pca.cache";
+    pca_basis.emplace();
+    if (!pca_basis->load(cache_path, basis) || pca_basis->tolerance() != pca_tolerance)
+    {
+      *pca_basis = PcaBasis::build(scheduler, basis, pca_tolerance);
+      pca_basis->save(cache_path);
+    }
+    std::cout << "PCA basis: " << pca_basis->num_components() << " of "
+              << pca_basis->num_targets() << " components, relative error "
+              << pca_basis->relative_error() << std::endl;
+  }
+  if (skin_method != SKIN_NONE && rig.skin.empty())
+  {
+    std::cout << "ERROR::SKIN::NO_JOINTS: data/faces/rig.txt declares no skeleton" << std::endl;
+    skin_method = SKIN_NONE;
+  }
+  std::optional<MeshletBasis> meshlet_basis;
+  if (use_meshlets)
+  {
+    ArenaScope load_scope;
+    meshlet_basis.emplace(basis, triangle_corners(base_obj, load_scope.resource()));
+    std::cout << "Meshlets: " << meshlet_basis->size() << ", " << meshlet_basis->num_active(weights)
+              << " active for the first weights" << std::endl;
+  }
+  std::optional<SubdivisionStencils> subdivision;
+  if (subdivision_level > 0)
+  {
+    subdivision.emplace(Obj("data/faces/base.obj", false), subdivision_level);
+    std::cout << "Subdivision level " << subdivision->level() << ": "
+              << subdivision->num_vertices() << " vertices, " << subdivision->size_bytes() / 1024
+              << " KiB of stencils" << std::endl;
+  }
+  const SubdivisionStencils *refine = subdivision ? &*subdivision : nullptr;
+  // ray queries on the blended cage (left click picks); the meshlet masks
+  // only bound what moved when the meshlet basis does the blend
+  std::pmr::vector<int> base_corners = triangle_corners(base_obj);
+  Bvh bvh(base_obj.getVertices(), base_corners,
+          meshlet_basis && !pca_basis && !quantized_basis ? &*meshlet_basis : nullptr);
+  std::optional<LandmarkFitter> tracker;
+  std::vector<std::vector<glm::dvec3>> track_frames;
+  size_t track_frame = 0;
+  if (!options.track_landmarks.empty())
+  {
+    std::vector<int> landmarks = load_landmarks(options.track_landmarks, basis.num_vertices());
+    if (!landmarks.empty())
+    {
+      track_frames = load_landmark_frames(options.track_observations, landmarks.size());
+    }
+    if (!track_frames.empty())
+    {
+      std::cout << "Tracking " << landmarks.size() << " landmarks over " << track_frames.size()
+                << " frames" << std::endl;
+      tracker.emplace(basis, std::move(landmarks));
+    }
+  }
+  SkinPose pose(rig.skin, skin_method);
+  pose.set(rig.skin.preview());
+  const SkinPose *skin = skin_method != SKIN_NONE ? &pose : nullptr;
+  auto blend = [&](std::vector<tinyobj::real_t> &vbuffer, std::vector<tinyobj::real_t> &nbuffer)
+  {
+    if (pca_basis)
+    {
+      blend_shape(scheduler, base_obj, *pca_basis, weights, vbuffer, nbuffer, &rig, skin, refine, &bvh);
+    }
+    else if (quantized_basis)
+    {
+      blend_shape(scheduler, base_obj, *quantized_basis, weights, vbuffer, nbuffer, &rig, skin, refine, &bvh);
+    }
+    else if (meshlet_basis)
+    {
+      blend_shape(scheduler, base_obj, *meshlet_basis, weights, vbuffer, nbuffer, &rig, skin, refine, &bvh);
+    }
+    else
+    {
+      blend_shape(scheduler, base_obj, basis, weights, vbuffer, nbuffer, &rig, skin, refine, &bvh);
+    }
+  };
 
   // blend shpae
   std::vector<tinyobj::real_t> vbuffer, nbuffer;
-  blend_shape(base_obj, face_objs, weights, vbuffer, nbuffer);
+  blend(vbuffer, nbuffer);
 
   GLuint VAO, VBO_vertices, VBO_normals;
   glGenVertexArrays(1, &VAO);
@@ -92,7 +332,7 @@ int main()
   glGenBuffers(1, &VBO_vertices);
   glBindBuffer(GL_ARRAY_BUFFER, VBO_vertices);
   glBufferData(GL_ARRAY_BUFFER, vbuffer.size() * sizeof(tinyobj::real_t), &vbuffer[0],
-               GL_STATIC_DRAW);
+               GL_DYNAMIC_DRAW);
 
   // position attribute
   GLuint vertex_loc = shader.getAttribLocation("aPos");
@@ -104,7 +344,7 @@ int main()
   glGenBuffers(1, &VBO_normals);
   glBindBuffer(GL_ARRAY_BUFFER, VBO_normals);
   glBufferData(GL_ARRAY_BUFFER, nbuffer.size() * sizeof(tinyobj::real_t), &nbuffer[0],
-               GL_STATIC_DRAW);
+               GL_DYNAMIC_DRAW);
 
   // normal attribute
   GLuint normal_loc = shader.getAttribLocation("aNormal");
@@ -113,34 +353,247 @@ int main()
   glEnableVertexAttribArray(normal_loc);
 
   glm::mat4 model = glm::mat4(1.0f);
-  glm::mat4 view = glm::lookAt(glm::vec3(20, 50, 200), glm::vec3(0, 90, 0),
-                               glm::vec3(0, 1, 0));
+  glm::vec3 eye(20, 50, 200);
+  glm::vec3 center(0, 90, 0);
+
+  // crowd preview: one instance per grid cell, blended on the GPU
+  std::optional<Shader> crowd_shader;
+  std::vector<std::vector<tinyobj::real_t>> crowd_weights;
+  std::vector<glm::mat4> crowd_transforms;
+  if (crowd_size > 0)
+  {
+    crowd_shader.emplace("shaders/crowd.vs", "shaders/shader.fs");
+    for (const auto &file : list_weight_files("data/weights/"))
+    {
+      crowd_weights.push_back(get_weights(file.string().c_str()));
+    }
 
-  glm::mat4 proj =
-      glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+    const float spacing_x = 60.0f, spacing_y = 75.0f;
+    int cols = (int)std::ceil(std::sqrt((float)crowd_size));
+    int rows = (crowd_size + cols - 1) / cols;
+    for (int i = 0; i < crowd_size; i++)
+    {
+      float x = (i % cols - (cols - 1) * 0.5f) * spacing_x;
+      float y = ((rows - 1) * 0.5f - i / cols) * spacing_y;
+      crowd_transforms.push_back(glm::translate(glm::mat4(1.0f), glm::vec3(x, y, 0)));
+    }
 
-  // render loop
-  while (!glfwWindowShouldClose(window))
+    // back off until the whole grid fits the 60 degree field of view
+    float extent = std::max(cols * spacing_x, rows * spacing_y);
+    center = glm::vec3(0, 114, 0);
+    eye = center + glm::vec3(0, 0, extent / (2.0f * std::tan(glm::radians(30.0f))) + 60.0f);
+  }
+
+  glm::mat4 view = glm::lookAt(eye, center, glm::vec3(0, 1, 0));
+
+  glm::mat4 proj =
+      glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f,
+                       std::max(1000.0f, eye.z + 200.0f));
+
+  // camera data is shared by every program, model data is per draw; the
+  // buffers are scoped so they are released while the context still exists
+  shader.bindUniformBlock<CameraBlock>("Camera", CAMERA_BINDING);
+  shader.bindUniformBlock<ModelBlock>("Model", MODEL_BINDING);
+  if (crowd_shader)
+  {
+    crowd_shader->bindUniformBlock<CameraBlock>("Camera", CAMERA_BINDING);
+    crowd_shader->bindUniformBlock<SkinBlock>("Skin", SKIN_BINDING);
+  }
   {
-    process_input(window);
+    UniformBuffer<CameraBlock> camera_ubo(CAMERA_BINDING);
+    UniformArrayBuffer<ModelBlock> model_ubo(MODEL_BINDING);
+    // the pose is fixed, one upload covers every frame
+    UniformBuffer<SkinBlock> skin_ubo(SKIN_BINDING);
+    skin_ubo.update(skin_block(pose));
+
+    std::optional<LodChain> crowd_lods;
+    std::unique_ptr<CrowdRenderer> crowd;
+    if (crowd_shader)
+    {
+      MemScope mem_scope(MEM_BASIS);
+      ArenaScope load_scope;
+      std::vector<tinyobj::real_t> base_normals;
+      recompute_normals(scheduler, base_obj, base_obj.getVertices(), base_normals);
+      std::vector<std::vector<tinyobj::real_t>> target_vertices, target_normals(face_objs.size());
+      for (size_t i = 0; i < face_objs.size(); i++)
+      {
+        target_vertices.push_back(face_objs[i].getVertices());
+        recompute_normals(scheduler, base_obj, target_vertices[i], target_normals[i]);
+      }
+
+      std::pmr::vector<int> corners = triangle_corners(base_obj, load_scope.resource());
+      crowd_lods.emplace(base_obj.getVertices(), corners, target_vertices);
+      crowd = std::make_unique<CrowdRenderer>(*crowd_shader, corners, base_obj.getVertices(),
+                                              base_normals, target_vertices, target_normals,
+                                              &*crowd_lods);
+      crowd->set_instances(crowd_weights, crowd_transforms);
+      crowd->select_levels(eye, glm::radians(60.0f), (float)SCR_HEIGHT);
+      std::cout << "Crowd ACMR " << crowd->acmr_original() << " -> " << crowd->acmr_optimized()
+                << std::endl;
+      for (size_t l = 0; l < crowd_lods->size(); l++)
+      {
+        const LodChain::Level &level = crowd_lods->level(l);
+        std::cout << "Crowd LOD " << l << ": " << level.triangles.size() / 3 << " triangles, "
+                  << level.sources.size() << " vertices, error " << level.error << ", "
+                  << crowd->instances_at(l) << " instances" << std::endl;
+      }
+      if (skin)
+      {
+        crowd->set_skin(rig.skin, skin_method);
+      }
+    }
 
-    // background color
-    glClearColor(0.3f, 0.4f, 0.5f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    FrameTimer frame_timer;
+    double title_time = glfwGetTime();
+    bool left_was_pressed = false;
 
-    // activate shader
-    shader.use();
-    shader.setMat4("model", model);
-    shader.setMat4("view", view);
-    shader.setMat4("projection", proj);
+    // render loop
+    while (!glfwWindowShouldClose(window))
+    {
+      // per-frame scratch, released at the end of the iteration
+      ArenaScope frame_scope;
+      frame_timer.begin_frame();
+
+      bool next_weights;
+      {
+        FrameTimer::Scope stage(frame_timer, STAGE_INPUT);
+        next_weights = process_input(window, scheduler);
+
+        // left click: the triangle and nearest base vertex under the cursor
+        bool left_pressed = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        if (left_pressed && !left_was_pressed && !crowd)
+        {
+          double cursor_x, cursor_y;
+          int window_width, window_height;
+          glfwGetCursorPos(window, &cursor_x, &cursor_y);
+          glfwGetWindowSize(window, &window_width, &window_height);
+          glm::vec2 ndc(2.0 * cursor_x / window_width - 1.0, 1.0 - 2.0 * cursor_y / window_height);
+          glm::mat4 unproject = glm::inverse(proj * view * model);
+          glm::vec4 near_point = unproject * glm::vec4(ndc, -1.0f, 1.0f);
+          glm::vec4 far_point = unproject * glm::vec4(ndc, 1.0f, 1.0f);
+          glm::vec3 from = glm::vec3(near_point) / near_point.w;
+          RayPacket ray;
+          ray.set(0, from, glm::normalize(glm::vec3(far_point) / far_point.w - from));
+          bvh.intersect(ray);
+          if (ray.triangle[0] >= 0)
+          {
+            float barycentric[3] = {1.0f - ray.u[0] - ray.v[0], ray.u[0], ray.v[0]};
+            int corner = (int)(std::max_element(barycentric, barycentric + 3) - barycentric);
+            std::cout << "Picked triangle " << ray.triangle[0] << ", vertex "
+                      << base_corners[ray.triangle[0] * 3 + corner] << std::endl;
+          }
+        }
+        left_was_pressed = left_pressed;
+      }
+
+      bool reblend = false;
+      if (tracker)
+      {
+        // the fitted pose places the head, the weights drive the blend
+        FrameTimer::Scope stage(frame_timer, STAGE_BLEND);
+        const LandmarkFit &fit = tracker->fit(track_frames[track_frame], options.solve);
+        track_frame = (track_frame + 1) % track_frames.size();
+        weights.assign(fit.weights.begin(), fit.weights.end());
+        model = glm::mat4(glm::mat3(fit.rotation));
+        model[3] = glm::vec4(glm::vec3(fit.translation), 1.0f);
+        reblend = true;
+      }
+      else if (next_weights && !weight_files.empty())
+      {
+        weights_index = (weights_index + 1) % weight_files.size();
+        std::cout << "Weights " << weight_files[weights_index].string() << std::endl;
+        FrameTimer::Scope stage(frame_timer, STAGE_BLEND);
+        weights = get_weights(weight_files[weights_index].string().c_str());
+        reblend = true;
+      }
+
+      if (reblend)
+      {
+        {
+          FrameTimer::Scope stage(frame_timer, STAGE_BLEND);
+          blend(vbuffer, nbuffer);
+        }
+        {
+          FrameTimer::Scope stage(frame_timer, STAGE_UPLOAD);
+          glBindBuffer(GL_ARRAY_BUFFER, VBO_vertices);
+          glBufferSubData(GL_ARRAY_BUFFER, 0, vbuffer.size() * sizeof(tinyobj::real_t), &vbuffer[0]);
+          glBindBuffer(GL_ARRAY_BUFFER, VBO_normals);
+          glBufferSubData(GL_ARRAY_BUFFER, 0, nbuffer.size() * sizeof(tinyobj::real_t), &nbuffer[0]);
+        }
+      }
+
+      {
+        FrameTimer::Scope stage(frame_timer, STAGE_DRAW);
+        frame_timer.begin_gpu();
+
+        // background color
+        glClearColor(0.3f, 0.4f, 0.5f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // one upload for the camera and one for all draws of this frame
+        camera_ubo.update({view, proj, glm::vec4(eye, 1.0f)});
+        model_ubo.clear();
+        size_t face_draw =
+            model_ubo.push({model, glm::transpose(glm::inverse(model))});
+        model_ubo.flush();
+
+        if (crowd)
+        {
+          // one instanced draw per level of detail in use
+          crowd_shader->use();
+          crowd->select_levels(eye, glm::radians(60.0f), (float)SCR_HEIGHT);
+          crowd->draw();
+        }
+        else
+        {
+          // activate shader
+          shader.use();
+          model_ubo.bind(face_draw);
+
+          // render container
+          glBindVertexArray(VAO);
+          glDrawArrays(GL_TRIANGLES, 0, vbuffer.size() / 3);
+        }
+
+        frame_timer.end_gpu();
+      }
+
+      // swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+      {
+        FrameTimer::Scope stage(frame_timer, STAGE_SWAP);
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+      }
+
+      frame_timer.end_frame();
+
+      // rolling percentiles in the title bar, twice a second
+      if (glfwGetTime() - title_time > 0.5)
+      {
+        title_time = glfwGetTime();
+        char title[192];
+        int prefix = std::snprintf(title, sizeof(title), "Facial Expressions | ");
+        frame_timer.summary(title + prefix, sizeof(title) - prefix);
+        glfwSetWindowTitle(window, title);
+      }
+    }
 
-    // render container
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, vbuffer.size() / 3);
+    if (!frame_log.empty())
+    {
+      frame_timer.write_csv(frame_log + ".csv");
+      frame_timer.write_json(frame_log + ".json");
+      frame_timer.write_chrome_trace(frame_log + ".trace.json");
+    }
+  }
 
-    // swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(window);
-    glfwPollEvents();
+  scheduler.wait_idle();
+  if (!trace_path.empty())
+  {
+    Trace::write_chrome_trace(trace_path);
+  }
+  if (MemTracker::compiled())
+  {
+    MemTracker::report(std::cout);
   }
 
   // terminate, clearing all previously allocated GLFW resources.
@@ -148,94 +601,356 @@ int main()
   return 0;
 }
 
-std::vector<Obj> load_face_objs(const std::string faces_path, const int num_faces)
+Options parse_options(int argc, char **argv)
 {
-  std::vector<Obj> face_objs;
-  for (int i = 0; i < num_faces; i++)
+  Options options;
+  int i = 1;
+  if (argc > 1 && (std::string(argv[1]) == "--batch" || std::string(argv[1]) == "--fit" ||
+                   std::string(argv[1]) == "--split-lr" || std::string(argv[1]) == "--crowd"))
   {
-    std::string file_name = faces_path + std::to_string(i) + ".obj";
-    Obj obj(file_name);
-    face_objs.push_back(obj);
+    options.mode = argv[i++];
   }
-
-  return face_objs;
+  for (; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    // flags with a value consume the next argument
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (arg == "--quantized")
+    {
+      options.quantized = true;
+    }
+    else if (arg == "--meshlets")
+    {
+      options.use_meshlets = true;
+    }
+    else if (i + 2 < argc && arg == "--track")
+    {
+      options.track_landmarks = argv[i + 1];
+      options.track_observations = argv[i + 2];
+      i += 2;
+    }
+    else if (value && arg == "--trace")
+    {
+      options.trace_path = value;
+      i++;
+    }
+    else if (value && arg == "--frame-log")
+    {
+      options.frame_log = value;
+      i++;
+    }
+    else if (value && arg == "--max-weight")
+    {
+      options.solve.upper = std::atof(value);
+      i++;
+    }
+    else if (value && arg == "--falloff")
+    {
+      options.falloff = std::max(1e-6, std::atof(value));
+      i++;
+    }
+    else if (value && arg == "--pca")
+    {
+      options.pca_tolerance = std::atof(value);
+      i++;
+    }
+    else if (value && arg == "--skin")
+    {
+      std::string method = value;
+      if (method == "lbs" || method == "dqs")
+      {
+        options.skin_method = method == "dqs" ? SKIN_DQS : SKIN_LBS;
+      }
+      else
+      {
+        std::cout << "ERROR::SKIN::UNKNOWN_METHOD: " << method << " (expected lbs or dqs)" << std::endl;
+      }
+      i++;
+    }
+    else if (value && arg == "--subdivide")
+    {
+      options.subdivision_level = std::max(1, std::atoi(value));
+      i++;
+    }
+    else if (arg.compare(0, 2, "--") != 0)
+    {
+      options.operands.push_back(arg);
+    }
+  }
+  return options;
 }
 
-std::vector<tinyobj::real_t> get_weights(const char *file_path)
+// load every *.weights file in weights_path, blend each against the shared
+// basis and write the results to out_path. Stage graph per file:
+//   weights -> (basis) -> blend + normals -> encode
+// When the rig declares drivers, *.controls files are blended too: their
+// drivers run for all of them in one batch pass before the basis stage.
+int run_batch(JobScheduler &scheduler, const std::string weights_path,
+              const std::string faces_path, const std::string out_path)
 {
-  std::vector<tinyobj::real_t> weights;
-
-  std::ifstream weights_file(file_path);
-
-  std::string line;
-  while (std::getline(weights_file, line))
+  RigManifest manifest = load_rig_manifest(faces_path);
+  DriverProgram drivers(manifest.controls, manifest.drivers);
+  std::vector<std::filesystem::path> weight_files = list_weight_files(weights_path);
+  size_t num_weight_files = weight_files.size();
+  if (!drivers.empty())
   {
-    std::istringstream line_stream(line);
-    tinyobj::real_t weight;
-
-    while (line_stream >> weight)
+    for (const auto &file : list_weight_files(weights_path, ".controls"))
     {
-      weights.push_back(weight);
+      weight_files.push_back(file);
     }
   }
+  std::filesystem::create_directories(out_path);
+
+  size_t count = weight_files.size();
+  size_t num_controls = drivers.num_controls();
+  std::vector<std::vector<tinyobj::real_t>> weights(count);
+  std::vector<double> controls((count - num_weight_files) * num_controls);
+  std::vector<TaskHandle> weight_tasks, control_tasks;
+  for (size_t i = 0; i < num_weight_files; i++)
+  {
+    weight_tasks.push_back(scheduler.async([&, i]()
+                                           { weights[i] = get_weights(weight_files[i].string().c_str()); }));
+  }
+  for (size_t i = num_weight_files; i < count; i++)
+  {
+    control_tasks.push_back(scheduler.async([&, i]()
+                                            {
+                                              std::vector<double> values = load_controls(weight_files[i].string(), drivers);
+                                              std::copy(values.begin(), values.end(),
+                                                        &controls[(i - num_weight_files) * num_controls]);
+                                            }));
+  }
+  if (!control_tasks.empty())
+  {
+    TaskHandle driven = scheduler.when_all(control_tasks, [&]()
+                                           {
+                                             size_t num_driven = count - num_weight_files;
+                                             size_t T = drivers.num_targets();
+                                             std::vector<double> driven_weights(num_driven * T, 0.0);
+                                             drivers.evaluate_batch(scheduler, controls.data(), num_driven,
+                                                                    driven_weights.data(), T);
+                                             for (size_t j = 0; j < num_driven; j++)
+                                             {
+                                               weights[num_weight_files + j].assign(&driven_weights[j * T],
+                                                                                    &driven_weights[(j + 1) * T]);
+                                             }
+                                           });
+    weight_tasks.resize(count, driven);
+  }
 
-  weights_file.close();
-  return weights;
+  // the basis needs the largest target count of all weight files
+  std::optional<Obj> base_obj;
+  std::vector<Obj> face_objs;
+  Rig rig;
+  TaskHandle basis = scheduler.when_all(weight_tasks, [&]()
+                                        {
+                                          size_t num_faces = 0;
+                                          for (const auto &w : weights)
+                                          {
+                                            num_faces = std::max(num_faces, w.size());
+                                          }
+                                          base_obj.emplace(faces_path + "base.obj");
+                                          face_objs = load_face_objs(scheduler, faces_path, num_faces);
+                                          rig = Rig(*base_obj, face_objs, manifest);
+                                        });
+
+  std::vector<std::vector<tinyobj::real_t>> vbuffers(count), nbuffers(count);
+  std::vector<TaskHandle> encode_tasks;
+  for (size_t i = 0; i < count; i++)
+  {
+    TaskHandle blend = scheduler.when_all({basis, weight_tasks[i]}, [&, i]()
+                                          { blend_shape(scheduler, *base_obj, face_objs, weights[i],
+                                                        vbuffers[i], nbuffers[i], &rig); });
+    encode_tasks.push_back(scheduler.then(blend, [&, i]()
+                                          {
+                                            std::filesystem::path file_path = std::filesystem::path(out_path) /
+                                                                              (weight_files[i].stem().string() + ".obj");
+                                            write_obj(file_path.string(), *base_obj, vbuffers[i], nbuffers[i]);
+                                            // release the expanded buffers as soon as they are written
+                                            std::vector<tinyobj::real_t>().swap(vbuffers[i]);
+                                            std::vector<tinyobj::real_t>().swap(nbuffers[i]);
+                                          }));
+  }
+
+  for (const auto &task : encode_tasks)
+  {
+    scheduler.wait(task);
+  }
+  std::cout << "Blended " << count << " weight files into " << out_path
+            << std::endl;
+  return 0;
 }
 
-void blend_shape(Obj base_obj, std::vector<Obj> face_objs,
-                 std::vector<tinyobj::real_t> weights,
-                 std::vector<tinyobj::real_t> &vbuffer,
-                 std::vector<tinyobj::real_t> &nbuffer)
+int run_fit(JobScheduler &scheduler, const std::string faces_path,
+            const std::string input_path, const std::string out_path,
+            const SolveOptions &options)
 {
-  std::vector<tinyobj::real_t> base_vertices = base_obj.getVertices();
-  std::vector<tinyobj::real_t> result_vertices = base_vertices;
+  std::vector<std::filesystem::path> mesh_files;
+  if (std::filesystem::is_directory(input_path))
+  {
+    for (const auto &entry : std::filesystem::directory_iterator(input_path))
+    {
+      if (entry.path().extension() == ".obj")
+      {
+        mesh_files.push_back(entry.path());
+      }
+    }
+    std::sort(mesh_files.begin(), mesh_files.end());
+  }
+  else
+  {
+    mesh_files.push_back(input_path);
+  }
 
-  for (size_t i = 0; i < weights.size(); i++)
+  // every consecutive <i>.obj target
+  int num_faces = 0;
+  while (std::filesystem::exists(faces_path + std::to_string(num_faces) + ".obj"))
+  {
+    num_faces++;
+  }
+  Obj base_obj(faces_path + "base.obj");
+  BlendBasis basis(base_obj, load_face_objs(scheduler, faces_path, num_faces));
+  WeightSolver solver(scheduler, basis);
+  if (!solver.well_posed())
   {
-    std::vector<tinyobj::real_t> face_vertices = face_objs[i].getVertices();
+    std::cout << "WARNING::FIT::BASIS_RANK_DEFICIENT: increase regularization" << std::endl;
+  }
 
-    assert(result_vertices.size() == face_vertices.size());
-    for (size_t j = 0; j < result_vertices.size(); j++)
+  std::vector<std::vector<tinyobj::real_t>> meshes(mesh_files.size());
+  scheduler.parallel_for(0, mesh_files.size(), 1, [&](size_t begin, size_t end)
+                         {
+                           for (size_t i = begin; i < end; i++)
+                           {
+                             meshes[i] = Obj(mesh_files[i].string()).getVertices();
+                           }
+                         });
+  for (size_t i = 0; i < meshes.size(); i++)
+  {
+    if (meshes[i].size() != base_obj.getVertices().size())
     {
-      result_vertices[j] += weights[i] * (face_vertices[j] - base_vertices[j]);
+      std::cout << "ERROR::FIT::TOPOLOGY_MISMATCH: " << mesh_files[i].string() << std::endl;
+      return 1;
     }
   }
 
-  std::vector<tinyobj::real_t> base_normals = base_obj.getNormals();
-  for (auto shape : base_obj.getShapes())
+  std::vector<std::vector<tinyobj::real_t>> weights;
+  solver.solve_batch(scheduler, meshes, weights, options);
+
+  std::filesystem::create_directories(out_path);
+  for (size_t i = 0; i < meshes.size(); i++)
   {
-    for (auto face : shape.mesh.indices)
-    {
-      int vid = face.vertex_index;
-      int nid = face.normal_index;
+    std::filesystem::path file_path = std::filesystem::path(out_path) /
+                                      (mesh_files[i].stem().string() + ".weights");
+    write_weights(file_path.string(), weights[i]);
+    std::cout << file_path.string() << ": rms error "
+              << solver.rms_error(meshes[i], weights[i]) << std::endl;
+  }
+  return 0;
+}
+
+// split every bilateral target of faces_path into <i>L.obj and <i>R.obj in
+// out_path; the symmetry map of the base is cached in faces_path
+int run_split(JobScheduler &scheduler, const std::string faces_path,
+              const std::string out_path, double falloff)
+{
+  int num_faces = 0;
+  while (std::filesystem::exists(faces_path + std::to_string(num_faces) + ".obj"))
+  {
+    num_faces++;
+  }
+  Obj base_obj(faces_path + "base.obj");
+  std::vector<Obj> face_objs = load_face_objs(scheduler, faces_path, num_faces);
+  const std::vector<tinyobj::real_t> &base = base_obj.getVertices();
 
-      vbuffer.push_back(result_vertices[vid * 3]);
-      vbuffer.push_back(result_vertices[vid * 3 + 1]);
-      vbuffer.push_back(result_vertices[vid * 3 + 2]);
+  const std::string cache_path = faces_path + "symmetry.cache";
+  SymmetryMap symmetry;
+  if (!symmetry.load(cache_path, base))
+  {
+    symmetry = SymmetryMap::build(scheduler, base);
+    symmetry.save(cache_path);
+  }
+  std::cout << "Symmetry plane x = " << symmetry.plane() << ", " << symmetry.num_paired()
+            << " of " << symmetry.size() << " vertices paired" << std::endl;
 
-      nbuffer.push_back(base_normals[nid * 3]);
-      nbuffer.push_back(base_normals[nid * 3 + 1]);
-      nbuffer.push_back(base_normals[nid * 3 + 2]);
+  // targets with at least a fifth of their motion on the weaker side
+  std::filesystem::create_directories(out_path);
+  std::vector<int> split;
+  for (int t = 0; t < num_faces; t++)
+  {
+    const std::vector<tinyobj::real_t> &target = face_objs[t].getVertices();
+    std::vector<tinyobj::real_t> delta(base.size());
+    for (size_t j = 0; j < base.size(); j++)
+    {
+      delta[j] = target[j] - base[j];
     }
+    if (symmetry.balance(base, delta) < 0.2)
+    {
+      continue;
+    }
+    split.push_back(t);
   }
+
+  scheduler.parallel_for(0, split.size(), 1, [&](size_t begin, size_t end)
+                         {
+                           for (size_t i = begin; i < end; i++)
+                           {
+                             int t = split[i];
+                             const std::vector<tinyobj::real_t> &target = face_objs[t].getVertices();
+                             std::vector<tinyobj::real_t> delta(base.size()), left, right;
+                             for (size_t j = 0; j < base.size(); j++)
+                             {
+                               delta[j] = target[j] - base[j];
+                             }
+                             symmetry.split(base, delta, falloff, left, right);
+                             for (size_t j = 0; j < base.size(); j++)
+                             {
+                               left[j] += base[j];
+                               right[j] += base[j];
+                             }
+                             std::filesystem::path path(out_path);
+                             write_shape_obj((path / (std::to_string(t) + "L.obj")).string(), base_obj, left);
+                             write_shape_obj((path / (std::to_string(t) + "R.obj")).string(), base_obj, right);
+                           }
+                         });
+  std::cout << "Split " << split.size() << " of " << num_faces << " targets into " << out_path
+            << std::endl;
+  return 0;
 }
 
 // process all input: query GLFW whether relevant keys are pressed/released this
-// frame and react accordingly
-void process_input(GLFWwindow *window)
+// frame and react accordingly; returns true when the next weights file is
+// requested
+bool process_input(GLFWwindow *window, JobScheduler &scheduler)
 {
   if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
     glfwSetWindowShouldClose(window, true);
 
+  // press n to switch to the next weights file (once per key press)
+  static bool n_was_pressed = false;
+  bool n_pressed = glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS;
+  bool next_weights = n_pressed && !n_was_pressed;
+  n_was_pressed = n_pressed;
+
+  // press t to write the trace collected so far
+  static bool t_was_pressed = false;
+  bool t_pressed = glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS;
+  if (t_pressed && !t_was_pressed && !trace_path.empty())
+  {
+    std::cout << "Trace " << trace_path << std::endl;
+    Trace::write_chrome_trace(trace_path);
+  }
+  t_was_pressed = t_pressed;
+
   // press p to capture screen
   if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
   {
     std::cout << "Capture Window " << ss_id << std::endl;
     int buffer_width, buffer_height;
     glfwGetFramebufferSize(window, &buffer_width, &buffer_height);
-    dump_framebuffer_to_ppm("tmp", buffer_width, buffer_height);
+    dump_framebuffer_to_ppm(scheduler, "tmp", buffer_width, buffer_height);
   }
+
+  return next_weights;
 }
 
 // glfw: whenever the window size changed (by OS or user resize) this callback
@@ -247,35 +962,25 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height)
   glViewport(0, 0, width, height);
 }
 
-void dump_framebuffer_to_ppm(std::string prefix, uint32_t width,
-                             uint32_t height)
+void dump_framebuffer_to_ppm(JobScheduler &scheduler, std::string prefix,
+                             uint32_t width, uint32_t height)
 {
+  TRACE_SCOPE("dump_framebuffer_to_ppm");
   int pixelChannel = 3;
   int totalPixelSize = pixelChannel * width * height * sizeof(GLubyte);
-  GLubyte *pixels = new GLubyte[totalPixelSize];
-  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+  MemScope mem_scope(MEM_CAPTURE);
+  auto pixels = std::make_shared<std::vector<GLubyte>>(totalPixelSize);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels->data());
 
   std::string fileName = prefix + std::to_string(ss_id) + ".ppm";
   std::filesystem::path filePath = std::filesystem::current_path() / fileName;
-  std::ofstream fout(filePath.string());
-
-  fout << "P3\n"
-       << width << " " << height << "\n"
-       << 255 << std::endl;
-  for (size_t i = 0; i < height; i++)
-  {
-    for (size_t j = 0; j < width; j++)
-    {
-      size_t cur = pixelChannel * ((height - i - 1) * width + j);
-      fout << (int)pixels[cur] << " " << (int)pixels[cur + 1] << " "
-           << (int)pixels[cur + 2] << " ";
-    }
-    fout << std::endl;
-  }
-
   ss_id++;
 
-  delete[] pixels;
-  fout.flush();
-  fout.close();
+  // the readback has to happen on the GL thread; encoding and writing do not
+  scheduler.async([pixels, filePath, width, height]()
+                  {
+                    MemScope mem_scope(MEM_CAPTURE);
+                    std::ofstream fout(filePath.string());
+                    fout << encode_ppm(pixels->data(), width, height);
+                  });
 }
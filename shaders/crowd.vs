@@ -0,0 +1,102 @@
+#version 330 core
+in int aVertexId;
+in mat4 aModel;
+
+out vec3 Normal;
+
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+    vec4 eye;
+};
+
+// texel v: base vertex v, texel (t + 1) * uNumVertices + v: delta of target t
+uniform samplerBuffer uPositions;
+uniform samplerBuffer uNormals;
+// uNumTargets weights per instance; a draw's instances start at row
+// uFirstInstance (GL 3.3 has no base instance)
+uniform samplerBuffer uWeights;
+uniform int uFirstInstance;
+uniform int uNumVertices;
+uniform int uNumTargets;
+
+// skinning after the blend, up to four joints per vertex (texel v of each)
+layout(std140) uniform Skin
+{
+    vec4 jointRows[3 * 64];
+    vec4 jointReal[64];
+    vec4 jointDual[64];
+};
+uniform isamplerBuffer uSkinJoints;
+uniform samplerBuffer uSkinWeights;
+uniform int uSkinMethod; // 0 none, 1 linear blend, 2 dual quaternion
+
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void skin(inout vec3 pos, inout vec3 normal)
+{
+    ivec4 joints = texelFetch(uSkinJoints, aVertexId);
+    vec4 weights = texelFetch(uSkinWeights, aVertexId);
+    if (uSkinMethod == 1)
+    {
+        vec4 rows[3] = vec4[3](vec4(0.0), vec4(0.0), vec4(0.0));
+        for (int k = 0; k < 4; k++)
+        {
+            for (int r = 0; r < 3; r++)
+            {
+                rows[r] += weights[k] * jointRows[joints[k] * 3 + r];
+            }
+        }
+        mat4x3 m = transpose(mat3x4(rows[0], rows[1], rows[2]));
+        pos = m * vec4(pos, 1.0);
+        normal = mat3(m) * normal;
+        return;
+    }
+
+    vec4 first = jointReal[joints.x];
+    vec4 real = vec4(0.0);
+    vec4 dual = vec4(0.0);
+    for (int k = 0; k < 4; k++)
+    {
+        vec4 q = jointReal[joints[k]];
+        float w = dot(q, first) < 0.0 ? -weights[k] : weights[k];
+        real += w * q;
+        dual += w * jointDual[joints[k]];
+    }
+    float inv = 1.0 / length(real);
+    real *= inv;
+    dual *= inv;
+    vec3 translation = 2.0 * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+    pos = rotate(real, pos) + translation;
+    normal = rotate(real, normal);
+}
+
+void main()
+{
+    vec3 pos = texelFetch(uPositions, aVertexId).xyz;
+    vec3 normal = texelFetch(uNormals, aVertexId).xyz;
+
+    int row = (uFirstInstance + gl_InstanceID) * uNumTargets;
+    for (int t = 0; t < uNumTargets; t++)
+    {
+        float w = texelFetch(uWeights, row + t).x;
+        if (w != 0.0)
+        {
+            int texel = (t + 1) * uNumVertices + aVertexId;
+            pos += w * texelFetch(uPositions, texel).xyz;
+            normal += w * texelFetch(uNormals, texel).xyz;
+        }
+    }
+
+    if (uSkinMethod != 0)
+    {
+        skin(pos, normal);
+    }
+
+    gl_Position = projection * view * aModel * vec4(pos, 1.0);
+    Normal = normalize(mat3(aModel) * normal);
+}
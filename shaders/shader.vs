@@ -4,12 +4,21 @@ in vec3 aNormal;
 
 out vec3 Normal;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+    vec4 eye;
+};
+
+layout(std140) uniform Model
+{
+    mat4 model;
+    mat4 normalMatrix;
+};
 
 void main()
 {
     gl_Position = projection * view * model * vec4(aPos, 1.0);
-    Normal = normalize(mat3(model) * aNormal);
+    Normal = normalize(mat3(normalMatrix) * aNormal);
 }